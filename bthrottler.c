@@ -29,6 +29,7 @@
 
 #include "dsock.h"
 #include "iol.h"
+#include "throttle.h"
 #include "utils.h"
 
 dsock_unique_id(bthrottler_type);
@@ -52,6 +53,18 @@ struct bthrottler_sock {
     size_t recv_remaining;
     int64_t recv_interval;
     int64_t recv_last;
+    /* Token bucket mode. Data are passed in chunks of at most 'quantum'
+       bytes. Zero quantum means that the direction is not throttled.
+       Zero rate of the bucket means that the socket has no limit of its
+       own and is throttled only by the group. */
+    struct throttle send_bucket;
+    size_t send_quantum;
+    struct throttle recv_bucket;
+    size_t recv_quantum;
+    struct throttle_group *group;
+    /* In adaptive mode the send rate follows the congestion downstream. */
+    struct throttle_aimd send_aimd;
+    int adaptive;
 };
 
 static void *bthrottler_hquery(struct hvfs *hvfs, const void *type) {
@@ -62,6 +75,49 @@ static void *bthrottler_hquery(struct hvfs *hvfs, const void *type) {
     return NULL;
 }
 
+static struct bthrottler_sock *bthrottler_alloc(void) {
+    struct bthrottler_sock *obj = malloc(sizeof(struct bthrottler_sock));
+    if(dsock_slow(!obj)) return NULL;
+    obj->hvfs.query = bthrottler_hquery;
+    obj->hvfs.close = bthrottler_hclose;
+    obj->bvfs.bsendl = bthrottler_bsendl;
+    obj->bvfs.brecvl = bthrottler_brecvl;
+    obj->s = -1;
+    obj->send_full = 0;
+    obj->recv_full = 0;
+    obj->send_quantum = 0;
+    obj->recv_quantum = 0;
+    obj->send_bucket.rate = 0;
+    obj->recv_bucket.rate = 0;
+    obj->group = NULL;
+    obj->adaptive = 0;
+    return obj;
+}
+
+/* Creates the handle and takes ownership of the underlying socket.
+   Deallocates the object in case of failure. */
+static int bthrottler_make(int s, struct bthrottler_sock *obj) {
+    int err;
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error1;}
+    /* Make a private copy of the underlying socket. */
+    obj->s = hdup(s);
+    if(dsock_slow(obj->s < 0)) {err = errno; goto error2;}
+    int rc = hclose(s);
+    dsock_assert(rc == 0);
+    return h;
+error2:
+    rc = hclose(h);
+    dsock_assert(rc == 0);
+    /* hclose() has already deallocated the object. */
+    errno = err;
+    return -1;
+error1:
+    free(obj);
+    errno = err;
+    return -1;
+}
+
 int bthrottler_attach(int s,
       uint64_t send_throughput, int64_t send_interval,
       uint64_t recv_throughput, int64_t recv_interval) {
@@ -73,49 +129,118 @@ int bthrottler_attach(int s,
     /* Check whether underlying socket is a bytestream. */
     if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
     /* Create the object. */
-    struct bthrottler_sock *obj = malloc(sizeof(struct bthrottler_sock));
+    struct bthrottler_sock *obj = bthrottler_alloc();
     if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
-    obj->hvfs.query = bthrottler_hquery;
-    obj->hvfs.close = bthrottler_hclose;
-    obj->bvfs.bsendl = bthrottler_bsendl;
-    obj->bvfs.brecvl = bthrottler_brecvl;
-    obj->s = -1;
-    obj->send_full = 0;
     if(send_throughput > 0) {
         obj->send_full = send_throughput * send_interval / 1000;
         obj->send_remaining = obj->send_full;
         obj->send_interval = send_interval;
         obj->send_last = now();
     }
-    obj->recv_full = 0;
     if(recv_throughput > 0) {
         obj->recv_full = recv_throughput * recv_interval / 1000;
         obj->recv_remaining = obj->recv_full;
         obj->recv_interval = recv_interval;
         obj->recv_last = now();
     }
-    /* Create the handle. */
-    int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {err = errno; goto error2;}
-    /* Make a private copy of the underlying socket. */
-    obj->s = hdup(s);
-    if(dsock_slow(obj->s < 0)) {err = errno; goto error3;}
-    int rc = hclose(s);
-    dsock_assert(rc == 0);
-    return h;
-error3:
-    rc = hclose(h);
-    dsock_assert(rc == 0);
-error2:
-    free(obj);
+    return bthrottler_make(s, obj);
 error1:
     errno = err;
     return -1;
 }
 
+/* Chunks are as big as the burst but at least one millisecond worth of data
+   given that's the resolution of the clock. Group's burst is ignored so that
+   the sockets in the group take turns frequently. */
+static size_t bthrottler_quantum(struct throttle *bucket,
+      struct throttle *group) {
+    size_t quantum = SIZE_MAX;
+    if(bucket->rate)
+        quantum = MAX(MAX(bucket->burst, bucket->rate / 1000), 1);
+    if(group && group->rate)
+        quantum = MIN(quantum, MAX(group->rate / 1000, 1));
+    return quantum == SIZE_MAX ? 0 : quantum;
+}
+
+static void bthrottler_adjust(struct bthrottler_sock *obj) {
+    struct throttle_group *grp = obj->group;
+    obj->send_quantum = bthrottler_quantum(&obj->send_bucket,
+        grp ? &grp->send : NULL);
+    obj->recv_quantum = bthrottler_quantum(&obj->recv_bucket,
+        grp ? &grp->recv : NULL);
+}
+
+int bthrottler_attach_bucket(int s,
+      uint64_t send_rate, uint64_t send_burst,
+      uint64_t recv_rate, uint64_t recv_burst) {
+    int err;
+    if(dsock_slow(send_rate > THROTTLE_MAXRATE ||
+          recv_rate > THROTTLE_MAXRATE)) {
+        err = EINVAL; goto error1;}
+    /* Check whether underlying socket is a bytestream. */
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct bthrottler_sock *obj = bthrottler_alloc();
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    if(send_rate > 0)
+        throttle_init(&obj->send_bucket, send_rate, send_burst);
+    if(recv_rate > 0)
+        throttle_init(&obj->recv_bucket, recv_rate, recv_burst);
+    bthrottler_adjust(obj);
+    return bthrottler_make(s, obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int bthrottler_attach_adaptive(int s, uint64_t minrate, uint64_t maxrate,
+      int64_t latency) {
+    int err;
+    if(dsock_slow(minrate == 0 || minrate > maxrate ||
+          maxrate > THROTTLE_MAXRATE || latency <= 0)) {
+        err = EINVAL; goto error1;}
+    /* Check whether underlying socket is a bytestream. */
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct bthrottler_sock *obj = bthrottler_alloc();
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    throttle_aimd_init(&obj->send_aimd, &obj->send_bucket, minrate, maxrate,
+        latency);
+    obj->adaptive = 1;
+    bthrottler_adjust(obj);
+    return bthrottler_make(s, obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int64_t bthrottler_rate(int s) {
+    struct bthrottler_sock *obj = hquery(s, bthrottler_type);
+    if(dsock_slow(!obj)) return -1;
+    return obj->send_bucket.rate;
+}
+
+int bthrottler_join(int s, int g) {
+    struct bthrottler_sock *obj = hquery(s, bthrottler_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Groups can't be combined with fixed-window throttling. */
+    if(dsock_slow(obj->send_full || obj->recv_full)) {
+        errno = EINVAL; return -1;}
+    struct throttle_group *grp = NULL;
+    if(g >= 0) {
+        grp = throttle_group_join(g);
+        if(dsock_slow(!grp)) return -1;
+    }
+    if(obj->group) throttle_group_leave(obj->group);
+    obj->group = grp;
+    bthrottler_adjust(obj);
+    return 0;
+}
+
 int bthrottler_detach(int s) {
     struct bthrottler_sock *obj = hquery(s, bthrottler_type);
     if(dsock_slow(!obj)) return -1;
+    if(obj->group) throttle_group_leave(obj->group);
     int u = obj->s;
     free(obj);
     return u;
@@ -126,13 +251,42 @@ static int bthrottler_bsendl(struct bsock_vfs *bvfs,
     struct bthrottler_sock *obj =
         dsock_cont(bvfs, struct bthrottler_sock, bvfs);
     /* If send-throttling is off forward the call. */
-    if(obj->send_full == 0) return bsendl(obj->s, first, last, deadline);
+    if(obj->send_full == 0 && obj->send_quantum == 0)
+        return bsendl(obj->s, first, last, deadline);
     /* Get rid of the corner case. */
     size_t bytes;
     int rc = iol_check(first, last, NULL, &bytes);
     if(dsock_slow(rc < 0)) return -1;
     if(dsock_slow(bytes == 0)) return 0;
     size_t pos = 0;
+    if(obj->send_quantum) {
+        /* Pass the data in small chunks so that they are spaced evenly. */
+        while(bytes) {
+            uint64_t tosend = MIN(bytes, obj->send_quantum);
+            struct throttle_group *grp = obj->group;
+            struct throttle *b[2] = {
+                obj->send_bucket.rate ? &obj->send_bucket : NULL,
+                grp && grp->send.rate ? &grp->send : NULL};
+            uint64_t units[2] = {tosend, tosend};
+            rc = throttle_acquire(b, units, 2, deadline);
+            if(dsock_slow(rc < 0)) return -1;
+            struct iol_slice slc;
+            iol_slice_init(&slc, first, last, pos, tosend);
+            int64_t start = now();
+            rc = bsendl(obj->s, &slc.first, slc.last, deadline);
+            iol_slice_term(&slc);
+            if(obj->adaptive && (rc == 0 || errno == ETIMEDOUT)) {
+                throttle_aimd_adjust(&obj->send_aimd, &obj->send_bucket,
+                    now() - start);
+                bthrottler_adjust(obj);
+            }
+            if(dsock_slow(rc < 0)) return -1;
+            if(grp) grp->send_units += tosend;
+            pos += tosend;
+            bytes -= tosend;
+        }
+        return 0;
+    }
     while(1) {
         /* If there's capacity send as much data as possible. */
         if(obj->send_remaining) {
@@ -162,13 +316,36 @@ static int bthrottler_brecvl(struct bsock_vfs *bvfs,
     struct bthrottler_sock *obj =
         dsock_cont(bvfs, struct bthrottler_sock, bvfs);
     /* If recv-throttling is off forward the call. */
-    if(obj->recv_full == 0) return brecvl(obj->s, first, last, deadline);
+    if(obj->recv_full == 0 && obj->recv_quantum == 0)
+        return brecvl(obj->s, first, last, deadline);
     /* Get rid of the corner case. */
     size_t bytes;
     int rc = iol_check(first, last, NULL, &bytes);
     if(dsock_slow(rc < 0)) return -1;
     if(dsock_slow(bytes == 0)) return 0;
     size_t pos = 0;
+    if(obj->recv_quantum) {
+        /* Read the data in small chunks so that they are spaced evenly. */
+        while(bytes) {
+            uint64_t torecv = MIN(bytes, obj->recv_quantum);
+            struct throttle_group *grp = obj->group;
+            struct throttle *b[2] = {
+                obj->recv_bucket.rate ? &obj->recv_bucket : NULL,
+                grp && grp->recv.rate ? &grp->recv : NULL};
+            uint64_t units[2] = {torecv, torecv};
+            rc = throttle_acquire(b, units, 2, deadline);
+            if(dsock_slow(rc < 0)) return -1;
+            struct iol_slice slc;
+            iol_slice_init(&slc, first, last, pos, torecv);
+            rc = brecvl(obj->s, &slc.first, slc.last, deadline);
+            iol_slice_term(&slc);
+            if(dsock_slow(rc < 0)) return -1;
+            if(grp) grp->recv_units += torecv;
+            pos += torecv;
+            bytes -= torecv;
+        }
+        return 0;
+    }
     while(1) {
         /* If there's capacity receive as much data as possible. */
         if(obj->recv_remaining) {
@@ -195,6 +372,7 @@ static int bthrottler_brecvl(struct bsock_vfs *bvfs,
 
 static void bthrottler_hclose(struct hvfs *hvfs) {
     struct bthrottler_sock *obj = (struct bthrottler_sock*)hvfs;
+    if(obj->group) throttle_group_leave(obj->group);
     if(dsock_fast(obj->s >= 0)) {
         int rc = hclose(obj->s);
         dsock_assert(rc == 0);
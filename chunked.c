@@ -0,0 +1,360 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsock.h"
+#include "http.h"
+#include "iol.h"
+#include "utils.h"
+
+dsock_unique_id(chunked_type);
+
+static void *chunked_hquery(struct hvfs *hvfs, const void *type);
+static void chunked_hclose(struct hvfs *hvfs);
+static int chunked_hdone(struct hvfs *hvfs, int64_t deadline);
+static int chunked_bsendl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static int chunked_brecvl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+
+/* Outgoing data smaller than 'batch' are collected in txbuf. Once they
+   would overflow it, the buffered data and the data being sent go out
+   as a single chunk, header and trailing CRLF included, in one call to
+   the underlying socket.
+
+   Incoming chunk payloads are received directly into the user's buffers.
+   Chunk headers are read with no read-ahead so that whatever follows
+   the last chunk stays in the underlying socket. CRLF after the payload
+   is read together with the beginning of the next chunk header. */
+
+/* Only so much of chunk header is kept. The rest are chunk extensions
+   which are ignored. */
+#define CHUNKED_MAXHDR 32
+
+struct chunked_sock {
+    struct hvfs hvfs;
+    struct bsock_vfs bvfs;
+    int s;
+    int txerr;
+    int rxerr;
+    size_t batch;
+    uint8_t *txbuf;
+    size_t txlen;
+    /* Some data were sent. */
+    int txused;
+    /* The last chunk was sent. */
+    int txdone;
+    /* Receiving has started. */
+    int rxused;
+    /* Bytes of the current incoming chunk not yet received. */
+    uint64_t rxrmn;
+    /* CRLF after the payload of the last chunk wasn't received yet. */
+    int rxcrlf;
+};
+
+static void *chunked_hquery(struct hvfs *hvfs, const void *type) {
+    struct chunked_sock *obj = (struct chunked_sock*)hvfs;
+    if(type == bsock_type) return &obj->bvfs;
+    if(type == chunked_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int chunked_attach(int s, size_t batch) {
+    int err;
+    /* Check whether underlying socket is a bytestream. */
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct chunked_sock *obj = malloc(sizeof(struct chunked_sock));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = chunked_hquery;
+    obj->hvfs.close = chunked_hclose;
+    obj->hvfs.done = chunked_hdone;
+    obj->bvfs.bsendl = chunked_bsendl;
+    obj->bvfs.brecvl = chunked_brecvl;
+    obj->s = s;
+    obj->txerr = 0;
+    obj->rxerr = 0;
+    obj->batch = batch;
+    obj->txbuf = NULL;
+    obj->txlen = 0;
+    obj->txused = 0;
+    obj->txdone = 0;
+    obj->rxused = 0;
+    obj->rxrmn = 0;
+    obj->rxcrlf = 0;
+    if(batch > 0) {
+        obj->txbuf = malloc(batch);
+        if(dsock_slow(!obj->txbuf)) {err = ENOMEM; goto error2;}
+    }
+    /* Create the handle. */
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error3;}
+    return h;
+error3:
+    free(obj->txbuf);
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Sends buffered data followed by the data from the iolist, if any,
+   as a single chunk. */
+static int chunked_sendchunk(struct chunked_sock *obj, struct iolist *first,
+      struct iolist *last, size_t len, int64_t deadline) {
+    size_t sz = obj->txlen + len;
+    if(sz == 0) return 0;
+    /* Chunk size in hex followed by CRLF. */
+    uint8_t hdr[sizeof(size_t) * 2 + 2];
+    size_t pos = sizeof(hdr) - 2;
+    do {
+        hdr[--pos] = "0123456789abcdef"[sz & 0xf];
+        sz >>= 4;
+    } while(sz);
+    hdr[sizeof(hdr) - 2] = '\r';
+    hdr[sizeof(hdr) - 1] = '\n';
+    struct iolist hiol = {hdr + pos, sizeof(hdr) - pos, NULL, 0};
+    struct iolist biol = {obj->txbuf, obj->txlen, NULL, 0};
+    struct iolist crlf = {(void*)"\r\n", 2, NULL, 0};
+    struct iolist *it = &hiol;
+    if(obj->txlen) {
+        it->iol_next = &biol;
+        it = &biol;
+    }
+    if(first) {
+        it->iol_next = first;
+        it = last;
+    }
+    it->iol_next = &crlf;
+    int rc = bsendl(obj->s, &hiol, &crlf, deadline);
+    if(first) last->iol_next = NULL;
+    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    obj->txlen = 0;
+    return 0;
+}
+
+static int chunked_bsendl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct chunked_sock *obj = dsock_cont(bvfs, struct chunked_sock, bvfs);
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    if(len == 0) return 0;
+    obj->txused = 1;
+    /* Small writes are coalesced. */
+    if(obj->txlen + len < obj->batch) {
+        iol_copy(first, obj->txbuf + obj->txlen);
+        obj->txlen += len;
+        return 0;
+    }
+    return chunked_sendchunk(obj, first, last, len, deadline);
+}
+
+int chunked_flush(int s, int64_t deadline) {
+    struct chunked_sock *obj = hquery(s, chunked_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    return chunked_sendchunk(obj, NULL, NULL, 0, deadline);
+}
+
+/* Sends the last chunk. There are no trailer fields. */
+static int chunked_hdone(struct hvfs *hvfs, int64_t deadline) {
+    struct chunked_sock *obj = (struct chunked_sock*)hvfs;
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = chunked_sendchunk(obj, NULL, NULL, 0, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    rc = bsend(obj->s, "0\r\n\r\n", 5, deadline);
+    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    obj->txdone = 1;
+    obj->txerr = EPIPE;
+    return 0;
+}
+
+/* Receives a line. The first min bytes are known to belong to the line.
+   If crlf is set, the line is preceded by CRLF which is checked and
+   dropped. At most len bytes of the line are stored into buf. Returns
+   full length of the line, excluding CRLF. */
+static ssize_t chunked_recvline(struct chunked_sock *obj, char *buf,
+      size_t len, int crlf, size_t min, int64_t deadline) {
+    uint8_t tmp[5];
+    size_t pre = crlf ? 2 : 0;
+    size_t n = pre + min;
+    dsock_assert(n <= sizeof(tmp));
+    size_t sz = 0;
+    uint8_t c1 = 0;
+    uint8_t c2 = 0;
+    while(1) {
+        int rc = brecv(obj->s, tmp, n, deadline);
+        if(dsock_slow(rc < 0)) {
+            /* The body can't end in the middle of a chunk. */
+            if(errno == EPIPE) errno = ECONNRESET;
+            obj->rxerr = errno;
+            return -1;
+        }
+        if(dsock_slow(pre && (tmp[0] != '\r' || tmp[1] != '\n'))) {
+            errno = obj->rxerr = EPROTO; return -1;}
+        size_t i;
+        for(i = pre; i != n; ++i) {
+            if(sz < len) buf[sz] = tmp[i];
+            ++sz;
+            c1 = c2;
+            c2 = tmp[i];
+        }
+        if(sz >= 2 && c1 == '\r' && c2 == '\n') return sz - 2;
+        /* Unless the last byte was CR, at least two more bytes follow. */
+        pre = 0;
+        n = c2 == '\r' ? 1 : 2;
+    }
+}
+
+/* Receives header of the next chunk. If it's the last chunk, trailer
+   fields are skipped and EPIPE is returned. */
+static int chunked_recvhdr(struct chunked_sock *obj, int64_t deadline) {
+    /* Shortest possible header is the size digit followed by CRLF. */
+    char hdr[CHUNKED_MAXHDR];
+    ssize_t sz = chunked_recvline(obj, hdr, sizeof(hdr), obj->rxcrlf, 3,
+        deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    obj->rxcrlf = 0;
+    sz = MIN(sz, sizeof(hdr));
+    uint64_t rmn = 0;
+    ssize_t i;
+    for(i = 0; i != sz; ++i) {
+        char c = hdr[i];
+        int d;
+        if(c >= '0' && c <= '9') d = c - '0';
+        else if(c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else break;
+        /* Chunk size is limited to 60 bits. */
+        if(dsock_slow(i >= 15)) {errno = obj->rxerr = EPROTO; return -1;}
+        rmn = (rmn << 4) | d;
+    }
+    /* Size may be followed only by chunk extensions. */
+    if(dsock_slow(i == 0 || (i != sz && hdr[i] != ';' && hdr[i] != ' ' &&
+          hdr[i] != '\t'))) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    if(rmn > 0) {
+        obj->rxrmn = rmn;
+        obj->rxcrlf = 1;
+        return 0;
+    }
+    /* The last chunk. Skip the trailer up to the empty line. */
+    while(1) {
+        sz = chunked_recvline(obj, NULL, 0, 0, 2, deadline);
+        if(dsock_slow(sz < 0)) return -1;
+        if(sz == 0) break;
+    }
+    /* Next message may follow on HTTP connection. */
+    http_bodyend(obj->s);
+    errno = obj->rxerr = EPIPE;
+    return -1;
+}
+
+static int chunked_brecvl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct chunked_sock *obj = dsock_cont(bvfs, struct chunked_sock, bvfs);
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->rxused = 1;
+    size_t pos = 0;
+    while(pos < len) {
+        if(obj->rxrmn == 0) {
+            rc = chunked_recvhdr(obj, deadline);
+            if(dsock_slow(rc < 0)) return -1;
+        }
+        size_t sz = MIN(len - pos, obj->rxrmn);
+        struct iol_slice slc;
+        iol_slice_init(&slc, first, last, pos, sz);
+        rc = brecvl(obj->s, &slc.first, slc.last, deadline);
+        iol_slice_term(&slc);
+        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+        pos += sz;
+        obj->rxrmn -= sz;
+    }
+    return 0;
+}
+
+int64_t chunked_chunklen(int s, int64_t deadline) {
+    struct chunked_sock *obj = hquery(s, chunked_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    obj->rxused = 1;
+    if(obj->rxrmn == 0) {
+        int rc = chunked_recvhdr(obj, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    return obj->rxrmn;
+}
+
+static void chunked_free(struct chunked_sock *obj) {
+    free(obj->txbuf);
+    free(obj);
+}
+
+int chunked_detach(int s, int64_t deadline) {
+    struct chunked_sock *obj = hquery(s, chunked_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Terminate the body if it was sent through this socket. */
+    if(obj->txused && !obj->txdone) {
+        int rc = chunked_hdone(&obj->hvfs, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    /* If the body was being received through this socket, skip the rest
+       of it so that the underlying socket is left at the end of the last
+       chunk. */
+    if(obj->rxused) {
+        while(!obj->rxerr) {
+            if(obj->rxrmn) {
+                struct iolist iol = {NULL, obj->rxrmn, NULL, 0};
+                int rc = brecvl(obj->s, &iol, &iol, deadline);
+                if(dsock_slow(rc < 0)) {obj->rxerr = errno; break;}
+                obj->rxrmn = 0;
+            }
+            chunked_recvhdr(obj, deadline);
+        }
+        if(dsock_slow(obj->rxerr != EPIPE)) {errno = obj->rxerr; return -1;}
+    }
+    int u = obj->s;
+    chunked_free(obj);
+    return u;
+}
+
+static void chunked_hclose(struct hvfs *hvfs) {
+    struct chunked_sock *obj = (struct chunked_sock*)hvfs;
+    int rc = hclose(obj->s);
+    dsock_assert(rc == 0);
+    chunked_free(obj);
+}
+
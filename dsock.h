@@ -101,8 +101,41 @@ DSOCK_EXPORT ssize_t udp_recvl(
 
 /******************************************************************************/
 /*  HTTP                                                                      */
+/*  The *v variants of the receiving functions don't copy anything. They      */
+/*  return views into the socket's receive buffer that stay valid until the   */
+/*  next receive operation on the socket.                                     */
+/*  http_recvheaders receives all the remaining fields up to the end of the   */
+/*  header and returns them as an array of views. The array and the fields    */
+/*  are stored in a per-connection arena. Its size, 16kB by default, can be   */
+/*  changed by http_headerlimit. Bigger headers fail with EMSGSIZE.           */
+/*  Lines are read from the underlying bytestream with no read-ahead, so      */
+/*  several messages can follow each other on one connection. The price is    */
+/*  many small reads: http_recvheaders asks for at most 4 bytes at a time,    */
+/*  the other functions for at most 2. E.g. 540 bytes of fields sent by a     */
+/*  web browser take 138 brecv calls (271 when read line by line). hdone ends */
+/*  the header being sent. Once the header is received the HTTP socket works  */
+/*  as a bytestream carrying the body. Incoming body is limited by            */
+/*  Content-Length; http_bodylen returns the number of its bytes not received */
+/*  yet, or fails with ENOTSUP if the length isn't known. Unread part of the  */
+/*  body is skipped when the next message is received. Body of unknown length */
+/*  can't be skipped. Unless it was received in full by a chunked socket,     */
+/*  receiving the next message fails with EPROTO.                             */
+/*  Responses to HEAD, and 2xx responses to CONNECT, have no body whatever    */
+/*  their fields say. To recognise them the socket remembers the methods of   */
+/*  the requests sent but not answered yet. There can be at most 64 of them;  */
+/*  sending one more request fails with EBUSY.                                */
 /******************************************************************************/
 
+struct http_view {
+    const char *base;
+    size_t len;
+};
+
+struct http_field {
+    struct http_view name;
+    struct http_view value;
+};
+
 DSOCK_EXPORT int http_attach(
     int s);
 DSOCK_EXPORT int http_detach(
@@ -120,6 +153,11 @@ DSOCK_EXPORT int http_recvrequest(
     char *resource,
     size_t resourcelen,
     int64_t deadline);
+DSOCK_EXPORT int http_recvrequestv(
+    int s,
+    struct http_view *command,
+    struct http_view *resource,
+    int64_t deadline);
 DSOCK_EXPORT int http_sendstatus(
     int s,
     int status,
@@ -130,6 +168,10 @@ DSOCK_EXPORT int http_recvstatus(
     char *reason,
     size_t reasonlen,
     int64_t deadline);
+DSOCK_EXPORT int http_recvstatusv(
+    int s,
+    struct http_view *reason,
+    int64_t deadline);
 DSOCK_EXPORT int http_sendfield(
     int s,
     const char *name,
@@ -142,17 +184,130 @@ DSOCK_EXPORT int http_recvfield(
     char *value,
     size_t valuelen,
     int64_t deadline);
+DSOCK_EXPORT int http_recvfieldv(
+    int s,
+    struct http_view *name,
+    struct http_view *value,
+    int64_t deadline);
+DSOCK_EXPORT int http_headerlimit(
+    int s,
+    size_t limit);
+DSOCK_EXPORT ssize_t http_recvheaders(
+    int s,
+    struct http_field **fields,
+    int64_t deadline);
+DSOCK_EXPORT int64_t http_bodylen(
+    int s);
+
+/******************************************************************************/
+/*  Chunked transfer encoding.                                                */
+/*  Bytestream carrying HTTP body in chunked encoding. It's meant to be       */
+/*  attached to HTTP socket once the header was sent or received. Writes      */
+/*  smaller than 'batch' are coalesced into bigger chunks; chunked_flush      */
+/*  sends what's buffered. hdone sends the last chunk. Receiving fails with   */
+/*  EPIPE once the last chunk arrives. Data received by a call that hits the  */
+/*  end of the body are lost. To read a body of unknown size, use             */
+/*  chunked_chunklen. It returns the number of bytes left in the current      */
+/*  chunk, receiving the header of the next chunk if needed, and fails with   */
+/*  EPIPE at the end of the body. chunked_detach sends the last chunk if any  */
+/*  data were sent and it wasn't sent yet. If the body was being received, it */
+/*  skips the rest of it so that the next message can be read from the        */
+/*  underlying socket.                                                        */
+/******************************************************************************/
+
+DSOCK_EXPORT int chunked_attach(
+    int s,
+    size_t batch);
+DSOCK_EXPORT int chunked_flush(
+    int s,
+    int64_t deadline);
+DSOCK_EXPORT int64_t chunked_chunklen(
+    int s,
+    int64_t deadline);
+DSOCK_EXPORT int chunked_detach(
+    int s,
+    int64_t deadline);
 
 /******************************************************************************/
 /*  WebSocket protocol.                                                       */
+/*  If websock_inplace is turned on, client masks outgoing messages in place, */
+/*  i.e. content of the buffers passed to msend is undefined afterwards.      */
+/*  websock_sendfrag sends a message in pieces, one frame per call, fin set   */
+/*  in the last call. websock_recvfrag receives a message in pieces of at     */
+/*  most len bytes and sets fin once the end of the message is reached.       */
+/*  msend and mrecv fail with EBUSY while such message is in progress.        */
+/*  websock_frame encodes a message once and returns a handle to it.          */
+/*  websock_broadcast sends it to a list of server-side sockets. The sockets  */
+/*  are sent to concurrently, so a slow peer doesn't hold up the others. If   */
+/*  sending to some of them fails, the rest still get the message and one of  */
+/*  the errors is reported.                                                   */
+/*  Pings are answered and close frames are acknowledged while receiving.     */
+/*  Once the peer closes the connection receiving fails with EPIPE.           */
+/*  websock_detach performs the closing handshake. websock_heartbeat sends    */
+/*  a ping if nothing was sent for interval milliseconds and fails receiving  */
+/*  with ECONNRESET if nothing arrives for timeout milliseconds. Negative     */
+/*  values switch either of them off.                                         */
+/*  If websock_utf8 is turned on, text messages that are not valid UTF-8 are  */
+/*  rejected with EPROTO and the connection is closed.                        */
+/*  websock_compress offers LZ4 compression of messages to the peer. Both     */
+/*  peers should call it straight after websock_attach. Once both have done   */
+/*  so, messages sent by msend that are at least threshold bytes long are     */
+/*  compressed if that makes them notably smaller. Compressed messages can be */
+/*  received only by mrecv; websock_recvfrag fails with ENOTSUP.              */
 /******************************************************************************/
 
 DSOCK_EXPORT int websock_attach(
     int s,
     int client);
+DSOCK_EXPORT int websock_inplace(
+    int s,
+    int inplace);
+DSOCK_EXPORT int websock_utf8(
+    int s,
+    int utf8);
+DSOCK_EXPORT int websock_compress(
+    int s,
+    size_t threshold,
+    int64_t deadline);
+DSOCK_EXPORT int websock_sendfrag(
+    int s,
+    const void *buf,
+    size_t len,
+    int fin,
+    int64_t deadline);
+DSOCK_EXPORT int websock_sendfragl(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int fin,
+    int64_t deadline);
+DSOCK_EXPORT ssize_t websock_recvfrag(
+    int s,
+    void *buf,
+    size_t len,
+    int *fin,
+    int64_t deadline);
+DSOCK_EXPORT ssize_t websock_recvfragl(
+    int s,
+    struct iolist *first,
+    struct iolist *last,
+    int *fin,
+    int64_t deadline);
+DSOCK_EXPORT int websock_frame(
+    const void *buf,
+    size_t len);
+DSOCK_EXPORT int websock_broadcast(
+    int frame,
+    const int *socks,
+    size_t nsocks,
+    int64_t deadline);
 DSOCK_EXPORT int websock_detach(
     int s,
     int64_t deadline);
+DSOCK_EXPORT int websock_heartbeat(
+    int s,
+    int64_t interval,
+    int64_t timeout);
 
 /******************************************************************************/
 /*  NaCl encryption and authentication protocol.                              */
@@ -201,21 +356,84 @@ DSOCK_EXPORT int mtrace_detach(
 /*  Nagle's algorithm for bytestreams.                                        */
 /*  Delays small sends until buffer of size 'batch' is full or timeout        */
 /*  'interval' expires.                                                       */
+/*  In adaptive mode batch size and interval are tuned automatically within   */
+/*  the specified bounds, based on rate of the writes and on the time it      */
+/*  takes to send the data to the underlying socket. Low latency is preferred */
+/*  when the socket is idle, big batches are used under load.                 */
+/*  Buffered data are sent only by hdone and nagle_detach. Closing the        */
+/*  socket drops any data that haven't been flushed yet.                      */
+/*  Full batches are sent by a background coroutine while the user fills      */
+/*  the next one. The coroutine is started even if the interval is infinite.  */
+/*  Errors are sticky. Once sending to the underlying socket fails, including */
+/*  a timeout in hdone or nagle_detach, all the following operations fail     */
+/*  with the same error, nagle_detach included. Part of a batch may have been */
+/*  sent to the underlying socket by then, so the socket can only be closed.  */
 /******************************************************************************/
 
+struct nagle_stats {
+    /* Current batch size. */
+    size_t batch;
+    /* Current flush interval. */
+    int64_t interval;
+    /* Number of flushes because the buffer was full. */
+    uint64_t size_flushes;
+    /* Number of flushes because the interval expired. */
+    uint64_t timeout_flushes;
+    /* Number of large writes that were sent without buffering. */
+    uint64_t bypasses;
+};
+
 DSOCK_EXPORT int nagle_attach(
     int s,
     size_t batch,
     int64_t interval);
+DSOCK_EXPORT int nagle_attach_adaptive(
+    int s,
+    size_t minbatch,
+    size_t maxbatch,
+    int64_t mininterval,
+    int64_t maxinterval);
+DSOCK_EXPORT int nagle_stats(
+    int s,
+    struct nagle_stats *stats);
 DSOCK_EXPORT int nagle_detach(
     int s, int64_t deadline);
 
+/******************************************************************************/
+/*  Message batching.                                                         */
+/*  Packs consecutive small messages into a single underlying message of up   */
+/*  to 'maxbytes' bytes. The batch is sent when there's no space left for the */
+/*  next message or when 'maxdelay' milliseconds have passed since the first  */
+/*  message was put into it. Zero 'maxdelay' disables batching, negative      */
+/*  value means that the batch is sent only once it's full. Both peers should */
+/*  use the same 'maxbytes'. Messages that don't fit into a batch on their    */
+/*  own can't be sent.                                                        */
+/*  Apart from that, the pending batch is flushed only by hdone and           */
+/*  mbatch_detach. Closing the socket drops it.                               */
+/******************************************************************************/
+
+DSOCK_EXPORT int mbatch_attach(
+    int s,
+    size_t maxbytes,
+    int64_t maxdelay);
+DSOCK_EXPORT int mbatch_detach(
+    int s,
+    int64_t deadline);
+
 /******************************************************************************/
 /*  Bytestream throttler.                                                     */
 /*  Throttles the outbound bytestream to send_throughput bytes per second.    */
 /*  Sending quota is recomputed every send_interval milliseconds.             */
 /*  Throttles the inbound bytestream to recv_throughput bytes per second.     */
 /*  Receiving quota is recomputed every recv_interval milliseconds.           */
+/*  In token bucket mode data are paced evenly at 'rate' bytes per second.    */
+/*  Up to 'burst' bytes can be passed at once after the socket was idle.      */
+/*  Zero rate means that the direction is not throttled.                      */
+/*  In adaptive mode the send rate is adjusted between 'minrate' and          */
+/*  'maxrate' based on how long it takes to pass the data to the underlying   */
+/*  socket. If it takes more than 'latency' milliseconds the rate is halved,  */
+/*  otherwise it is slowly increased. bthrottler_rate() returns the current   */
+/*  send rate.                                                                */
 /******************************************************************************/
 
 DSOCK_EXPORT int bthrottler_attach(
@@ -224,6 +442,19 @@ DSOCK_EXPORT int bthrottler_attach(
     int64_t send_interval,
     uint64_t recv_throughput,
     int64_t recv_interval);
+DSOCK_EXPORT int bthrottler_attach_bucket(
+    int s,
+    uint64_t send_rate,
+    uint64_t send_burst,
+    uint64_t recv_rate,
+    uint64_t recv_burst);
+DSOCK_EXPORT int bthrottler_attach_adaptive(
+    int s,
+    uint64_t minrate,
+    uint64_t maxrate,
+    int64_t latency);
+DSOCK_EXPORT int64_t bthrottler_rate(
+    int s);
 DSOCK_EXPORT int bthrottler_detach(
     int s);
 
@@ -233,6 +464,15 @@ DSOCK_EXPORT int bthrottler_detach(
 /*  Sending quota is recomputed every send_interval milliseconds.             */
 /*  Throttles receive operations to recv_throughput messages per second.      */
 /*  Receiving quota is recomputed every recv_interval milliseconds.           */
+/*  In token bucket mode messages are paced evenly at 'rate' messages per     */
+/*  second. Up to 'burst' messages can be passed at once after the socket     */
+/*  was idle. Zero rate means that the direction is not throttled.            */
+/*  In dual mode both the number of messages and the number of bytes per      */
+/*  second are limited. Up to 'interval' milliseconds worth of traffic can    */
+/*  be passed at once.                                                        */
+/*  In adaptive mode the send rate is adjusted between 'minrate' and          */
+/*  'maxrate' messages per second based on how long it takes to pass the      */
+/*  message to the underlying socket. See bthrottler for details.             */
 /******************************************************************************/
 
 DSOCK_EXPORT int mthrottler_attach(
@@ -241,20 +481,110 @@ DSOCK_EXPORT int mthrottler_attach(
     int64_t send_interval,
     uint64_t recv_throughput,
     int64_t recv_interval);
+DSOCK_EXPORT int mthrottler_attach_bucket(
+    int s,
+    uint64_t send_rate,
+    uint64_t send_burst,
+    uint64_t recv_rate,
+    uint64_t recv_burst);
+DSOCK_EXPORT int mthrottler_attach_dual(
+    int s,
+    uint64_t send_throughput,
+    uint64_t send_bytes,
+    int64_t send_interval,
+    uint64_t recv_throughput,
+    uint64_t recv_bytes,
+    int64_t recv_interval);
+DSOCK_EXPORT int mthrottler_attach_adaptive(
+    int s,
+    uint64_t minrate,
+    uint64_t maxrate,
+    int64_t latency);
+DSOCK_EXPORT int64_t mthrottler_rate(
+    int s);
 DSOCK_EXPORT int mthrottler_detach(
     int s);
 
+/******************************************************************************/
+/*  Throttler groups.                                                         */
+/*  Limits the aggregate throughput of multiple throttled sockets. Sockets    */
+/*  in token bucket mode can join a group using bthrottler_join() or          */
+/*  mthrottler_join(). Each socket is limited both by its own rate and by     */
+/*  the rate of the group. The group's capacity is shared fairly among its    */
+/*  members. Group counts bytes for bytestream throttlers and messages for    */
+/*  message throttlers, so the two should not be mixed in a single group.     */
+/*  Group is deallocated when it is closed and all the sockets left it.       */
+/*  Passing -1 instead of a group handle removes the socket from its group.   */
+/******************************************************************************/
+
+struct throttler_group_stats {
+    /* Number of sockets in the group. */
+    size_t sockets;
+    /* Bytes or messages passed through the group. */
+    uint64_t send_units;
+    uint64_t recv_units;
+    /* How far ahead the capacity of the group is reserved, in milliseconds. */
+    int64_t send_backlog;
+    int64_t recv_backlog;
+};
+
+DSOCK_EXPORT int throttler_group(
+    uint64_t send_rate,
+    uint64_t send_burst,
+    uint64_t recv_rate,
+    uint64_t recv_burst);
+DSOCK_EXPORT int throttler_group_stats(
+    int g,
+    struct throttler_group_stats *stats);
+DSOCK_EXPORT int bthrottler_join(
+    int s,
+    int g);
+DSOCK_EXPORT int mthrottler_join(
+    int s,
+    int g);
+
 /******************************************************************************/
 /*  Keep-alives.                                                              */
 /*  If there's no messages being sent a keep-alive is sent once every         */
 /*  send_interval milliseconds. If no message or keep-alive is received for   */
 /*  recv_interval milliseconds an error is reported.                          */
+/*  keepalive_ping starts sending timestamped pings once every interval       */
+/*  milliseconds. Peer's keepalive layer echoes them back while it's          */
+/*  receiving and round-trip time statistics are updated on arrival.          */
+/*  keepalive_detector turns on phi accrual failure detection. Suspicion      */
+/*  level is computed from the distribution of gaps between the keep-alives   */
+/*  and an error is reported when it exceeds the threshold. Zero turns the    */
+/*  detector off. recv_interval still applies as an upper bound.              */
 /******************************************************************************/
 
+struct keepalive_stats {
+    /* Last measured round-trip time, in microseconds. */
+    int64_t rtt;
+    /* Smoothed round-trip time, in microseconds. */
+    int64_t srtt;
+    /* Minimal round-trip time, in microseconds. */
+    int64_t minrtt;
+    /* Smoothed variation of round-trip time, in microseconds. */
+    int64_t jitter;
+    /* Number of pongs received. */
+    uint64_t samples;
+};
+
 DSOCK_EXPORT int keepalive_attach(
     int s,
     int64_t send_interval,
     int64_t recv_interval);
+DSOCK_EXPORT int keepalive_ping(
+    int s,
+    int64_t interval);
+DSOCK_EXPORT int keepalive_stats(
+    int s,
+    struct keepalive_stats *stats);
+DSOCK_EXPORT int keepalive_detector(
+    int s,
+    double threshold);
+DSOCK_EXPORT double keepalive_suspicion(
+    int s);
 DSOCK_EXPORT int keepalive_detach(
     int s);
 
@@ -461,5 +791,34 @@ DSOCK_EXPORT const char *btls_connversion(
 
 DSOCK_EXPORT int inproc_pair(int fds[2]);
 
+/******************************************************************************/
+/*  Shared memory sockets.                                                    */
+/*  Message-based transport between two processes on the same machine.        */
+/*  Messages are passed through a pair of ring buffers in shared memory.      */
+/*  The shared memory is set up by passing file descriptors over 'fd', which  */
+/*  must be a connected UNIX domain socket. The connecting side chooses the   */
+/*  size of the ring buffers. Messages larger than half of the buffer size    */
+/*  are rejected with EMSGSIZE.                                               */
+/*  'fd' is not needed once the function returns and can be closed.           */
+/*  shmem_borrow receives the next message without copying it. It returns     */
+/*  the size of the message and points 'buf' to the message in the ring. The  */
+/*  message stays valid until shmem_release is called. While a message is     */
+/*  borrowed, mrecv and shmem_borrow fail with EBUSY.                         */
+/******************************************************************************/
+
+DSOCK_EXPORT int shmem_connect(
+    int fd,
+    size_t bufsz,
+    int64_t deadline);
+DSOCK_EXPORT int shmem_accept(
+    int fd,
+    int64_t deadline);
+DSOCK_EXPORT ssize_t shmem_borrow(
+    int s,
+    const void **buf,
+    int64_t deadline);
+DSOCK_EXPORT int shmem_release(
+    int s);
+
 #endif
 
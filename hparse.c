@@ -0,0 +1,179 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define DSOCK_HPARSE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "hparse.h"
+#include "utils.h"
+
+/* Header lines are split at spaces and colons. Kernels look for two
+   delimiters at once so that a single pass over field name finds either
+   the colon or the stray space. */
+
+typedef size_t (*hparse_fn)(const char *buf, size_t len, char a, char b);
+
+static size_t hparse_scalar(const char *buf, size_t len, char a, char b) {
+    size_t i;
+    for(i = 0; i != len; ++i)
+        if(buf[i] == a || buf[i] == b) break;
+    return i;
+}
+
+#if defined DSOCK_HPARSE_X86
+
+__attribute__((target("sse2")))
+static size_t hparse_sse2(const char *buf, size_t len, char a, char b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    size_t pos = 0;
+    while(len - pos >= 16) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(buf + pos));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(w, va),
+            _mm_cmpeq_epi8(w, vb)));
+        if(m) return pos + __builtin_ctz(m);
+        pos += 16;
+    }
+    return pos + hparse_scalar(buf + pos, len - pos, a, b);
+}
+
+__attribute__((target("avx2")))
+static size_t hparse_avx2(const char *buf, size_t len, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    size_t pos = 0;
+    while(len - pos >= 32) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)(buf + pos));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(w, va), _mm256_cmpeq_epi8(w, vb)));
+        if(m) return pos + __builtin_ctz(m);
+        pos += 32;
+    }
+    return pos + hparse_sse2(buf + pos, len - pos, a, b);
+}
+
+#endif
+
+static hparse_fn hparse_kernel(void) {
+    static hparse_fn kernel = NULL;
+    /* Racing threads would store the same value so there's no need
+       for synchronisation. */
+    if(dsock_fast(kernel)) return kernel;
+#if defined DSOCK_HPARSE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) kernel = hparse_avx2;
+    else if(__builtin_cpu_supports("sse2")) kernel = hparse_sse2;
+    else kernel = hparse_scalar;
+#else
+    kernel = hparse_scalar;
+#endif
+    return kernel;
+}
+
+size_t hparse_find(const char *buf, size_t len, char a, char b) {
+    /* Short tokens such as method names are not worth the setup. */
+    if(len < 16) return hparse_scalar(buf, len, a, b);
+    return hparse_kernel()(buf, len, a, b);
+}
+
+static const char *hparse_lstrip(const char *pos, const char *end) {
+    while(pos != end && *pos == ' ') ++pos;
+    return pos;
+}
+
+static const char *hparse_rstrip(const char *pos, const char *end) {
+    while(end != pos && *(end - 1) == ' ') --end;
+    return end;
+}
+
+/* Parses a token terminated by a space. Returns pointer to the space. */
+static const char *hparse_token(const char *pos, const char *end,
+      struct http_view *token) {
+    size_t n = hparse_find(pos, end - pos, ' ', ' ');
+    if(dsock_slow(n == 0 || pos + n == end)) return NULL;
+    token->base = pos;
+    token->len = n;
+    return pos + n;
+}
+
+int hparse_request(const char *line, size_t len,
+      struct http_view *command, struct http_view *resource) {
+    const char *end = line + len;
+    const char *pos = hparse_lstrip(line, end);
+    pos = hparse_token(pos, end, command);
+    if(dsock_slow(!pos)) {errno = EPROTO; return -1;}
+    pos = hparse_token(hparse_lstrip(pos, end), end, resource);
+    if(dsock_slow(!pos)) {errno = EPROTO; return -1;}
+    pos = hparse_lstrip(pos, end);
+    end = hparse_rstrip(pos, end);
+    if(dsock_slow(end - pos != 8 || memcmp(pos, "HTTP/1.1", 8) != 0)) {
+        errno = EPROTO; return -1;}
+    return 0;
+}
+
+int hparse_status(const char *line, size_t len, struct http_view *reason) {
+    const char *end = line + len;
+    const char *pos = hparse_lstrip(line, end);
+    struct http_view token;
+    pos = hparse_token(pos, end, &token);
+    if(dsock_slow(!pos)) {errno = EPROTO; return -1;}
+    if(dsock_slow(token.len != 8 || memcmp(token.base, "HTTP/1.1", 8) != 0)) {
+        errno = EPROTO; return -1;}
+    pos = hparse_token(hparse_lstrip(pos, end), end, &token);
+    if(dsock_slow(!pos || token.len != 3)) {errno = EPROTO; return -1;}
+    int status = 0;
+    size_t i;
+    for(i = 0; i != 3; ++i) {
+        if(dsock_slow(token.base[i] < '0' || token.base[i] > '9')) {
+            errno = EPROTO; return -1;}
+        status = status * 10 + (token.base[i] - '0');
+    }
+    pos = hparse_lstrip(pos, end);
+    reason->base = pos;
+    reason->len = end - pos;
+    return status;
+}
+
+int hparse_field(const char *line, size_t len,
+      struct http_view *name, struct http_view *value) {
+    const char *end = line + len;
+    const char *pos = hparse_lstrip(line, end);
+    size_t n = hparse_find(pos, end - pos, ':', ' ');
+    if(dsock_slow(n == 0 || pos + n == end)) {errno = EPROTO; return -1;}
+    name->base = pos;
+    name->len = n;
+    /* No whitespace is allowed between the field name and the colon. */
+    pos += n;
+    if(dsock_slow(*pos != ':')) {errno = EPROTO; return -1;}
+    pos = hparse_lstrip(pos + 1, end);
+    value->base = pos;
+    value->len = hparse_rstrip(pos, end) - pos;
+    return 0;
+}
+
@@ -0,0 +1,50 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_HPARSE_H_INCLUDED
+#define DSOCK_HPARSE_H_INCLUDED
+
+#include <stddef.h>
+
+#include "dsock.h"
+
+/* Parser of HTTP/1.1 header lines. Nothing is copied, parsed items are
+   returned as views into the line. Functions fail with EPROTO if the line
+   is malformed. */
+
+/* Returns offset of the first occurrence of either a or b in the buffer,
+   or len if there is none. */
+size_t hparse_find(const char *buf, size_t len, char a, char b);
+
+int hparse_request(const char *line, size_t len,
+    struct http_view *command, struct http_view *resource);
+
+/* Returns the status code. */
+int hparse_status(const char *line, size_t len, struct http_view *reason);
+
+int hparse_field(const char *line, size_t len,
+    struct http_view *name, struct http_view *value);
+
+#endif
+
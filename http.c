@@ -29,8 +29,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "dsock.h"
+#include "hparse.h"
+#include "http.h"
+#include "iol.h"
 #include "utils.h"
 
 dsock_unique_id(http_type);
@@ -38,17 +42,74 @@ dsock_unique_id(http_type);
 static void *http_hquery(struct hvfs *hvfs, const void *type);
 static void http_hclose(struct hvfs *hvfs);
 static int http_hdone(struct hvfs *hvfs, int64_t deadline);
+static int http_bsendl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static int http_brecvl(struct bsock_vfs *bvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+
+/* Lines are received into rxbuf and parsed in place. Views returned to
+   the user point into it. */
+#define HTTP_RXBUF 8192
+
+/* http_recvheaders receives the whole header into an arena allocated once
+   per connection. Lines are stored from the beginning of the arena, the
+   array of fields grows from its end. The arena is never reallocated so
+   that the views stay valid. Its size limits the size of the header. */
+#define HTTP_ARENA 16384
+
+/* Methods of the requests that were sent but not answered yet are kept
+   so that the responses which have no body despite their Content-Length
+   can be recognised. At most HTTP_MAXPENDING requests can be outstanding
+   at any time. */
+#define HTTP_MAXPENDING 64
+#define HTTP_OTHER 0
+#define HTTP_HEAD 1
+#define HTTP_CONNECT 2
+
+/* Lines are read directly from the underlying bytestream, never reading
+   past the end of the current line. Thus, a message can be followed by
+   the next one on the same connection and the body can be passed to the
+   user via bsock interface of the HTTP socket. Once the body of incoming
+   message is received, or skipped when the next message is asked for, the
+   next pipelined message can be received. Receiving and sending are
+   independent of each other so that responses can be sent while further
+   requests are waiting in the underlying socket. */
 
 struct http_sock {
     struct hvfs hvfs;
-    /* Underlying CRLF socket. */
+    struct bsock_vfs bvfs;
+    /* Underlying bytestream. */
     int s;
     int rxerr;
-    char rxbuf[1024];
+    /* Header fields are being received. */
+    int rxfields;
+    /* Content-Length of the incoming message, -1 if there was none. */
+    int64_t rxclen;
+    /* Transfer-Encoding of the incoming message was specified. */
+    int rxte;
+    /* Length of the body if neither of the above is specified. */
+    int64_t rxdflt;
+    /* Incoming message has no body whatever its fields say. */
+    int rxnobody;
+    /* Body bytes still to be received. -1 if the body is not delimited
+       by Content-Length. Such body has to be consumed by the user and no
+       further message can be received until the layer that decodes it
+       calls http_bodyend. */
+    int64_t rxrmn;
+    /* Header fields are being sent. */
+    int txfields;
+    /* FIFO of the methods of outstanding requests. */
+    uint8_t txpending[HTTP_MAXPENDING];
+    size_t txfirst;
+    size_t txcount;
+    char *arena;
+    size_t arenalen;
+    char rxbuf[HTTP_RXBUF];
 };
 
 static void *http_hquery(struct hvfs *hvfs, const void *type) {
     struct http_sock *obj = (struct http_sock*)hvfs;
+    if(type == bsock_type) return &obj->bvfs;
     if(type == http_type) return obj;
     errno = ENOTSUP;
     return NULL;
@@ -64,53 +125,68 @@ int http_attach(int s) {
     obj->hvfs.query = http_hquery;
     obj->hvfs.close = http_hclose;
     obj->hvfs.done = http_hdone;
-    obj->s = -1;
+    obj->bvfs.bsendl = http_bsendl;
+    obj->bvfs.brecvl = http_brecvl;
+    obj->s = s;
     obj->rxerr = 0;
+    obj->rxfields = 0;
+    obj->rxclen = -1;
+    obj->rxte = 0;
+    obj->rxdflt = 0;
+    obj->rxnobody = 0;
+    obj->rxrmn = 0;
+    obj->txfields = 0;
+    obj->txfirst = 0;
+    obj->txcount = 0;
+    obj->arena = NULL;
+    obj->arenalen = HTTP_ARENA;
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
     if(dsock_slow(h < 0)) {err = errno; goto error2;}
-    /* Make a private copy of the underlying socket. */
-    int tmp = hdup(s);
-    if(dsock_slow(tmp < 0)) {err = errno; goto error3;}
-    /* Wrap the underlying socket into CRLF protocol. */
-    obj->s = crlf_attach(tmp);
-    if(dsock_slow(obj->s < 0)) {err = errno; goto error4;}
-    /* Function succeeded. We can now close original undelying handle. */
-    int rc = hclose(s);
-    dsock_assert(rc == 0);
     return h;
-error4:
-    rc = hclose(tmp);
-    dsock_assert(rc == 0);
-error3:;
-    rc = hclose(h);
-    dsock_assert(rc == 0);
 error2:
     free(obj);
 error1:
     errno = err;
     return -1;
-
-}
-
-static int http_hdone(struct hvfs *hvfs, int64_t deadline) {
-    struct http_sock *obj = (struct http_sock*)hvfs;
-    return hdone(obj->s, deadline);
 }
 
 int http_detach(int s, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
-    int u = crlf_detach(obj->s, deadline);
-    /* TODO: Handle errors. */
+    /* Nothing is ever read ahead so there's no data to lose. */
+    int u = obj->s;
+    free(obj->arena);
     free(obj);
     return u;
 }
 
+/* Sends the line, adding CRLF at its end. */
+static int http_sendline(struct http_sock *obj, struct iolist *first,
+      struct iolist *last, int64_t deadline) {
+    struct iolist crlf = {(void*)"\r\n", 2, NULL, 0};
+    last->iol_next = &crlf;
+    int rc = bsendl(obj->s, first, &crlf, deadline);
+    last->iol_next = NULL;
+    return rc;
+}
+
+/* Empty line terminates the header. */
+static int http_hdone(struct hvfs *hvfs, int64_t deadline) {
+    struct http_sock *obj = (struct http_sock*)hvfs;
+    if(dsock_slow(!obj->txfields)) {errno = EPROTO; return -1;}
+    int rc = bsend(obj->s, "\r\n", 2, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->txfields = 0;
+    return 0;
+}
+
 int http_sendrequest(int s, const char *command, const char *resource,
       int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txfields)) {errno = EPROTO; return -1;}
+    if(dsock_slow(obj->txcount == HTTP_MAXPENDING)) {errno = EBUSY; return -1;}
     /* TODO: command and resource should contain no spaces! */
     struct iolist iol[4];
     iol[0].iol_base = (void*)command;
@@ -129,49 +205,147 @@ int http_sendrequest(int s, const char *command, const char *resource,
     iol[3].iol_len = 9;
     iol[3].iol_next = NULL;
     iol[3].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[3], deadline);
+    int rc = http_sendline(obj, &iol[0], &iol[3], deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->txfields = 1;
+    uint8_t method = HTTP_OTHER;
+    if(strcmp(command, "HEAD") == 0) method = HTTP_HEAD;
+    else if(strcmp(command, "CONNECT") == 0) method = HTTP_CONNECT;
+    obj->txpending[(obj->txfirst + obj->txcount) % HTTP_MAXPENDING] = method;
+    obj->txcount++;
+    return 0;
 }
 
-int http_recvrequest(int s, char *command, size_t commandlen,
-      char *resource, size_t resourcelen, int64_t deadline) {
-    struct http_sock *obj = hquery(s, http_type);
-    if(dsock_slow(!obj)) return -1;
+/* Copies the view into a zero-terminated string. */
+static int http_copy(char *dst, size_t dstlen, const struct http_view *src) {
+    if(dsock_slow(src->len > dstlen - 1)) {errno = EMSGSIZE; return -1;}
+    memcpy(dst, src->base, src->len);
+    dst[src->len] = 0;
+    return 0;
+}
+
+/* Receives a line into the buffer, CRLF included. Returns the length
+   of the line without CRLF. The line ends with CRLF, so unless the last
+   byte received was CR at least two more bytes are yet to come. Reading
+   them never reads past the end of the line. */
+static ssize_t http_recvline(struct http_sock *obj, char *buf, size_t len,
+      int64_t deadline) {
     if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
-    if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
     size_t pos = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Command. */
-    size_t start = pos;
-    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start > commandlen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(command, obj->rxbuf + start, pos - start);
-    command[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Resource. */
-    start = pos;
-    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start > resourcelen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(resource, obj->rxbuf + start, pos - start);
-    resource[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Protocol. */
-    start = pos;
-    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
-    if(dsock_slow(pos - start != 8 &&
-          memcmp(obj->rxbuf + start, "HTTP/1.1", 8) != 0)) {
-        errno = EPROTO; return -1;}
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] != 0)) {errno = EPROTO; return -1;}
+    while(1) {
+        size_t n = pos > 0 && buf[pos - 1] == '\r' ? 1 : 2;
+        if(dsock_slow(pos + n > len)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        int rc = brecv(obj->s, buf + pos, n, deadline);
+        if(dsock_slow(rc < 0)) {
+            /* Peer may close the connection only between messages. */
+            if(errno == EPIPE && (pos > 0 || obj->rxfields))
+                errno = ECONNRESET;
+            obj->rxerr = errno;
+            return -1;
+        }
+        pos += n;
+        if(pos >= 2 && buf[pos - 2] == '\r' && buf[pos - 1] == '\n')
+            return pos - 2;
+    }
+}
+
+/* Processes a received header line. Fields that delimit the body are
+   remembered. Empty line ends the header and EPIPE is returned. */
+static int http_recvfield_(struct http_sock *obj, const char *line,
+      size_t len, struct http_view *name, struct http_view *value) {
+    if(len == 0) {
+        obj->rxfields = 0;
+        if(obj->rxnobody) obj->rxrmn = 0;
+        else if(obj->rxte) obj->rxrmn = -1;
+        else if(obj->rxclen >= 0) obj->rxrmn = obj->rxclen;
+        else obj->rxrmn = obj->rxdflt;
+        errno = EPIPE;
+        return -1;
+    }
+    int rc = hparse_field(line, len, name, value);
+    if(dsock_slow(rc < 0)) return -1;
+    if(name->len == 17 &&
+          strncasecmp(name->base, "Transfer-Encoding", 17) == 0) {
+        obj->rxte = 1;
+        return 0;
+    }
+    if(name->len == 14 &&
+          strncasecmp(name->base, "Content-Length", 14) == 0) {
+        /* Without a valid length the end of the body can't be found. */
+        int64_t clen = 0;
+        size_t i;
+        for(i = 0; i != value->len; ++i) {
+            char c = value->base[i];
+            if(dsock_slow(c < '0' || c > '9' || i >= 18)) {
+                errno = obj->rxerr = EPROTO; return -1;}
+            clen = clen * 10 + (c - '0');
+        }
+        if(dsock_slow(value->len == 0 ||
+              (obj->rxclen >= 0 && obj->rxclen != clen))) {
+            errno = obj->rxerr = EPROTO; return -1;}
+        obj->rxclen = clen;
+    }
     return 0;
 }
 
+/* Skips whatever is left of the current message and receives the first
+   line of the next one. */
+static ssize_t http_recvstart(struct http_sock *obj, int64_t deadline) {
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    /* Skipped fields still determine the length of the body. */
+    while(obj->rxfields) {
+        ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf),
+            deadline);
+        if(dsock_slow(sz < 0)) return -1;
+        struct http_view name, value;
+        int rc = http_recvfield_(obj, obj->rxbuf, sz, &name, &value);
+        if(dsock_slow(rc < 0 && errno != EPIPE)) return -1;
+    }
+    /* The end of the body is not known. The next message would be read
+       from the middle of it. */
+    if(dsock_slow(obj->rxrmn < 0)) {errno = EPROTO; return -1;}
+    if(obj->rxrmn > 0) {
+        struct iolist iol = {NULL, obj->rxrmn, NULL, 0};
+        int rc = brecvl(obj->s, &iol, &iol, deadline);
+        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+        obj->rxrmn = 0;
+    }
+    ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf),
+        deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    obj->rxfields = 1;
+    obj->rxclen = -1;
+    obj->rxte = 0;
+    obj->rxnobody = 0;
+    return sz;
+}
+
+int http_recvrequestv(int s, struct http_view *command,
+      struct http_view *resource, int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    ssize_t sz = http_recvstart(obj, deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    /* Request without Content-Length has no body. */
+    obj->rxdflt = 0;
+    return hparse_request(obj->rxbuf, sz, command, resource);
+}
+
+int http_recvrequest(int s, char *command, size_t commandlen,
+      char *resource, size_t resourcelen, int64_t deadline) {
+    struct http_view cmd, res;
+    int rc = http_recvrequestv(s, &cmd, &res, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    rc = http_copy(command, commandlen, &cmd);
+    if(dsock_slow(rc < 0)) return -1;
+    return http_copy(resource, resourcelen, &res);
+}
+
 int http_sendstatus(int s, int status, const char *reason, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->txfields)) {errno = EPROTO; return -1;}
     if(dsock_slow(status < 100 || status > 599)) {errno = EINVAL; return -1;}
     char buf[4];
     buf[0] = (status / 100) + '0';
@@ -193,43 +367,41 @@ int http_sendstatus(int s, int status, const char *reason, int64_t deadline) {
     iol[2].iol_len = strlen(reason);
     iol[2].iol_next = NULL;
     iol[2].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[2], deadline);
+    int rc = http_sendline(obj, &iol[0], &iol[2], deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->txfields = 1;
+    return 0;
 }
 
-int http_recvstatus(int s, char *reason, size_t reasonlen, int64_t deadline) {
+int http_recvstatusv(int s, struct http_view *reason, int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
+    ssize_t sz = http_recvstart(obj, deadline);
     if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
-    size_t pos = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Protocol. */
-    size_t start = pos;
-    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start != 8 &&
-          memcmp(obj->rxbuf + start, "HTTP/1.1", 8) != 0)) {
-        errno = EPROTO; return -1;}
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Status code. */
-    start = pos;
-    while(obj->rxbuf[pos] != 0 && obj->rxbuf[pos] != ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start != 3)) {errno = EPROTO; return -1;}
-    if(dsock_slow(obj->rxbuf[start] < '0' || obj->rxbuf[start] > '9' ||
-          obj->rxbuf[start + 1] < '0' || obj->rxbuf[start + 1] > '9' ||
-          obj->rxbuf[start + 2] < '0' || obj->rxbuf[start + 2] > '9')) {
-        errno = EPROTO; return -1;}
-    int status = (obj->rxbuf[start] - '0') * 100 +
-        (obj->rxbuf[start + 1] - '0') * 10 +
-        (obj->rxbuf[start + 2] - '0');
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Reason. */
-    if(sz - pos > reasonlen - 1) {errno = EMSGSIZE; return -1;}
-    memcpy(reason, obj->rxbuf + pos, sz - pos);
-    reason[sz - pos] = 0;
+    int status = hparse_status(obj->rxbuf, sz, reason);
+    if(dsock_slow(status < 0)) return -1;
+    /* Interim responses precede the final response to the same request. */
+    uint8_t method = HTTP_OTHER;
+    if((status >= 200 || status == 101) && obj->txcount) {
+        method = obj->txpending[obj->txfirst];
+        obj->txfirst = (obj->txfirst + 1) % HTTP_MAXPENDING;
+        obj->txcount--;
+    }
+    /* Some responses never have a body, even if they carry Content-Length.
+       Other responses without Content-Length last till the connection is
+       closed. */
+    obj->rxnobody = status < 200 || status == 204 || status == 304 ||
+        method == HTTP_HEAD || (method == HTTP_CONNECT && status / 100 == 2);
+    obj->rxdflt = obj->rxnobody ? 0 : -1;
+    return status;
+}
+
+int http_recvstatus(int s, char *reason, size_t reasonlen, int64_t deadline) {
+    struct http_view rsn;
+    int status = http_recvstatusv(s, &rsn, deadline);
+    if(dsock_slow(status < 0)) return -1;
+    int rc = http_copy(reason, reasonlen, &rsn);
+    if(dsock_slow(rc < 0)) return -1;
     return status;
 }
 
@@ -241,6 +413,7 @@ int http_sendfield(int s, const char *name, const char *value,
     if (strpbrk(name, "(),/:;<=>?@[\\]{}\" \t") != NULL) {
         errno = EPROTO; return -1;}
     if (strlen(value) == 0) {errno = EPROTO; return -1;}
+    if(dsock_slow(!obj->txfields)) {errno = EPROTO; return -1;}
     struct iolist iol[3];
     iol[0].iol_base = (void*)name;
     iol[0].iol_len = strlen(name);
@@ -257,50 +430,149 @@ int http_sendfield(int s, const char *name, const char *value,
     iol[2].iol_len = end - start;
     iol[2].iol_next = NULL;
     iol[2].iol_rsvd = 0;
-    return msendl(obj->s, &iol[0], &iol[2], deadline);
+    return http_sendline(obj, &iol[0], &iol[2], deadline);
+}
+
+int http_recvfieldv(int s, struct http_view *name, struct http_view *value,
+      int64_t deadline) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(!obj->rxfields)) {errno = EPIPE; return -1;}
+    ssize_t sz = http_recvline(obj, obj->rxbuf, sizeof(obj->rxbuf),
+        deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    return http_recvfield_(obj, obj->rxbuf, sz, name, value);
 }
 
 int http_recvfield(int s, char *name, size_t namelen,
       char *value, size_t valuelen, int64_t deadline) {
+    struct http_view nm, val;
+    int rc = http_recvfieldv(s, &nm, &val, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    rc = http_copy(name, namelen, &nm);
+    if(dsock_slow(rc < 0)) return -1;
+    return http_copy(value, valuelen, &val);
+}
+
+int http_headerlimit(int s, size_t limit) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(limit < sizeof(struct http_field))) {
+        errno = EINVAL; return -1;}
+    /* The arena will be allocated anew on the next use. */
+    free(obj->arena);
+    obj->arena = NULL;
+    obj->arenalen = limit;
+    return 0;
+}
+
+ssize_t http_recvheaders(int s, struct http_field **fields,
+      int64_t deadline) {
     struct http_sock *obj = hquery(s, http_type);
     if(dsock_slow(!obj)) return -1;
     if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    ssize_t sz = mrecv(obj->s, obj->rxbuf, sizeof(obj->rxbuf) - 1, deadline);
-    if(dsock_slow(sz < 0)) return -1;
-    obj->rxbuf[sz] = 0;
-    size_t pos = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Name. */
-    size_t start = pos;
-    while(obj->rxbuf[pos] != 0 &&
-          obj->rxbuf[pos] != ' ' &&
-          obj->rxbuf[pos] != ':')
-        ++pos;
-    if(dsock_slow(obj->rxbuf[pos] == 0)) {errno = EPROTO; return -1;}
-    if(dsock_slow(pos - start > namelen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(name, obj->rxbuf + start, pos - start);
-    name[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] != ':')) {errno = EPROTO; return -1;}
-    ++pos;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    /* Value. */
-    start = pos;
-    pos = dsock_rstrip(obj->rxbuf + sz, ' ') - obj->rxbuf;
-    if(dsock_slow(pos - start > valuelen - 1)) {errno = EMSGSIZE; return -1;}
-    memcpy(value, obj->rxbuf + start, pos - start);
-    value[pos - start] = 0;
-    while(obj->rxbuf[pos] == ' ') ++pos;
-    if(dsock_slow(obj->rxbuf[pos] != 0)) {errno = EPROTO; return -1;}
+    if(dsock_slow(!obj->rxfields)) {errno = EPIPE; return -1;}
+    if(dsock_slow(!obj->arena)) {
+        obj->arena = malloc(obj->arenalen);
+        if(dsock_slow(!obj->arena)) {errno = ENOMEM; return -1;}
+    }
+    struct http_field *top = (struct http_field*)(obj->arena +
+        obj->arenalen / sizeof(struct http_field) *
+        sizeof(struct http_field));
+    struct http_field *fld = top;
+    char *pos = obj->arena;
+    char *line = pos;
+    /* Nothing can be read past the end of the header. It ends with CRLFCRLF,
+       so depending on how much of it was matched so far, up to four bytes
+       are known to belong to the header. state is the number of matched
+       bytes. The previous line has already ended with CRLF. */
+    int state = 2;
+    while(state != 4) {
+        size_t n = 4 - state;
+        /* Leave space for the field structure. */
+        if(dsock_slow((char*)(fld - 1) < pos + n)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        int rc = brecv(obj->s, pos, n, deadline);
+        if(dsock_slow(rc < 0)) {
+            if(errno == EPIPE) errno = ECONNRESET;
+            obj->rxerr = errno;
+            return -1;
+        }
+        char *end = pos + n;
+        for(; pos != end; ++pos) {
+            if(*pos == "\r\n\r\n"[state]) ++state;
+            else state = *pos == '\r' ? 1 : 0;
+            if(state != 2) continue;
+            /* The next line may have been partially received already,
+               so the header can't be resumed after a malformed field. */
+            --fld;
+            rc = http_recvfield_(obj, line, pos - 1 - line, &fld->name,
+                &fld->value);
+            if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+            line = pos + 1;
+        }
+    }
+    /* Empty line ends the header. */
+    struct http_view name, value;
+    int rc = http_recvfield_(obj, pos, 0, &name, &value);
+    dsock_assert(rc < 0 && errno == EPIPE);
+    /* Fields were stored in reverse order. */
+    size_t n = top - fld;
+    size_t i;
+    for(i = 0; i != n / 2; ++i) {
+        struct http_field tmp = fld[i];
+        fld[i] = fld[n - i - 1];
+        fld[n - i - 1] = tmp;
+    }
+    *fields = fld;
+    return n;
+}
+
+void http_bodyend(int s) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(!obj) return;
+    if(!obj->rxfields && obj->rxrmn < 0) obj->rxrmn = 0;
+}
+
+int64_t http_bodylen(int s) {
+    struct http_sock *obj = hquery(s, http_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->rxfields || obj->rxrmn < 0)) {
+        errno = ENOTSUP; return -1;}
+    return obj->rxrmn;
+}
+
+/* Body is sent as is. It's up to the user to send the matching
+   Content-Length field. */
+static int http_bsendl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct http_sock *obj = dsock_cont(bvfs, struct http_sock, bvfs);
+    if(dsock_slow(obj->txfields)) {errno = EPROTO; return -1;}
+    return bsendl(obj->s, first, last, deadline);
+}
+
+static int http_brecvl(struct bsock_vfs *bvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct http_sock *obj = dsock_cont(bvfs, struct http_sock, bvfs);
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    if(dsock_slow(obj->rxfields)) {errno = EPROTO; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Reading beyond the end of the body. */
+    if(dsock_slow(obj->rxrmn >= 0 && len > obj->rxrmn)) {
+        errno = EPIPE; return -1;}
+    rc = brecvl(obj->s, first, last, deadline);
+    if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+    if(obj->rxrmn >= 0) obj->rxrmn -= len;
     return 0;
 }
 
 static void http_hclose(struct hvfs *hvfs) {
     struct http_sock *obj = (struct http_sock*)hvfs;
-    if(dsock_fast(obj->s >= 0)) {
-        int rc = hclose(obj->s);
-        dsock_assert(rc == 0);
-    }
+    int rc = hclose(obj->s);
+    dsock_assert(rc == 0);
+    free(obj->arena);
     free(obj);
 }
 
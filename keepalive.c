@@ -24,12 +24,14 @@
 
 #include <errno.h>
 #include <libdillimpl.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/uio.h>
+#include <time.h>
 
 #include "dsock.h"
+#include "timer.h"
 #include "utils.h"
 
 dsock_unique_id(keepalive_type);
@@ -40,8 +42,34 @@ static int keepalive_msendl(struct msock_vfs *mvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
 static ssize_t keepalive_mrecvl(struct msock_vfs *mvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
-static coroutine void keepalive_sender(int s, int64_t send_interval,
-    int sendch, int ackch);
+
+/* User messages are sent directly from the caller's coroutine. Keepalives
+   are driven by a timer from the shared timer wheel, so an idle socket
+   doesn't need a coroutine of its own. When the timer expires it checks
+   the time of the last send. If something was sent in the meantime the
+   timer is simply rescheduled. Otherwise a short-lived coroutine is launched
+   to send the keepalive. If the user wants to send while keepalive is being
+   sent, it waits on wakech.
+
+   The same coroutine sends pings and pongs. A ping carries the time it was
+   sent at, in microseconds, and the peer echoes it back in a pong. The time
+   is never interpreted by the peer so the clocks don't have to be in sync.
+   Pongs are sent by the peer when it receives the ping, i.e. the peer has
+   to be reading from the socket for the measurement to work.
+
+   Optionally, failures are detected by phi accrual detector. The peer sends
+   a keepalive only after it has been idle for send_interval, so the gaps
+   that end with a keepalive tell us how long the peer can be silent. Their
+   mean and standard deviation are tracked over a sliding window. Suspicion
+   level phi is -log10 of the probability that the next message arrives
+   even later than now. Its threshold is converted into the number of
+   standard deviations beyond the mean in advance so that receiving needs
+   no floating point computation. */
+
+/* Number of keepalive gaps the failure detector remembers. */
+#define KEEPALIVE_WINDOW 32
+/* Minimal number of gaps needed before the failure detector kicks in. */
+#define KEEPALIVE_MINGAPS 4
 
 struct keepalive_sock {
     struct hvfs hvfs;
@@ -49,17 +77,46 @@ struct keepalive_sock {
     int s;
     int64_t send_interval;
     int64_t recv_interval;
-    int sendch;
-    int ackch;
+    /* Last time something was sent. */
+    int64_t last_send;
+    /* User is sending a message. */
+    int busy;
+    /* Background coroutine is sending a control message. */
+    int sending;
+    /* User is waiting for the control message to be sent. */
+    int waiting;
+    int wakech;
+    struct timer timer;
+    /* Control messages to be sent by the background coroutine. */
+    int idle_due;
+    int ping_due;
+    int pong_due;
+    /* Timestamp to echo back in the pong. */
+    uint64_t pong_stamp;
+    /* Interval between pings. -1 if pings are not being sent. */
+    int64_t ping_interval;
+    struct timer pinger;
+    struct keepalive_stats stats;
+    /* Failure detector threshold. Zero if the detector is off. */
+    double threshold;
+    /* Number of standard deviations corresponding to the threshold. */
+    double ythreshold;
+    /* Sliding window of gaps ending with a keepalive, in milliseconds. */
+    int64_t gaps[KEEPALIVE_WINDOW];
+    size_t ngaps;
+    size_t gappos;
+    int64_t gapsum;
+    int64_t gapsumsq;
+    /* Coroutine sending the last control message. It may have already
+       finished. */
     int sender;
     int64_t last_recv;
     int err;
 };
 
-struct keepalive_vec {
-    struct iolist *first;
-    struct iolist *last;
-};
+static coroutine void keepalive_sender(struct keepalive_sock *obj);
+static void keepalive_expired(struct timer *timer);
+static void keepalive_ping_expired(struct timer *timer);
 
 static void *keepalive_hquery(struct hvfs *hvfs, const void *type) {
     struct keepalive_sock *obj = (struct keepalive_sock*)hvfs;
@@ -84,39 +141,44 @@ int keepalive_attach(int s, int64_t send_interval, int64_t recv_interval) {
     obj->s = s;
     obj->send_interval = send_interval;
     obj->recv_interval = recv_interval;
-    obj->sendch = -1;
-    obj->ackch = -1;
+    obj->last_send = now();
+    obj->busy = 0;
+    obj->sending = 0;
+    obj->waiting = 0;
+    obj->idle_due = 0;
+    obj->ping_due = 0;
+    obj->pong_due = 0;
+    obj->pong_stamp = 0;
+    obj->ping_interval = -1;
+    memset(&obj->stats, 0, sizeof(obj->stats));
+    obj->threshold = 0;
+    obj->ythreshold = 0;
+    obj->ngaps = 0;
+    obj->gappos = 0;
+    obj->gapsum = 0;
+    obj->gapsumsq = 0;
+    obj->last_recv = obj->last_send;
+    obj->err = 0;
     obj->sender = -1;
+    timer_init(&obj->timer, keepalive_expired);
+    timer_init(&obj->pinger, keepalive_ping_expired);
+    /* The channel is needed even if keepalives are not sent. Pongs may
+       still have to be sent in the background. */
+    obj->wakech = chmake(sizeof(int));
+    if(dsock_slow(obj->wakech < 0)) {err = errno; goto error2;}
     if(send_interval >= 0) {
-        obj->sendch = chmake(sizeof(struct keepalive_vec));
-        if(dsock_slow(obj->sendch < 0)) {err = errno; goto error2;}
-        obj->ackch = chmake(sizeof(int));
-        if(dsock_slow(obj->ackch < 0)) {err = errno; goto error3;}
-        obj->sender = go(keepalive_sender(s, send_interval,
-            obj->sendch, obj->ackch));
-        if(dsock_slow(obj->sender < 0)) {err = errno; goto error4;}
-    }
-    obj->last_recv = now();
-    obj->err = 0;
+        rc = timer_add(&obj->timer, obj->last_send + send_interval);
+        if(dsock_slow(rc < 0)) {err = errno; goto error3;}
+    }
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {err = errno; goto error5;}
+    if(dsock_slow(h < 0)) {err = errno; goto error4;}
     return h;
-error5:
-    if(obj->sender >= 0) {
-        rc = hclose(obj->sender);
-        dsock_assert(rc == 0);
-    }
 error4:
-    if(obj->ackch >= 0) {
-        rc = hclose(obj->ackch);
-        dsock_assert(rc == 0);
-    }
+    timer_rm(&obj->timer);
 error3:
-    if(obj->sendch >= 0) {
-        rc = hclose(obj->sendch);
-        dsock_assert(rc == 0);
-    }
+    rc = hclose(obj->wakech);
+    dsock_assert(rc == 0);
 error2:
     free(obj);
 error1:
@@ -125,14 +187,14 @@ error1:
 }
 
 static int keepalive_free(struct keepalive_sock *obj) {
-    if(obj->send_interval >= 0) {
+    timer_rm(&obj->timer);
+    timer_rm(&obj->pinger);
+    if(obj->sender >= 0) {
         int rc = hclose(obj->sender);
         dsock_assert(rc == 0);
-        rc = hclose(obj->ackch);
-        dsock_assert(rc == 0);
-        rc = hclose(obj->sendch);
-        dsock_assert(rc == 0);
     }
+    int rc = hclose(obj->wakech);
+    dsock_assert(rc == 0);
     int u = obj->s;
     free(obj);
     return u;
@@ -145,59 +207,254 @@ int keepalive_detach(int s) {
     return keepalive_free(obj);
 }
 
+/* Monotonic time in microseconds. now() is too coarse to measure RTT
+   on a local network. */
+static uint64_t keepalive_usec(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    dsock_assert(rc == 0);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Launches the coroutine to send pending control messages. If the user is
+   sending at the moment, the control messages are sent once it's done. */
+static int keepalive_kick(struct keepalive_sock *obj) {
+    if(obj->sending || obj->busy) return 0;
+    /* The previous sender has already finished given that it cleared
+       the sending flag as the last thing it did. */
+    if(obj->sender >= 0) {
+        int rc = hclose(obj->sender);
+        dsock_assert(rc == 0);
+    }
+    obj->sending = 1;
+    obj->sender = go(keepalive_sender(obj));
+    if(dsock_slow(obj->sender < 0)) {obj->sending = 0; return -1;}
+    return 0;
+}
+
+int keepalive_ping(int s, int64_t interval) {
+    struct keepalive_sock *obj = hquery(s, keepalive_type);
+    if(dsock_slow(!obj)) return -1;
+    if(interval < 0) {
+        timer_rm(&obj->pinger);
+        obj->ping_interval = -1;
+        obj->ping_due = 0;
+        return 0;
+    }
+    if(dsock_slow(interval == 0)) {errno = EINVAL; return -1;}
+    obj->ping_interval = interval;
+    /* Send the first ping straight away. */
+    obj->ping_due = 1;
+    int rc = keepalive_kick(obj);
+    if(dsock_slow(rc < 0)) return timer_add(&obj->pinger, now() + interval);
+    return 0;
+}
+
+int keepalive_stats(int s, struct keepalive_stats *stats) {
+    struct keepalive_sock *obj = hquery(s, keepalive_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(!stats)) {errno = EINVAL; return -1;}
+    *stats = obj->stats;
+    return 0;
+}
+
+/* Logistic approximation of the normal distribution's tail. Returns phi
+   for y standard deviations beyond the mean. */
+static double keepalive_phi(double y) {
+    double e = exp(-y * (1.5976 + 0.070566 * y * y));
+    if(y > 0) return -log10(e / (1.0 + e));
+    return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+int keepalive_detector(int s, double threshold) {
+    struct keepalive_sock *obj = hquery(s, keepalive_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Failures are detected only in receive mode. */
+    if(dsock_slow(obj->recv_interval < 0)) {errno = EINVAL; return -1;}
+    if(dsock_slow(threshold < 0)) {errno = EINVAL; return -1;}
+    obj->threshold = threshold;
+    if(threshold == 0) return 0;
+    /* Phi grows monotonically with y. Find the threshold by bisection. */
+    double lo = -10.0;
+    double hi = 40.0;
+    int i;
+    for(i = 0; i != 64; ++i) {
+        double mid = (lo + hi) / 2;
+        if(keepalive_phi(mid) < threshold) lo = mid;
+        else hi = mid;
+    }
+    obj->ythreshold = hi;
+    return 0;
+}
+
+/* Mean and standard deviation of the keepalive gaps. Jitter below timer
+   resolution would make the detector trigger-happy, so standard deviation
+   is never less than a tenth of the mean or one millisecond. */
+static void keepalive_gapstats(struct keepalive_sock *obj, double *mean,
+      double *stddev) {
+    double n = obj->ngaps;
+    *mean = obj->gapsum / n;
+    double var = obj->gapsumsq / n - *mean * *mean;
+    *stddev = var > 0 ? sqrt(var) : 0;
+    *stddev = MAX(*stddev, *mean / 10);
+    *stddev = MAX(*stddev, 1.0);
+}
+
+double keepalive_suspicion(int s) {
+    struct keepalive_sock *obj = hquery(s, keepalive_type);
+    if(dsock_slow(!obj)) return -1;
+    if(obj->ngaps < KEEPALIVE_MINGAPS) return 0;
+    double mean;
+    double stddev;
+    keepalive_gapstats(obj, &mean, &stddev);
+    double phi = keepalive_phi((now() - obj->last_recv - mean) / stddev);
+    return phi > 0 ? phi : 0;
+}
+
+static void keepalive_gap(struct keepalive_sock *obj, int64_t gap) {
+    if(obj->ngaps == KEEPALIVE_WINDOW) {
+        int64_t old = obj->gaps[obj->gappos];
+        obj->gapsum -= old;
+        obj->gapsumsq -= old * old;
+    }
+    else {
+        obj->ngaps++;
+    }
+    obj->gaps[obj->gappos] = gap;
+    obj->gappos = (obj->gappos + 1) % KEEPALIVE_WINDOW;
+    obj->gapsum += gap;
+    obj->gapsumsq += gap * gap;
+}
+
 static int keepalive_msendl(struct msock_vfs *mvfs,
       struct iolist *first, struct iolist *last, int64_t deadline) {
     struct keepalive_sock *obj = dsock_cont(mvfs, struct keepalive_sock, mvfs);
     if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
-    /* Send is done in a worker coroutine. */
-    struct keepalive_vec vec = {first, last};
-    int rc = chsend(obj->sendch, &vec, sizeof(vec), deadline);
-    if(dsock_slow(rc < 0)) return -1;
-    /* Wait till worker is done. */
-    int err;
-    rc = chrecv(obj->ackch, &err, sizeof(err), deadline);
-    if(dsock_slow(rc < 0)) return -1;
-    if(dsock_slow(err < 0)) {errno = err; return -1;}
+    /* Wait till the control message being sent at the moment is out. */
+    while(dsock_slow(obj->sending)) {
+        obj->waiting = 1;
+        int dummy;
+        int rc = chrecv(obj->wakech, &dummy, sizeof(dummy), deadline);
+        obj->waiting = 0;
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    uint8_t c = 'D';
+    struct iolist iol = {&c, 1, first, 0};
+    obj->busy = 1;
+    int rc = msendl(obj->s, &iol, last, deadline);
+    obj->busy = 0;
+    if(dsock_slow(rc < 0)) {obj->err = errno; return -1;}
+    obj->last_send = now();
+    /* Pings or pongs may have been postponed while we were sending. */
+    if(dsock_slow(obj->ping_due || obj->pong_due)) keepalive_kick(obj);
     return 0;
 }
 
-static coroutine void keepalive_sender(int s, int64_t send_interval,
-      int sendch, int ackch) {
-    /* Last time something was sent. */
-    int64_t last = now();
+static void keepalive_expired(struct timer *timer) {
+    struct keepalive_sock *obj = dsock_cont(timer, struct keepalive_sock, timer);
+    int64_t nw = now();
+    /* Something was sent in the meantime. */
+    if(nw < obj->last_send + obj->send_interval) {
+        timer_add(&obj->timer, obj->last_send + obj->send_interval);
+        return;
+    }
+    /* User is sending a message at the moment. Check again later. */
+    if(obj->busy) {
+        timer_add(&obj->timer, nw + obj->send_interval);
+        return;
+    }
+    obj->idle_due = 1;
+    int rc = keepalive_kick(obj);
+    /* Try again later. */
+    if(dsock_slow(rc < 0)) timer_add(&obj->timer, nw + obj->send_interval);
+}
+
+static void keepalive_ping_expired(struct timer *timer) {
+    struct keepalive_sock *obj = dsock_cont(timer, struct keepalive_sock,
+        pinger);
+    obj->ping_due = 1;
+    int rc = keepalive_kick(obj);
+    if(dsock_slow(rc < 0)) timer_add(&obj->pinger, now() + obj->ping_interval);
+}
+
+static coroutine void keepalive_sender(struct keepalive_sock *obj) {
+    uint8_t buf[9];
+    /* More control messages may become due while we are sending. */
     while(1) {
-        /* Get data to send from the user coroutine. */
-        struct keepalive_vec vec;
-        int rc = chrecv(sendch, &vec, sizeof(vec), last + send_interval);
-        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        if(dsock_slow(rc < 0 && errno == ETIMEDOUT)) {
-            /* Send a keepalive. */
-            rc = msend(s, "K", 1, -1);
-            if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            /* We'll ignore other errors here, assuming they are temporary.
-               Temporary failure to send a keepalive should not cause errors. */
-            last = now();
-            continue;
+        int rc;
+        if(obj->pong_due) {
+            obj->pong_due = 0;
+            buf[0] = 'Q';
+            dsock_putll(buf + 1, obj->pong_stamp);
+            rc = msend(obj->s, buf, sizeof(buf), -1);
         }
-        dsock_assert(rc == 0);
-        uint8_t c = 'D';
-        struct iolist iol = {&c, 1, vec.first, 0};
-        rc = msendl(s, &iol, vec.last, -1);
-        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        /* Pass the error to the user. */
-        if(dsock_slow(rc < 0)) {
-            int err = errno;
-            rc = chsend(ackch, &err, sizeof(err), -1);
-            if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            dsock_assert(rc == 0);
-            return;
+        else if(obj->ping_due) {
+            obj->ping_due = 0;
+            buf[0] = 'P';
+            dsock_putll(buf + 1, keepalive_usec());
+            rc = msend(obj->s, buf, sizeof(buf), -1);
+            if(obj->ping_interval >= 0)
+                timer_add(&obj->pinger, now() + obj->ping_interval);
+        }
+        else if(obj->idle_due) {
+            obj->idle_due = 0;
+            /* A ping or a pong counts as traffic. */
+            if(now() < obj->last_send + obj->send_interval) continue;
+            rc = msend(obj->s, "K", 1, -1);
         }
-        last = now();
-        int err = 0;
-        rc = chsend(ackch, &err, sizeof(err), -1);
+        else break;
         if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        dsock_assert(rc == 0);
+        /* We'll ignore other errors here, assuming they are temporary.
+           Temporary failure to send a keepalive should not cause errors. */
+        obj->last_send = now();
     }
+    obj->sending = 0;
+    int dummy = 0;
+    if(obj->waiting) chsend(obj->wakech, &dummy, sizeof(dummy), 0);
+    if(obj->send_interval >= 0)
+        timer_add(&obj->timer, obj->last_send + obj->send_interval);
+}
+
+/* Extracts the timestamp from a ping or a pong. The timestamp may be split
+   among user's buffers and the tail buffer. Returns -1 if the user asked for
+   the data to be skipped, in which case it's not available. */
+static int keepalive_stamp(struct iolist *first, struct iolist *last,
+      const uint8_t *tail, uint64_t *stamp) {
+    uint8_t buf[8];
+    size_t pos = 0;
+    struct iolist *it = first;
+    while(pos < sizeof(buf) && it) {
+        size_t n = MIN(it->iol_len, sizeof(buf) - pos);
+        if(dsock_slow(n && !it->iol_base)) return -1;
+        memcpy(buf + pos, it->iol_base, n);
+        pos += n;
+        it = it == last ? NULL : it->iol_next;
+    }
+    memcpy(buf + pos, tail, sizeof(buf) - pos);
+    *stamp = dsock_getll(buf);
+    return 0;
+}
+
+/* Smoothed RTT and its variation are computed as in RFC 6298. */
+static void keepalive_sample(struct keepalive_sock *obj, uint64_t stamp) {
+    uint64_t nw = keepalive_usec();
+    /* Not a timestamp we've sent. */
+    if(dsock_slow(stamp > nw)) return;
+    int64_t rtt = nw - stamp;
+    struct keepalive_stats *st = &obj->stats;
+    if(st->samples == 0) {
+        st->srtt = rtt;
+        st->minrtt = rtt;
+        st->jitter = rtt / 2;
+    }
+    else {
+        int64_t delta = st->srtt > rtt ? st->srtt - rtt : rtt - st->srtt;
+        st->jitter = (st->jitter * 3 + delta) / 4;
+        st->srtt = (st->srtt * 7 + rtt) / 8;
+        st->minrtt = MIN(st->minrtt, rtt);
+    }
+    st->rtt = rtt;
+    st->samples++;
 }
 
 static ssize_t keepalive_mrecvl(struct msock_vfs *mvfs,
@@ -206,26 +463,63 @@ static ssize_t keepalive_mrecvl(struct msock_vfs *mvfs,
     /* If receive mode is off, just forward the call. */
     if(obj->recv_interval < 0) return mrecvl(obj->s, first, last, deadline);
     if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    /* Pings and pongs are received into the user's buffer. The extra
+       buffer at the end makes sure that they fit in even if the user's
+       buffer is small. */
+    size_t len = 0;
+    struct iolist *it;
+    for(it = first; it; it = it->iol_next) len += it->iol_len;
+    uint8_t tail[8];
+    struct iolist tiol = {tail, sizeof(tail), NULL, 0};
+    uint64_t stamp;
+    int rc;
 retry:;
     /* Compute the deadline. Take keepalive interval into consideration. */
     int64_t dd = obj->last_recv + obj->recv_interval;
+    if(obj->threshold > 0 && obj->ngaps >= KEEPALIVE_MINGAPS) {
+        double mean;
+        double stddev;
+        keepalive_gapstats(obj, &mean, &stddev);
+        int64_t timeout = (int64_t)ceil(mean + obj->ythreshold * stddev);
+        dd = MIN(dd, obj->last_recv + MAX(timeout, 0));
+    }
     int fail_on_deadline = 1;
-    if(deadline < dd) {
+    if(deadline >= 0 && deadline < dd) {
        dd = deadline;
        fail_on_deadline = 0;
     }
     uint8_t c;
     struct iolist iol = {&c, 1, first, 0};
-    ssize_t sz = mrecvl(obj->s, &iol, last, dd);
+    last->iol_next = &tiol;
+    ssize_t sz = mrecvl(obj->s, &iol, &tiol, dd);
+    last->iol_next = NULL;
     if(dsock_slow(fail_on_deadline && sz < 0 && errno == ETIMEDOUT)) {
         obj->err = errno = ECONNRESET; return -1;}
     if(dsock_slow(sz < 0)) return -1;
-    obj->last_recv = now();
+    int64_t nw = now();
+    int64_t gap = nw - obj->last_recv;
+    obj->last_recv = nw;
     if(dsock_slow(sz == 0)) {errno = EPROTO; return -1;}
     switch(c) {
     case 'D':
+        if(dsock_slow(sz - 1 > len)) {errno = EMSGSIZE; return -1;}
         return sz - 1;
     case 'K':
+        if(obj->threshold > 0) keepalive_gap(obj, gap);
+        goto retry;
+    case 'P':
+        if(dsock_slow(sz != 9)) {errno = EPROTO; return -1;}
+        rc = keepalive_stamp(first, last, tail, &stamp);
+        if(dsock_slow(rc < 0)) goto retry;
+        obj->pong_stamp = stamp;
+        obj->pong_due = 1;
+        keepalive_kick(obj);
+        goto retry;
+    case 'Q':
+        if(dsock_slow(sz != 9)) {errno = EPROTO; return -1;}
+        rc = keepalive_stamp(first, last, tail, &stamp);
+        if(dsock_slow(rc < 0)) goto retry;
+        keepalive_sample(obj, stamp);
         goto retry;
     default:
         errno = EPROTO;
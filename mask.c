@@ -0,0 +1,136 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define DSOCK_MASK_X86 1
+#include <immintrin.h>
+#endif
+
+#include "mask.h"
+#include "utils.h"
+
+/* Mask is rotated according to the position once, so that the kernels can
+   work on whole words. Given that 4 divides the word sizes the rotated mask
+   applies to every word in the same way. */
+
+typedef void (*mask_fn)(uint8_t *dst, const uint8_t *src, size_t len,
+    uint32_t key);
+
+static void mask_scalar(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t key) {
+    uint64_t key64 = ((uint64_t)key << 32) | key;
+    while(len >= 8) {
+        uint64_t w;
+        memcpy(&w, src, 8);
+        w ^= key64;
+        memcpy(dst, &w, 8);
+        dst += 8;
+        src += 8;
+        len -= 8;
+    }
+    uint8_t k[4];
+    memcpy(k, &key, 4);
+    size_t i;
+    for(i = 0; i != len; ++i)
+        dst[i] = src[i] ^ k[i % 4];
+}
+
+#if defined DSOCK_MASK_X86
+
+__attribute__((target("sse2")))
+static void mask_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t key) {
+    __m128i k = _mm_set1_epi32((int)key);
+    while(len >= 16) {
+        __m128i w = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(w, k));
+        dst += 16;
+        src += 16;
+        len -= 16;
+    }
+    mask_scalar(dst, src, len, key);
+}
+
+__attribute__((target("avx2")))
+static void mask_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+      uint32_t key) {
+    __m256i k = _mm256_set1_epi32((int)key);
+    while(len >= 32) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)src);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(w, k));
+        dst += 32;
+        src += 32;
+        len -= 32;
+    }
+    mask_sse2(dst, src, len, key);
+}
+
+#endif
+
+static mask_fn mask_kernel(void) {
+    static mask_fn kernel = NULL;
+    /* Racing threads would store the same value so there's no need
+       for synchronisation. */
+    if(dsock_fast(kernel)) return kernel;
+#if defined DSOCK_MASK_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) kernel = mask_avx2;
+    else if(__builtin_cpu_supports("sse2")) kernel = mask_sse2;
+    else kernel = mask_scalar;
+#else
+    kernel = mask_scalar;
+#endif
+    return kernel;
+}
+
+void mask_apply(uint8_t *dst, const uint8_t *src, size_t len,
+      const uint8_t *mask, size_t pos) {
+    /* Short buffers are not worth the setup. */
+    if(len < 8) {
+        size_t i;
+        for(i = 0; i != len; ++i)
+            dst[i] = src[i] ^ mask[(pos + i) % 4];
+        return;
+    }
+    uint8_t k[4];
+    size_t i;
+    for(i = 0; i != 4; ++i)
+        k[i] = mask[(pos + i) % 4];
+    uint32_t key;
+    memcpy(&key, k, 4);
+    mask_kernel()(dst, src, len, key);
+}
+
+size_t mask_iol(struct iolist *first, const uint8_t *mask, size_t pos) {
+    struct iolist *it;
+    for(it = first; it; it = it->iol_next) {
+        if(it->iol_base)
+            mask_apply(it->iol_base, it->iol_base, it->iol_len, mask, pos);
+        pos += it->iol_len;
+    }
+    return pos;
+}
+
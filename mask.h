@@ -0,0 +1,46 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_MASK_H_INCLUDED
+#define DSOCK_MASK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dsock.h"
+
+/* Copies len bytes from src to dst XORing them with the 4-byte mask.
+   pos is the offset of src within the masked data, i.e. the masking
+   starts at mask[pos % 4]. src and dst may be the same buffer but they
+   must not overlap otherwise. */
+void mask_apply(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t *mask, size_t pos);
+
+/* Masks the buffers of the iolist in place. Buffers with NULL base are
+   skipped but they still count towards the position. Returns position
+   after the last buffer. */
+size_t mask_iol(struct iolist *first, const uint8_t *mask, size_t pos);
+
+#endif
+
@@ -0,0 +1,336 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsock.h"
+#include "iol.h"
+#include "utils.h"
+
+dsock_unique_id(mbatch_type);
+
+static void *mbatch_hquery(struct hvfs *hvfs, const void *type);
+static void mbatch_hclose(struct hvfs *hvfs);
+static int mbatch_hdone(struct hvfs *hvfs, int64_t deadline);
+static int mbatch_msendl(struct msock_vfs *mvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static ssize_t mbatch_mrecvl(struct msock_vfs *mvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+
+/* Messages are packed into a container message, each one prefixed by its
+   size encoded as a varint (7 bits per byte, least significant group first,
+   high bit set on all bytes but the last one). Container is sent to the
+   underlying socket once there's no space left for the next message or when
+   maxdelay expires. Packing is done in the context of the caller. Background
+   coroutine only waits for the delay to expire. It is woken up via timerch
+   when the buffer becomes non-empty. If the background coroutine is sending
+   a container at the moment, the user waits on wakech till it's done. */
+
+/* Maximum size of a varint-encoded 64-bit number. */
+#define MBATCH_MAXVARINT 10
+
+struct mbatch_sock {
+    struct hvfs hvfs;
+    struct msock_vfs mvfs;
+    int s;
+    size_t maxbytes;
+    int64_t maxdelay;
+    /* Container being assembled. */
+    uint8_t *txbuf;
+    size_t txlen;
+    /* Time when the first message was put into the container. */
+    int64_t first;
+    /* Container being unpacked. */
+    uint8_t *rxbuf;
+    size_t rxlen;
+    size_t rxpos;
+    /* Container is being sent to the underlying socket. */
+    int busy;
+    /* User is waiting for the container to be sent. */
+    int waiting;
+    int err;
+    int timerch;
+    int wakech;
+    int timer;
+};
+
+static coroutine void mbatch_timer(struct mbatch_sock *obj);
+
+static void *mbatch_hquery(struct hvfs *hvfs, const void *type) {
+    struct mbatch_sock *obj = (struct mbatch_sock*)hvfs;
+    if(type == msock_type) return &obj->mvfs;
+    if(type == mbatch_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int mbatch_attach(int s, size_t maxbytes, int64_t maxdelay) {
+    int rc;
+    int err;
+    if(dsock_slow(maxbytes < 2)) {err = EINVAL; goto error1;}
+    /* Check whether underlying socket is message-based. */
+    if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct mbatch_sock *obj = malloc(sizeof(struct mbatch_sock));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = mbatch_hquery;
+    obj->hvfs.close = mbatch_hclose;
+    obj->hvfs.done = mbatch_hdone;
+    obj->mvfs.msendl = mbatch_msendl;
+    obj->mvfs.mrecvl = mbatch_mrecvl;
+    obj->s = s;
+    obj->maxbytes = maxbytes;
+    obj->maxdelay = maxdelay;
+    obj->txlen = 0;
+    obj->first = 0;
+    obj->rxlen = 0;
+    obj->rxpos = 0;
+    obj->busy = 0;
+    obj->waiting = 0;
+    obj->err = 0;
+    obj->txbuf = malloc(maxbytes);
+    if(dsock_slow(!obj->txbuf)) {err = ENOMEM; goto error2;}
+    obj->rxbuf = malloc(maxbytes);
+    if(dsock_slow(!obj->rxbuf)) {err = ENOMEM; goto error3;}
+    obj->timerch = chmake(sizeof(int));
+    if(dsock_slow(obj->timerch < 0)) {err = errno; goto error4;}
+    obj->wakech = chmake(sizeof(int));
+    if(dsock_slow(obj->wakech < 0)) {err = errno; goto error5;}
+    obj->timer = go(mbatch_timer(obj));
+    if(dsock_slow(obj->timer < 0)) {err = errno; goto error6;}
+    /* Create the handle. */
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error7;}
+    return h;
+error7:
+    rc = hclose(obj->timer);
+    dsock_assert(rc == 0);
+error6:
+    rc = hclose(obj->wakech);
+    dsock_assert(rc == 0);
+error5:
+    rc = hclose(obj->timerch);
+    dsock_assert(rc == 0);
+error4:
+    free(obj->rxbuf);
+error3:
+    free(obj->txbuf);
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+static int mbatch_free(struct mbatch_sock *obj) {
+    int rc = hclose(obj->timer);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->wakech);
+    dsock_assert(rc == 0);
+    rc = hclose(obj->timerch);
+    dsock_assert(rc == 0);
+    free(obj->rxbuf);
+    free(obj->txbuf);
+    int u = obj->s;
+    free(obj);
+    return u;
+}
+
+static size_t mbatch_varlen(uint64_t val) {
+    size_t len = 1;
+    while(val >= 0x80) {val >>= 7; ++len;}
+    return len;
+}
+
+static size_t mbatch_putvar(uint8_t *buf, uint64_t val) {
+    size_t pos = 0;
+    while(val >= 0x80) {
+        buf[pos++] = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    buf[pos++] = (uint8_t)val;
+    return pos;
+}
+
+/* Returns number of bytes consumed or -1 if the varint is malformed. */
+static int mbatch_getvar(const uint8_t *buf, size_t len, uint64_t *val) {
+    uint64_t res = 0;
+    size_t pos;
+    for(pos = 0; pos != MIN(len, MBATCH_MAXVARINT); ++pos) {
+        res |= (uint64_t)(buf[pos] & 0x7f) << (pos * 7);
+        if(!(buf[pos] & 0x80)) {*val = res; return pos + 1;}
+    }
+    return -1;
+}
+
+/* Wait till the container being sent by the background coroutine is out. */
+static int mbatch_wait(struct mbatch_sock *obj, int64_t deadline) {
+    while(dsock_slow(obj->busy)) {
+        obj->waiting = 1;
+        int dummy;
+        int rc = chrecv(obj->wakech, &dummy, sizeof(dummy), deadline);
+        obj->waiting = 0;
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    return 0;
+}
+
+/* Send the container to the underlying socket. Any failure is fatal
+   because it's not known whether the container was sent or not. */
+static int mbatch_flush(struct mbatch_sock *obj, int64_t deadline) {
+    obj->busy = 1;
+    int rc = msend(obj->s, obj->txbuf, obj->txlen, deadline);
+    obj->busy = 0;
+    int dummy = 0;
+    if(obj->waiting) chsend(obj->wakech, &dummy, sizeof(dummy), 0);
+    if(dsock_slow(rc < 0)) {obj->err = errno; return -1;}
+    obj->txlen = 0;
+    return 0;
+}
+
+static int mbatch_flushall(struct mbatch_sock *obj, int64_t deadline) {
+    int rc = mbatch_wait(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    if(!obj->txlen) return 0;
+    return mbatch_flush(obj, deadline);
+}
+
+int mbatch_detach(int s, int64_t deadline) {
+    struct mbatch_sock *obj = hquery(s, mbatch_type);
+    if(dsock_slow(!obj)) return -1;
+    /* If flushing fails the socket is left intact. */
+    int rc = mbatch_flushall(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    return mbatch_free(obj);
+}
+
+static int mbatch_hdone(struct hvfs *hvfs, int64_t deadline) {
+    struct mbatch_sock *obj = (struct mbatch_sock*)hvfs;
+    int rc = mbatch_flushall(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->err = EPIPE;
+    return hdone(obj->s, deadline);
+}
+
+static int mbatch_msendl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct mbatch_sock *obj = dsock_cont(mvfs, struct mbatch_sock, mvfs);
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    size_t sz = mbatch_varlen(len) + len;
+    if(dsock_slow(sz > obj->maxbytes)) {errno = EMSGSIZE; return -1;}
+    rc = mbatch_wait(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    /* If the message doesn't fit into the container send the container
+       straight away. */
+    if(obj->txlen + sz > obj->maxbytes) {
+        rc = mbatch_flush(obj, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    int empty = !obj->txlen;
+    obj->txlen += mbatch_putvar(obj->txbuf + obj->txlen, len);
+    iol_copy(first, obj->txbuf + obj->txlen);
+    obj->txlen += len;
+    /* No batching requested or the container is full. */
+    if(obj->maxdelay == 0 || obj->txlen == obj->maxbytes)
+        return mbatch_flush(obj, deadline);
+    /* Start the timer. */
+    if(empty && obj->maxdelay > 0) {
+        obj->first = now();
+        int dummy = 0;
+        chsend(obj->timerch, &dummy, sizeof(dummy), 0);
+    }
+    return 0;
+}
+
+static coroutine void mbatch_timer(struct mbatch_sock *obj) {
+    while(1) {
+        int64_t dd = -1;
+        if(obj->txlen && !obj->busy && obj->maxdelay > 0)
+            dd = obj->first + obj->maxdelay;
+        int dummy;
+        int rc = chrecv(obj->timerch, &dummy, sizeof(dummy), dd);
+        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
+        if(rc == 0) continue;
+        dsock_assert(errno == ETIMEDOUT);
+        /* User is sending the container at the moment or it was sent
+           in the meantime. */
+        if(obj->busy || !obj->txlen || now() < obj->first + obj->maxdelay)
+            continue;
+        rc = mbatch_flush(obj, -1);
+        /* The error will be reported to the user. */
+        if(dsock_slow(rc < 0)) return;
+    }
+}
+
+static ssize_t mbatch_mrecvl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct mbatch_sock *obj = dsock_cont(mvfs, struct mbatch_sock, mvfs);
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Get a new container if the current one was fully unpacked. */
+    while(obj->rxpos == obj->rxlen) {
+        ssize_t sz = mrecv(obj->s, obj->rxbuf, obj->maxbytes, deadline);
+        if(dsock_slow(sz < 0)) return -1;
+        obj->rxlen = sz;
+        obj->rxpos = 0;
+    }
+    /* Parse the size of the message. If the container is malformed
+       drop the rest of it. */
+    uint64_t sz;
+    size_t rmn = obj->rxlen - obj->rxpos;
+    int hdr = mbatch_getvar(obj->rxbuf + obj->rxpos, rmn, &sz);
+    if(dsock_slow(hdr < 0 || sz > rmn - hdr)) {
+        obj->rxpos = obj->rxlen; errno = EPROTO; return -1;}
+    uint8_t *pos = obj->rxbuf + obj->rxpos + hdr;
+    obj->rxpos += hdr + sz;
+    /* Message doesn't fit into the buffer. Drop it. */
+    if(dsock_slow(sz > len)) {errno = EMSGSIZE; return -1;}
+    /* Copy the message to the user's buffers. */
+    size_t rest = sz;
+    struct iolist *it;
+    for(it = first; it && rest; it = it->iol_next) {
+        size_t tocopy = MIN(it->iol_len, rest);
+        if(it->iol_base) memcpy(it->iol_base, pos, tocopy);
+        pos += tocopy;
+        rest -= tocopy;
+    }
+    return sz;
+}
+
+static void mbatch_hclose(struct hvfs *hvfs) {
+    struct mbatch_sock *obj = (struct mbatch_sock*)hvfs;
+    /* Pending batch is dropped. Sending it here could leave a partial
+       message in the underlying socket. */
+    int u = mbatch_free(obj);
+    int rc = hclose(u);
+    dsock_assert(rc == 0);
+}
@@ -28,6 +28,8 @@
 #include <stdlib.h>
 
 #include "dsock.h"
+#include "iol.h"
+#include "throttle.h"
 #include "utils.h"
 
 dsock_unique_id(mthrottler_type);
@@ -51,6 +53,19 @@ struct mthrottler_sock {
     size_t recv_remaining;
     int64_t recv_interval;
     int64_t recv_last;
+    /* Token bucket mode. Zero rate of the bucket means that the socket
+       has no limit of its own and is throttled only by the group. Byte
+       buckets are charged by the size of the message. */
+    struct throttle send_bucket;
+    struct throttle send_bytes;
+    int send_tb;
+    struct throttle recv_bucket;
+    struct throttle recv_bytes;
+    int recv_tb;
+    struct throttle_group *group;
+    /* In adaptive mode the send rate follows the congestion downstream. */
+    struct throttle_aimd send_aimd;
+    int adaptive;
 };
 
 static void *mthrottler_hquery(struct hvfs *hvfs, const void *type) {
@@ -61,6 +76,51 @@ static void *mthrottler_hquery(struct hvfs *hvfs, const void *type) {
     return NULL;
 }
 
+static struct mthrottler_sock *mthrottler_alloc(void) {
+    struct mthrottler_sock *obj = malloc(sizeof(struct mthrottler_sock));
+    if(dsock_slow(!obj)) return NULL;
+    obj->hvfs.query = mthrottler_hquery;
+    obj->hvfs.close = mthrottler_hclose;
+    obj->mvfs.msendl = mthrottler_msendl;
+    obj->mvfs.mrecvl = mthrottler_mrecvl;
+    obj->s = -1;
+    obj->send_full = 0;
+    obj->recv_full = 0;
+    obj->send_tb = 0;
+    obj->recv_tb = 0;
+    obj->send_bucket.rate = 0;
+    obj->send_bytes.rate = 0;
+    obj->recv_bucket.rate = 0;
+    obj->recv_bytes.rate = 0;
+    obj->group = NULL;
+    obj->adaptive = 0;
+    return obj;
+}
+
+/* Creates the handle and takes ownership of the underlying socket.
+   Deallocates the object in case of failure. */
+static int mthrottler_make(int s, struct mthrottler_sock *obj) {
+    int err;
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error1;}
+    /* Make a private copy of the underlying socket. */
+    obj->s = hdup(s);
+    if(dsock_slow(obj->s < 0)) {err = errno; goto error2;}
+    int rc = hclose(s);
+    dsock_assert(rc == 0);
+    return h;
+error2:
+    rc = hclose(h);
+    dsock_assert(rc == 0);
+    /* hclose() has already deallocated the object. */
+    errno = err;
+    return -1;
+error1:
+    free(obj);
+    errno = err;
+    return -1;
+}
+
 int mthrottler_attach(int s,
       uint64_t send_throughput, int64_t send_interval,
       uint64_t recv_throughput, int64_t recv_interval) {
@@ -72,49 +132,144 @@ int mthrottler_attach(int s,
     /* Check whether underlying socket is message-based. */
     if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
     /* Create the object. */
-    struct mthrottler_sock *obj = malloc(sizeof(struct mthrottler_sock));
+    struct mthrottler_sock *obj = mthrottler_alloc();
     if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
-    obj->hvfs.query = mthrottler_hquery;
-    obj->hvfs.close = mthrottler_hclose;
-    obj->mvfs.msendl = mthrottler_msendl;
-    obj->mvfs.mrecvl = mthrottler_mrecvl;
-    obj->s = -1;
-    obj->send_full = 0;
     if(send_throughput > 0) {
         obj->send_full = send_throughput * send_interval / 1000;
         obj->send_remaining = obj->send_full;
         obj->send_interval = send_interval;
         obj->send_last = now();
     }
-    obj->recv_full = 0;
     if(recv_throughput > 0) {
         obj->recv_full = recv_throughput * recv_interval / 1000;
         obj->recv_remaining = obj->recv_full;
         obj->recv_interval = recv_interval;
         obj->recv_last = now();
     }
-    /* Create the handle. */
-    int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {err = errno; goto error2;}
-    /* Make a private copy of the underlying socket. */
-    obj->s = hdup(s);
-    if(dsock_slow(obj->s < 0)) {err = errno; goto error3;}
-    int rc = hclose(s);
-    dsock_assert(rc == 0);
-    return h;
-error3:
-    rc = hclose(h);
-    dsock_assert(rc == 0);
-error2:
-    free(obj);
+    return mthrottler_make(s, obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+static void mthrottler_adjust(struct mthrottler_sock *obj) {
+    struct throttle_group *grp = obj->group;
+    obj->send_tb = obj->send_bucket.rate || obj->send_bytes.rate ||
+        (grp && grp->send.rate);
+    obj->recv_tb = obj->recv_bucket.rate || obj->recv_bytes.rate ||
+        (grp && grp->recv.rate);
+}
+
+int mthrottler_attach_bucket(int s,
+      uint64_t send_rate, uint64_t send_burst,
+      uint64_t recv_rate, uint64_t recv_burst) {
+    int err;
+    if(dsock_slow(send_rate > THROTTLE_MAXRATE ||
+          recv_rate > THROTTLE_MAXRATE)) {
+        err = EINVAL; goto error1;}
+    /* Check whether underlying socket is message-based. */
+    if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct mthrottler_sock *obj = mthrottler_alloc();
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    if(send_rate > 0)
+        throttle_init(&obj->send_bucket, send_rate, send_burst);
+    if(recv_rate > 0)
+        throttle_init(&obj->recv_bucket, recv_rate, recv_burst);
+    mthrottler_adjust(obj);
+    return mthrottler_make(s, obj);
 error1:
     errno = err;
     return -1;
 }
 
+/* Intervals specify how much traffic can be passed at once, same way as in
+   the fixed-window mode. */
+int mthrottler_attach_dual(int s,
+      uint64_t send_throughput, uint64_t send_bytes, int64_t send_interval,
+      uint64_t recv_throughput, uint64_t recv_bytes, int64_t recv_interval) {
+    int err;
+    if(dsock_slow((send_throughput || send_bytes) && send_interval <= 0)) {
+        err = EINVAL; goto error1;}
+    if(dsock_slow((recv_throughput || recv_bytes) && recv_interval <= 0)) {
+        err = EINVAL; goto error1;}
+    if(dsock_slow(send_throughput > THROTTLE_MAXRATE ||
+          send_bytes > THROTTLE_MAXRATE ||
+          recv_throughput > THROTTLE_MAXRATE ||
+          recv_bytes > THROTTLE_MAXRATE)) {
+        err = EINVAL; goto error1;}
+    /* Check whether underlying socket is message-based. */
+    if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct mthrottler_sock *obj = mthrottler_alloc();
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    if(send_throughput > 0)
+        throttle_init(&obj->send_bucket, send_throughput,
+            send_throughput * send_interval / 1000);
+    if(send_bytes > 0)
+        throttle_init(&obj->send_bytes, send_bytes,
+            send_bytes * send_interval / 1000);
+    if(recv_throughput > 0)
+        throttle_init(&obj->recv_bucket, recv_throughput,
+            recv_throughput * recv_interval / 1000);
+    if(recv_bytes > 0)
+        throttle_init(&obj->recv_bytes, recv_bytes,
+            recv_bytes * recv_interval / 1000);
+    mthrottler_adjust(obj);
+    return mthrottler_make(s, obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int mthrottler_attach_adaptive(int s, uint64_t minrate, uint64_t maxrate,
+      int64_t latency) {
+    int err;
+    if(dsock_slow(minrate == 0 || minrate > maxrate ||
+          maxrate > THROTTLE_MAXRATE || latency <= 0)) {
+        err = EINVAL; goto error1;}
+    /* Check whether underlying socket is message-based. */
+    if(dsock_slow(!hquery(s, msock_type))) {err = errno; goto error1;}
+    /* Create the object. */
+    struct mthrottler_sock *obj = mthrottler_alloc();
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    throttle_aimd_init(&obj->send_aimd, &obj->send_bucket, minrate, maxrate,
+        latency);
+    obj->adaptive = 1;
+    mthrottler_adjust(obj);
+    return mthrottler_make(s, obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+int64_t mthrottler_rate(int s) {
+    struct mthrottler_sock *obj = hquery(s, mthrottler_type);
+    if(dsock_slow(!obj)) return -1;
+    return obj->send_bucket.rate;
+}
+
+int mthrottler_join(int s, int g) {
+    struct mthrottler_sock *obj = hquery(s, mthrottler_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Groups can't be combined with fixed-window throttling. */
+    if(dsock_slow(obj->send_full || obj->recv_full)) {
+        errno = EINVAL; return -1;}
+    struct throttle_group *grp = NULL;
+    if(g >= 0) {
+        grp = throttle_group_join(g);
+        if(dsock_slow(!grp)) return -1;
+    }
+    if(obj->group) throttle_group_leave(obj->group);
+    obj->group = grp;
+    mthrottler_adjust(obj);
+    return 0;
+}
+
 int mthrottler_detach(int s) {
     struct mthrottler_sock *obj = hquery(s, mthrottler_type);
     if(dsock_slow(!obj)) return -1;
+    if(obj->group) throttle_group_leave(obj->group);
     int u = obj->s;
     free(obj);
     return u;
@@ -125,7 +280,31 @@ static int mthrottler_msendl(struct msock_vfs *mvfs,
     struct mthrottler_sock *obj =
         dsock_cont(mvfs, struct mthrottler_sock, mvfs);
     /* If send-throttling is off forward the call. */
-    if(obj->send_full == 0) return msendl(obj->s, first, last, deadline);
+    if(obj->send_full == 0 && !obj->send_tb)
+        return msendl(obj->s, first, last, deadline);
+    if(obj->send_tb) {
+        size_t len = 0;
+        if(obj->send_bytes.rate) {
+            int rc = iol_check(first, last, NULL, &len);
+            if(dsock_slow(rc < 0)) return -1;
+        }
+        struct throttle_group *grp = obj->group;
+        struct throttle *b[3] = {
+            obj->send_bucket.rate ? &obj->send_bucket : NULL,
+            obj->send_bytes.rate ? &obj->send_bytes : NULL,
+            grp && grp->send.rate ? &grp->send : NULL};
+        uint64_t units[3] = {1, len, 1};
+        int rc = throttle_acquire(b, units, 3, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        int64_t start = now();
+        rc = msendl(obj->s, first, last, deadline);
+        if(obj->adaptive && (rc == 0 || errno == ETIMEDOUT))
+            throttle_aimd_adjust(&obj->send_aimd, &obj->send_bucket,
+                now() - start);
+        if(dsock_slow(rc < 0)) return -1;
+        if(grp) grp->send_units++;
+        return 0;
+    }
     /* If there's no quota wait till it is renewed. */
     if(!obj->send_remaining) {
         int rc = msleep(obj->send_last + obj->send_interval);
@@ -145,7 +324,25 @@ static ssize_t mthrottler_mrecvl(struct msock_vfs *mvfs,
     struct mthrottler_sock *obj =
         dsock_cont(mvfs, struct mthrottler_sock, mvfs);
     /* If recv-throttling is off forward the call. */
-    if(obj->recv_full == 0) return mrecvl(obj->s, first, last, deadline);
+    if(obj->recv_full == 0 && !obj->recv_tb)
+        return mrecvl(obj->s, first, last, deadline);
+    if(obj->recv_tb) {
+        /* Size of the message is not known in advance. Wait till the byte
+           bucket is out of debt and charge it once the message arrives. */
+        struct throttle_group *grp = obj->group;
+        struct throttle *b[3] = {
+            obj->recv_bucket.rate ? &obj->recv_bucket : NULL,
+            obj->recv_bytes.rate ? &obj->recv_bytes : NULL,
+            grp && grp->recv.rate ? &grp->recv : NULL};
+        uint64_t units[3] = {1, 0, 1};
+        int rc = throttle_acquire(b, units, 3, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        ssize_t sz = mrecvl(obj->s, first, last, deadline);
+        if(dsock_slow(sz < 0)) return -1;
+        if(obj->recv_bytes.rate) throttle_charge(&obj->recv_bytes, sz);
+        if(grp) grp->recv_units++;
+        return sz;
+    }
     /* If there's no quota wait till it is renewed. */
     if(!obj->recv_remaining) {
         int rc = msleep(obj->recv_last + obj->recv_interval);
@@ -162,6 +359,7 @@ static ssize_t mthrottler_mrecvl(struct msock_vfs *mvfs,
 
 static void mthrottler_hclose(struct hvfs *hvfs) {
     struct mthrottler_sock *obj = (struct mthrottler_sock*)hvfs;
+    if(obj->group) throttle_group_leave(obj->group);
     if(dsock_fast(obj->s >= 0)) {
         int rc = hclose(obj->s);
         dsock_assert(rc == 0);
@@ -36,29 +36,80 @@ dsock_unique_id(nagle_type);
 
 static void *nagle_hquery(struct hvfs *hvfs, const void *type);
 static void nagle_hclose(struct hvfs *hvfs);
+static int nagle_hdone(struct hvfs *hvfs, int64_t deadline);
 static int nagle_bsendl(struct bsock_vfs *bvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
 static int nagle_brecvl(struct bsock_vfs *bvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
-static coroutine void nagle_sender(int s, size_t batch, int64_t interval,
-    uint8_t *buf, int sendch, int ackch);
 
-struct nagle_vec {
-    struct iolist *first;
-    struct iolist *last;
-    size_t len;
-};
+/* Buffering is done directly in the context of the caller. There are two
+   buffers. When the current one fills up it is handed over to the background
+   coroutine which sends it to the underlying socket while the user continues
+   writing into the other one. The user has to wait only if the second buffer
+   fills up before the first one was sent. The background coroutine also
+   flushes the current buffer once the interval expires. It is woken up via
+   flushch only when a full buffer is handed over or when the current buffer
+   becomes non-empty. The user waits on wakech till the buffer in flight
+   is sent.
+
+   In adaptive mode the effective batch and interval are recomputed after
+   each flush from moving averages of the gap between writes, arrival rate
+   of the data and time spent in the underlying send. When writes are sparse
+   there's nothing to coalesce and the buffer is flushed after the minimal
+   interval. Under load the interval follows the gap between writes and the
+   batch is sized to absorb the data arriving during the interval plus one
+   underlying send. */
+
+/* Moving averages are kept in fixed point with 8 fractional bits. */
+#define NAGLE_FP 8
 
 struct nagle_sock {
     struct hvfs hvfs;
     struct bsock_vfs bvfs;
     int s;
-    uint8_t *buf;
-    int sendch;
-    int ackch;
-    int sender;
+    /* Effective batch size and flush interval. */
+    size_t batch;
+    int64_t interval;
+    /* Bounds for the above. Min and max are the same in non-adaptive mode. */
+    size_t minbatch;
+    size_t maxbatch;
+    int64_t mininterval;
+    int64_t maxinterval;
+    int adaptive;
+    /* Last time user has written some data. */
+    int64_t arrival;
+    /* Moving average of gap between writes, in milliseconds. */
+    int64_t gap;
+    /* Moving average of arrival rate, in bytes per millisecond. */
+    int64_t rate;
+    /* Moving average of duration of underlying sends, in milliseconds. */
+    int64_t latency;
+    uint64_t size_flushes;
+    uint64_t timeout_flushes;
+    uint64_t bypasses;
+    /* User writes into bufs[cur]. bufs[!cur] may be in flight. */
+    uint8_t *bufs[2];
+    int cur;
+    /* Amount of data in the current buffer. */
+    size_t len;
+    /* Amount of data being sent by the background coroutine. */
+    size_t inflight;
+    /* Last time a batch was flushed. */
+    int64_t last;
+    /* User is writing directly to the underlying socket. */
+    int busy;
+    /* User is waiting for the buffer in flight to be sent. */
+    int waiting;
+    /* Sticky error. A failed send may have left part of a batch in the
+       underlying socket, so there's no way to recover. */
+    int err;
+    int flushch;
+    int wakech;
+    int flusher;
 };
 
+static coroutine void nagle_flusher(struct nagle_sock *obj);
+
 static void *nagle_hquery(struct hvfs *hvfs, const void *type) {
     struct nagle_sock *obj = (struct nagle_sock*)hvfs;
     if(type == bsock_type) return &obj->bvfs;
@@ -67,7 +118,8 @@ static void *nagle_hquery(struct hvfs *hvfs, const void *type) {
     return NULL;
 }
 
-int nagle_attach(int s, size_t batch, int64_t interval) {
+static int nagle_create(int s, size_t minbatch, size_t maxbatch,
+      int64_t mininterval, int64_t maxinterval, int adaptive) {
     int rc;
     int err;
     /* Check whether underlying socket is a bytestream. */
@@ -77,33 +129,59 @@ int nagle_attach(int s, size_t batch, int64_t interval) {
     if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
     obj->hvfs.query = nagle_hquery;
     obj->hvfs.close = nagle_hclose;
+    obj->hvfs.done = nagle_hdone;
     obj->bvfs.bsendl = nagle_bsendl;
     obj->bvfs.brecvl = nagle_brecvl;
     obj->s = s;
-    obj->buf = malloc(batch);
-    if(dsock_slow(!obj->buf)) {errno = ENOMEM; goto error2;}
-    obj->sendch = chmake(sizeof(struct nagle_vec));
-    if(dsock_slow(obj->sendch < 0)) {err = errno; goto error3;}
-    obj->ackch = chmake(sizeof(int));
-    if(dsock_slow(obj->ackch < 0)) {err = errno; goto error4;}
-    obj->sender = go(nagle_sender(s, batch, interval,
-        obj->buf, obj->sendch, obj->ackch));
-    if(dsock_slow(obj->sender < 0)) {err = errno; goto error5;}
+    obj->minbatch = minbatch;
+    obj->maxbatch = maxbatch;
+    obj->mininterval = mininterval;
+    obj->maxinterval = maxinterval;
+    obj->adaptive = adaptive;
+    /* Start in low-latency mode. */
+    obj->batch = minbatch;
+    obj->interval = mininterval;
+    obj->arrival = now();
+    obj->gap = (int64_t)maxinterval << NAGLE_FP;
+    obj->rate = 0;
+    obj->latency = 0;
+    obj->size_flushes = 0;
+    obj->timeout_flushes = 0;
+    obj->bypasses = 0;
+    obj->cur = 0;
+    obj->len = 0;
+    obj->inflight = 0;
+    obj->last = obj->arrival;
+    obj->busy = 0;
+    obj->waiting = 0;
+    obj->err = 0;
+    obj->bufs[0] = malloc(maxbatch);
+    if(dsock_slow(!obj->bufs[0])) {err = ENOMEM; goto error2;}
+    obj->bufs[1] = malloc(maxbatch);
+    if(dsock_slow(!obj->bufs[1])) {err = ENOMEM; goto error3;}
+    obj->flushch = chmake(sizeof(int));
+    if(dsock_slow(obj->flushch < 0)) {err = errno; goto error4;}
+    obj->wakech = chmake(sizeof(int));
+    if(dsock_slow(obj->wakech < 0)) {err = errno; goto error5;}
+    obj->flusher = go(nagle_flusher(obj));
+    if(dsock_slow(obj->flusher < 0)) {err = errno; goto error6;}
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {err = errno; goto error6;}
+    if(dsock_slow(h < 0)) {err = errno; goto error7;}
     return h;
+error7:
+    rc = hclose(obj->flusher);
+    dsock_assert(rc == 0);
 error6:
-    rc = hclose(obj->sender);
+    rc = hclose(obj->wakech);
     dsock_assert(rc == 0);
 error5:
-    rc = hclose(obj->ackch);
+    rc = hclose(obj->flushch);
     dsock_assert(rc == 0);
 error4:
-    rc = hclose(obj->sendch);
-    dsock_assert(rc == 0);
+    free(obj->bufs[1]);
 error3:
-    free(obj->buf);
+    free(obj->bufs[0]);
 error2:
     free(obj);
 error1:
@@ -111,107 +189,217 @@ error1:
     return -1;
 }
 
-int nagle_detach(int s, int64_t deadline) {
+int nagle_attach(int s, size_t batch, int64_t interval) {
+    return nagle_create(s, batch, batch, interval, interval, 0);
+}
+
+int nagle_attach_adaptive(int s, size_t minbatch, size_t maxbatch,
+      int64_t mininterval, int64_t maxinterval) {
+    if(dsock_slow(minbatch == 0 || minbatch > maxbatch || mininterval < 0 ||
+          mininterval > maxinterval)) {
+        errno = EINVAL; return -1;}
+    return nagle_create(s, minbatch, maxbatch, mininterval, maxinterval, 1);
+}
+
+int nagle_stats(int s, struct nagle_stats *stats) {
     struct nagle_sock *obj = hquery(s, nagle_type);
     if(dsock_slow(!obj)) return -1;
-    /* TODO: Flush the data from the buffer! */
-    int rc = hclose(obj->sender);
+    if(dsock_slow(!stats)) {errno = EINVAL; return -1;}
+    stats->batch = obj->batch;
+    stats->interval = obj->interval;
+    stats->size_flushes = obj->size_flushes;
+    stats->timeout_flushes = obj->timeout_flushes;
+    stats->bypasses = obj->bypasses;
+    return 0;
+}
+
+static int nagle_free(struct nagle_sock *obj) {
+    int rc = hclose(obj->flusher);
     dsock_assert(rc == 0);
-    rc = hclose(obj->ackch);
+    rc = hclose(obj->wakech);
     dsock_assert(rc == 0);
-    rc = hclose(obj->sendch);
+    rc = hclose(obj->flushch);
     dsock_assert(rc == 0);
-    free(obj->buf);
+    free(obj->bufs[0]);
+    free(obj->bufs[1]);
     int u = obj->s;
     free(obj);
     return u;
 }
 
+static void nagle_ewma(int64_t *avg, int64_t sample) {
+    *avg += ((sample << NAGLE_FP) - *avg) / 8;
+}
+
+/* Called when a batch of data is flushed. Updates the arrival rate and
+   adjusts batch size and interval accordingly. */
+static void nagle_account(struct nagle_sock *obj, size_t bytes) {
+    int64_t nw = now();
+    nagle_ewma(&obj->rate, bytes / MAX(nw - obj->last, 1));
+    obj->last = nw;
+    if(!obj->adaptive) return;
+    /* If writes are sparse waiting for the next one only adds latency. */
+    int64_t interval = obj->gap * 2 >> NAGLE_FP;
+    if(interval > obj->maxinterval) interval = obj->mininterval;
+    obj->interval = MAX(interval, obj->mininterval);
+    /* Make the buffer large enough to absorb the data arriving while
+       waiting for the interval to expire and while the previous batch is
+       being sent. */
+    uint64_t batch = obj->rate * (obj->interval + 1 +
+        (obj->latency >> NAGLE_FP)) >> NAGLE_FP;
+    obj->batch = MAX(MIN(batch, obj->maxbatch), obj->minbatch);
+}
+
+/* Send data to the underlying socket and measure how long it takes. */
+static int nagle_send(struct nagle_sock *obj, struct iolist *first,
+      struct iolist *last, int64_t deadline) {
+    int64_t start = now();
+    int rc = bsendl(obj->s, first, last, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    nagle_ewma(&obj->latency, now() - start);
+    return 0;
+}
+
+/* Wake up the background coroutine. If it's not waiting at the moment
+   it will check the state anyway before it goes to sleep once again. */
+static void nagle_kick(struct nagle_sock *obj) {
+    int dummy = 0;
+    chsend(obj->flushch, &dummy, sizeof(dummy), 0);
+}
+
+/* Wait till the buffer in flight is sent. */
+static int nagle_wait(struct nagle_sock *obj, int64_t deadline) {
+    while(dsock_slow(obj->inflight)) {
+        obj->waiting = 1;
+        int dummy;
+        int rc = chrecv(obj->wakech, &dummy, sizeof(dummy), deadline);
+        obj->waiting = 0;
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    return 0;
+}
+
+/* Send all the buffered data in the context of the caller. */
+static int nagle_flushall(struct nagle_sock *obj, int64_t deadline) {
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
+    int rc = nagle_wait(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    if(!obj->len) return 0;
+    obj->busy = 1;
+    nagle_account(obj, obj->len);
+    struct iolist iol = {obj->bufs[obj->cur], obj->len, NULL, 0};
+    rc = nagle_send(obj, &iol, &iol, deadline);
+    obj->busy = 0;
+    if(dsock_slow(rc < 0)) {obj->err = errno; return -1;}
+    obj->len = 0;
+    return 0;
+}
+
+int nagle_detach(int s, int64_t deadline) {
+    struct nagle_sock *obj = hquery(s, nagle_type);
+    if(dsock_slow(!obj)) return -1;
+    /* If flushing fails the socket is left intact. */
+    int rc = nagle_flushall(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    return nagle_free(obj);
+}
+
+static int nagle_hdone(struct hvfs *hvfs, int64_t deadline) {
+    struct nagle_sock *obj = (struct nagle_sock*)hvfs;
+    int rc = nagle_flushall(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->err = EPIPE;
+    return hdone(obj->s, deadline);
+}
+
 static int nagle_bsendl(struct bsock_vfs *bvfs,
       struct iolist *first, struct iolist *last, int64_t deadline) {
     struct nagle_sock *obj = dsock_cont(bvfs, struct nagle_sock, bvfs);
+    if(dsock_slow(obj->err)) {errno = obj->err; return -1;}
     size_t len;
     int rc = iol_check(first, last, NULL, &len);
     if(dsock_slow(rc < 0)) return -1;
-    /* Send is done in a worker coroutine. */
-    struct nagle_vec vec = {first, last, len};
-    rc = chsend(obj->sendch, &vec, sizeof(vec), deadline);
-    if(dsock_slow(rc < 0)) return -1;
-    /* Wait till worker is done. */
-    int err;
-    rc = chrecv(obj->ackch, &err, sizeof(err), deadline);
+    if(obj->adaptive) {
+        int64_t nw = now();
+        nagle_ewma(&obj->gap, nw - obj->arrival);
+        obj->arrival = nw;
+    }
+    /* Fast path: If data fit into the buffer, store them there. */
+    if(dsock_fast(obj->len + len < obj->batch)) {
+        int empty = !obj->len;
+        iol_copy(first, obj->bufs[obj->cur] + obj->len);
+        obj->len += len;
+        /* Start the interval timer. */
+        if(empty && obj->interval >= 0) nagle_kick(obj);
+        return 0;
+    }
+    /* Current buffer is full. Wait till the other one is available. */
+    rc = nagle_wait(obj, deadline);
     if(dsock_slow(rc < 0)) return -1;
-    if(dsock_slow(rc < 0)) {errno = err; return -1;}
+    /* This is a big chunk of data, no need to Nagle it. Send it straight
+       away along with whatever is in the buffer. */
+    if(len >= obj->batch) {
+        obj->busy = 1;
+        nagle_account(obj, obj->len + len);
+        struct iolist iol = {obj->bufs[obj->cur], obj->len, first, 0};
+        rc = nagle_send(obj, obj->len ? &iol : first, last, deadline);
+        obj->busy = 0;
+        if(dsock_slow(rc < 0)) {obj->err = errno; return -1;}
+        obj->len = 0;
+        obj->bypasses++;
+        return 0;
+    }
+    /* Hand the buffer over to the background coroutine and continue
+       with the other one. */
+    nagle_account(obj, obj->len);
+    obj->inflight = obj->len;
+    obj->cur = !obj->cur;
+    obj->len = 0;
+    obj->size_flushes++;
+    nagle_kick(obj);
+    iol_copy(first, obj->bufs[obj->cur]);
+    obj->len = len;
     return 0;
 }
 
-static coroutine void nagle_sender(int s, size_t batch, int64_t interval,
-      uint8_t *buf, int sendch, int ackch) {
-    /* Amount of data in the buffer. */
-    size_t len = 0;
-    /* Last time at least one byte was sent. */
-    int64_t last = now();
+static coroutine void nagle_flusher(struct nagle_sock *obj) {
     while(1) {
-        /* Get data to send from the user coroutine. */
-        struct nagle_vec vec;
-        int rc = chrecv(sendch, &vec, sizeof(vec),
-            interval >= 0 && len ? last + interval : -1);
-        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        /* Timeout expired. Flush the data in the buffer. */
-        if(dsock_slow(rc < 0 && errno == ETIMEDOUT)) {
-            rc = bsend(s, buf, len, -1);
-            if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            dsock_assert(rc == 0);
-            len = 0;
-            last = now();
-            continue;
-        }
-        dsock_assert(rc == 0);
-        /* If data fit into the buffer, store them there. */
-        if(len + vec.len < batch) {
-            iol_copy(vec.first, buf + len);
-            len += vec.len;
-            int err = 0;
-            rc = chsend(ackch, &err, sizeof(err), -1);
-            if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            dsock_assert(rc == 0);
-            continue;
-        }
-        if(len > 0) {
-            /* Flush the buffer. */
-            rc = bsend(s, buf, len, -1);
+        if(!obj->inflight) {
+            /* Wait till there's a full buffer to send or till there's
+               something in the current buffer and the interval expires. */
+            int64_t dd = -1;
+            if(obj->len && !obj->busy && obj->interval >= 0)
+                dd = obj->last + obj->interval;
+            int dummy;
+            int rc = chrecv(obj->flushch, &dummy, sizeof(dummy), dd);
             if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            /* Pass the error to the user. */
-            if(dsock_slow(rc < 0)) {
-                int err = errno;
-                rc = chsend(ackch, &err, sizeof(err), -1);
-                if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-                dsock_assert(rc == 0);
-                return;
+            if(rc < 0) {
+                dsock_assert(errno == ETIMEDOUT);
+                /* User is using the socket at the moment or the buffer was
+                   flushed in the meantime. */
+                if(obj->inflight || obj->busy || !obj->len ||
+                      now() < obj->last + obj->interval)
+                    continue;
+                /* Interval expired. Flush the current buffer. */
+                nagle_account(obj, obj->len);
+                obj->inflight = obj->len;
+                obj->cur = !obj->cur;
+                obj->len = 0;
+                obj->timeout_flushes++;
             }
-            len = 0;
-            last = now();
+            if(!obj->inflight) continue;
         }
-        /* Once again: If data fit into buffer store them there. */
-        if(vec.len < batch) {
-            iol_copy(vec.first, buf);
-            len = vec.len;
-            int err = 0;
-            rc = chsend(ackch, &err, sizeof(err), -1);
-            if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-            dsock_assert(rc == 0);
-            continue;
-        }
-        /* This is a big chunk of data, no need to Nagle it.
-           We'll send it straight away. */
-        rc = bsendl(s, vec.first, vec.last, -1);
+        /* Send the buffer in flight. */
+        struct iolist iol = {obj->bufs[!obj->cur], obj->inflight, NULL, 0};
+        int rc = nagle_send(obj, &iol, &iol, -1);
         if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        dsock_assert(rc == 0);
-        last = now();
-        int err = 0;
-        rc = chsend(ackch, &err, sizeof(err), -1);
-        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
-        dsock_assert(rc == 0);
+        /* Pass the error to the user. */
+        if(dsock_slow(rc < 0)) obj->err = errno;
+        obj->inflight = 0;
+        int dummy = 0;
+        if(obj->waiting) chsend(obj->wakech, &dummy, sizeof(dummy), 0);
+        if(dsock_slow(obj->err)) return;
     }
 }
 
@@ -223,15 +411,9 @@ static int nagle_brecvl(struct bsock_vfs *bvfs,
 
 static void nagle_hclose(struct hvfs *hvfs) {
     struct nagle_sock *obj = (struct nagle_sock*)hvfs;
-    int rc = hclose(obj->sender);
-    dsock_assert(rc == 0);
-    rc = hclose(obj->ackch);
+    /* Buffered data are dropped. Sending them here could leave a partial
+       record in the underlying socket. */
+    int u = nagle_free(obj);
+    int rc = hclose(u);
     dsock_assert(rc == 0);
-    rc = hclose(obj->sendch);
-    dsock_assert(rc == 0);
-    free(obj->buf);
-    rc = hclose(obj->s);
-    dsock_assert(rc == 0);
-    free(obj);
 }
-
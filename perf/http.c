@@ -0,0 +1,119 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures receiving of pipelined HTTP requests over an IPC connection,
+   i.e. reading the header from the socket as well as parsing it.
+   Usage: http [requests] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+/* Request sent by a web browser. */
+static const char browser[] =
+    "GET /dashboard/metrics?range=24h&tz=Europe%2FPrague HTTP/1.1\r\n"
+    "Host: monitoring.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/58.0.3029.110 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/webp,*/*;q=0.8\r\n"
+    "Referer: https://monitoring.example.com/dashboard\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.8,cs;q=0.6\r\n"
+    "Cookie: session=8f3a9c1e7b2d4f6a0c5e9b3d7f1a2c4e; theme=dark; "
+        "_ga=GA1.2.1234567890.1497000000\r\n"
+    "\r\n";
+
+/* Request sent by an API client. */
+static const char api[] =
+    "POST /v1/events HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 25\r\n"
+    "\r\n"
+    "{\"event\":\"click\",\"id\":42}";
+
+/* Sends n copies of the request, many of them in a single call. */
+coroutine void feed(int s, const char *req, size_t len, size_t n) {
+    size_t batch = 65536 / len;
+    char *buf = malloc(batch * len);
+    assert(buf);
+    size_t i;
+    for(i = 0; i != batch; ++i)
+        memcpy(buf + i * len, req, len);
+    while(n) {
+        size_t cnt = n < batch ? n : batch;
+        int rc = bsend(s, buf, cnt * len, -1);
+        assert(rc == 0);
+        n -= cnt;
+    }
+    free(buf);
+}
+
+static void measure(const char *name, const char *req, int n) {
+    size_t len = strlen(req);
+    int s[2];
+    int rc = ipc_pair(s);
+    assert(rc == 0);
+    int h = http_attach(s[1]);
+    assert(h >= 0);
+    int cr = go(feed(s[0], req, len, n));
+    assert(cr >= 0);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != n; ++i) {
+        char command[16];
+        char resource[256];
+        rc = http_recvrequest(h, command, sizeof(command), resource,
+            sizeof(resource), -1);
+        assert(rc == 0);
+        struct http_field *fields;
+        ssize_t nfields = http_recvheaders(h, &fields, -1);
+        assert(nfields > 0);
+        /* Body, if any, is skipped when the next request is received. */
+    }
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-8s %10.0f requests/s %10.3f MB/s\n", name,
+        (double)n * 1000 / elapsed, (double)n * len / 1000 / elapsed);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(h);
+    assert(rc == 0);
+    rc = hclose(s[0]);
+    assert(rc == 0);
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    measure("browser", browser, n);
+    measure("api", api, n);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures rate of small messages with and without the keepalive layer.
+   Also measures memory used by an idle connection with and without
+   the keepalive layer.
+   Usage: keepalive [message-size] [messages] [idle-connections] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../dsock.h"
+
+coroutine void drain(int s, int n, int done) {
+    char buf[4096];
+    int i;
+    for(i = 0; i != n; ++i) {
+        ssize_t sz = mrecv(s, buf, sizeof(buf), -1);
+        assert(sz >= 0);
+    }
+    int val = 0;
+    int rc = chsend(done, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+static void measure(const char *name, int usekeepalive, size_t sz, int n) {
+    int s[2];
+    int rc = ipc_pair(s);
+    assert(rc == 0);
+    int h0 = pfx_attach(s[0]);
+    assert(h0 >= 0);
+    int h1 = pfx_attach(s[1]);
+    assert(h1 >= 0);
+    if(usekeepalive) {
+        h0 = keepalive_attach(h0, 1000, -1);
+        assert(h0 >= 0);
+        h1 = keepalive_attach(h1, -1, 3000);
+        assert(h1 >= 0);
+    }
+    int done = chmake(sizeof(int));
+    assert(done >= 0);
+    int cr = go(drain(h1, n, done));
+    assert(cr >= 0);
+    char *buf = malloc(sz);
+    assert(buf);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != n; ++i) {
+        rc = msend(h0, buf, sz, -1);
+        assert(rc == 0);
+    }
+    int val;
+    rc = chrecv(done, &val, sizeof(val), -1);
+    assert(rc == 0);
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-10s %10.0f msgs/s\n", name, (double)n * 1000 / elapsed);
+    free(buf);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(done);
+    assert(rc == 0);
+    rc = hclose(h0);
+    assert(rc == 0);
+    rc = hclose(h1);
+    assert(rc == 0);
+}
+
+/* Resident set size of the process, in bytes. */
+static long rss(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) return 0;
+    long size, resident;
+    int rc = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+    if(rc != 2) return 0;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void measure_idle(const char *name, int usekeepalive, int n) {
+    int *hs = malloc(sizeof(int) * n * 2);
+    assert(hs);
+    long before = rss();
+    int i;
+    for(i = 0; i != n; ++i) {
+        int s[2];
+        int rc = ipc_pair(s);
+        assert(rc == 0);
+        hs[i * 2] = pfx_attach(s[0]);
+        assert(hs[i * 2] >= 0);
+        hs[i * 2 + 1] = s[1];
+        if(usekeepalive) {
+            hs[i * 2] = keepalive_attach(hs[i * 2], 1000, -1);
+            assert(hs[i * 2] >= 0);
+        }
+    }
+    /* Let the sockets settle down. */
+    int rc = msleep(now() + 100);
+    assert(rc == 0);
+    long after = rss();
+    printf("%-10s %10ld bytes per idle connection\n", name,
+        (after - before) / n);
+    for(i = 0; i != n * 2; ++i) {
+        rc = hclose(hs[i]);
+        assert(rc == 0);
+    }
+    free(hs);
+}
+
+int main(int argc, char *argv[]) {
+    size_t sz = argc > 1 ? atoi(argv[1]) : 16;
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    int idle = argc > 3 ? atoi(argv[3]) : 400;
+    measure("pfx", 0, sz, n);
+    measure("keepalive", 1, sz, n);
+    measure_idle("pfx", 0, idle);
+    measure_idle("keepalive", 1, idle);
+    return 0;
+}
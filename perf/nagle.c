@@ -0,0 +1,95 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures throughput of small writes through the Nagle layer.
+   Usage: nagle [write-size] [writes] [batch] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../dsock.h"
+
+coroutine void drain(int s, size_t total, int done) {
+    char buf[4096];
+    while(total) {
+        size_t sz = total < sizeof(buf) ? total : sizeof(buf);
+        int rc = brecv(s, buf, sz, -1);
+        assert(rc == 0);
+        total -= sz;
+    }
+    int val = 0;
+    int rc = chsend(done, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+static void measure(const char *name, int usenagle, size_t sz, int n,
+      size_t batch) {
+    int s[2];
+    int rc = ipc_pair(s);
+    assert(rc == 0);
+    int h = s[0];
+    if(usenagle) {
+        h = nagle_attach(s[0], batch, 10);
+        assert(h >= 0);
+    }
+    int done = chmake(sizeof(int));
+    assert(done >= 0);
+    int cr = go(drain(s[1], sz * n, done));
+    assert(cr >= 0);
+    char *buf = malloc(sz);
+    assert(buf);
+    int64_t start = now();
+    int i;
+    for(i = 0; i != n; ++i) {
+        rc = bsend(h, buf, sz, -1);
+        assert(rc == 0);
+    }
+    /* Wait till all the data arrives, including the last partial batch. */
+    int val;
+    rc = chrecv(done, &val, sizeof(val), -1);
+    assert(rc == 0);
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-8s %10.0f writes/s %10.3f MB/s\n", name,
+        (double)n * 1000 / elapsed, (double)n * sz / 1000 / elapsed);
+    free(buf);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(done);
+    assert(rc == 0);
+    rc = hclose(h);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+}
+
+int main(int argc, char *argv[]) {
+    size_t sz = argc > 1 ? atoi(argv[1]) : 16;
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    size_t batch = argc > 3 ? atoi(argv[3]) : 2000;
+    measure("ipc", 0, sz, n, batch);
+    measure("nagle", 1, sz, n, batch);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Compares latency and throughput of shmem sockets with IPC sockets
+   (with PFX message framing on top) between two processes.
+   Usage: shmem [message-size] [roundtrips] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../dsock.h"
+
+/* Child process: echo messages with the first byte set to 'E'.
+   Swallow messages that start with 'S' and acknowledge once 'F' arrives. */
+static void peer(int s, size_t sz) {
+    char *buf = malloc(sz);
+    assert(buf);
+    while(1) {
+        ssize_t len = mrecv(s, buf, sz, -1);
+        if(len < 0) break;
+        if(buf[0] == 'E') {
+            int rc = msend(s, buf, len, -1);
+            assert(rc == 0);
+        }
+        if(buf[0] == 'F') {
+            int rc = msend(s, "F", 1, -1);
+            assert(rc == 0);
+        }
+    }
+    free(buf);
+}
+
+static void measure(const char *name, int s, size_t sz, int n) {
+    char *buf = malloc(sz);
+    assert(buf);
+    /* Latency. */
+    buf[0] = 'E';
+    int64_t start = now();
+    int i;
+    for(i = 0; i != n; ++i) {
+        int rc = msend(s, buf, sz, -1);
+        assert(rc == 0);
+        ssize_t len = mrecv(s, buf, sz, -1);
+        assert(len == sz);
+    }
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-6s latency:    %8.3f us\n", name,
+        (double)elapsed * 1000 / n / 2);
+    /* Throughput. */
+    int count = n * 10;
+    buf[0] = 'S';
+    start = now();
+    for(i = 0; i != count; ++i) {
+        int rc = msend(s, buf, sz, -1);
+        assert(rc == 0);
+    }
+    int rc = msend(s, "F", 1, -1);
+    assert(rc == 0);
+    ssize_t len = mrecv(s, buf, sz, -1);
+    assert(len == 1);
+    elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-6s throughput: %8.0f msgs/s %10.3f MB/s\n", name,
+        (double)count * 1000 / elapsed,
+        (double)count * sz / 1000 / elapsed);
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    size_t sz = argc > 1 ? atoi(argv[1]) : 64;
+    int n = argc > 2 ? atoi(argv[2]) : 100000;
+    if(sz < 1) sz = 1;
+
+    /* shmem */
+    int fds[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0) {
+        int s = shmem_accept(fds[1], -1);
+        assert(s >= 0);
+        peer(s, sz);
+        _exit(0);
+    }
+    int s = shmem_connect(fds[0], sz * 64 > 65536 ? sz * 64 : 65536, -1);
+    assert(s >= 0);
+    close(fds[0]);
+    close(fds[1]);
+    measure("shmem", s, sz, n);
+    rc = hclose(s);
+    assert(rc == 0);
+    waitpid(pid, NULL, 0);
+
+    /* ipc + pfx */
+    rc = ipc_pair(fds);
+    assert(rc == 0);
+    pid = fork();
+    assert(pid >= 0);
+    if(pid == 0) {
+        rc = hclose(fds[0]);
+        assert(rc == 0);
+        int s = pfx_attach(fds[1]);
+        assert(s >= 0);
+        peer(s, sz);
+        _exit(0);
+    }
+    rc = hclose(fds[1]);
+    assert(rc == 0);
+    s = pfx_attach(fds[0]);
+    assert(s >= 0);
+    measure("ipc", s, sz, n);
+    rc = hclose(s);
+    assert(rc == 0);
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures throughput of UTF-8 validation used for WebSocket text messages.
+   Usage: utf8 [buffer-size] [iterations] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../dsock.h"
+#include "../utf8.h"
+
+static void measure(const char *name, const uint8_t *buf, size_t sz,
+      int n) {
+    int64_t start = now();
+    int i;
+    for(i = 0; i != n; ++i) {
+        struct utf8_state st;
+        utf8_init(&st);
+        int rc = utf8_validate(&st, buf, sz);
+        assert(rc == 0 && utf8_complete(&st));
+    }
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-8s %10.3f GB/s\n", name,
+        (double)sz * n / 1000000 / elapsed);
+}
+
+/* Fills the buffer with the string repeated, never splitting a character. */
+static void fill(uint8_t *buf, size_t sz, const char *s) {
+    size_t len = strlen(s);
+    size_t pos = 0;
+    while(pos + len <= sz) {
+        memcpy(buf + pos, s, len);
+        pos += len;
+    }
+    memset(buf + pos, 'x', sz - pos);
+}
+
+int main(int argc, char *argv[]) {
+    size_t sz = argc > 1 ? atoi(argv[1]) : 1000000;
+    int n = argc > 2 ? atoi(argv[2]) : 1000;
+    uint8_t *buf = malloc(sz);
+    assert(buf);
+    fill(buf, sz, "The quick brown fox jumps over the lazy dog. ");
+    measure("ascii", buf, sz, n);
+    fill(buf, sz, "P\xc5\x99\xc3\xadli\xc5\xa1 \xc5\xbelu\xc5\xa5"
+        "ou\xc4\x8dk\xc3\xbd k\xc5\xaf\xc5\x88. ");
+    measure("latin", buf, sz, n);
+    fill(buf, sz, "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xf0\x9f\x98\x80 ");
+    measure("mixed", buf, sz, n);
+    free(buf);
+    return 0;
+}
+
@@ -0,0 +1,121 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures fanout of a message to many WebSocket connections, sending it
+   to each connection separately and broadcasting a pre-encoded frame.
+   Usage: websock [message-size] [messages] [connections] */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../dsock.h"
+
+coroutine void drain(int s, int n, int done) {
+    char buf[4096];
+    int i;
+    for(i = 0; i != n; ++i) {
+        ssize_t sz = mrecv(s, buf, sizeof(buf), -1);
+        assert(sz >= 0);
+    }
+    int val = 0;
+    int rc = chsend(done, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+static void measure(const char *name, int usebroadcast, size_t sz, int n,
+      int conns) {
+    int *srv = malloc(sizeof(int) * conns);
+    assert(srv);
+    int *cli = malloc(sizeof(int) * conns);
+    assert(cli);
+    int *crs = malloc(sizeof(int) * conns);
+    assert(crs);
+    int done = chmake(sizeof(int));
+    assert(done >= 0);
+    int i, j;
+    for(i = 0; i != conns; ++i) {
+        int s[2];
+        int rc = ipc_pair(s);
+        assert(rc == 0);
+        srv[i] = websock_attach(s[0], 0);
+        assert(srv[i] >= 0);
+        cli[i] = websock_attach(s[1], 1);
+        assert(cli[i] >= 0);
+        crs[i] = go(drain(cli[i], n, done));
+        assert(crs[i] >= 0);
+    }
+    char *buf = malloc(sz);
+    assert(buf);
+    int64_t start = now();
+    for(i = 0; i != n; ++i) {
+        if(usebroadcast) {
+            int f = websock_frame(buf, sz);
+            assert(f >= 0);
+            int rc = websock_broadcast(f, srv, conns, -1);
+            assert(rc == 0);
+            rc = hclose(f);
+            assert(rc == 0);
+            continue;
+        }
+        for(j = 0; j != conns; ++j) {
+            int rc = msend(srv[j], buf, sz, -1);
+            assert(rc == 0);
+        }
+    }
+    /* Wait till all the messages are delivered. */
+    for(i = 0; i != conns; ++i) {
+        int val;
+        int rc = chrecv(done, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+    int64_t elapsed = now() - start;
+    if(elapsed == 0) elapsed = 1;
+    printf("%-10s %10.0f messages/s %10.0f deliveries/s\n", name,
+        (double)n * 1000 / elapsed, (double)n * conns * 1000 / elapsed);
+    for(i = 0; i != conns; ++i) {
+        int rc = hclose(crs[i]);
+        assert(rc == 0);
+        rc = hclose(cli[i]);
+        assert(rc == 0);
+        rc = hclose(srv[i]);
+        assert(rc == 0);
+    }
+    int rc = hclose(done);
+    assert(rc == 0);
+    free(buf);
+    free(crs);
+    free(cli);
+    free(srv);
+}
+
+int main(int argc, char *argv[]) {
+    size_t sz = argc > 1 ? atoi(argv[1]) : 64;
+    int n = argc > 2 ? atoi(argv[2]) : 10000;
+    int conns = argc > 3 ? atoi(argv[3]) : 100;
+    measure("msend", 0, sz, n, conns);
+    measure("broadcast", 1, sz, n, conns);
+    return 0;
+}
+
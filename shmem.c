@@ -0,0 +1,532 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "dsock.h"
+#include "iol.h"
+#include "utils.h"
+
+dsock_unique_id(shmem_type);
+
+/* Two processes share a memory segment containing two ring buffers, one for
+   each direction. Messages are copied into the ring by the sender and copied
+   out of it directly into the receiver's buffers. Each message is stored as
+   8-byte length followed by the payload, padded to 8 bytes. If the message
+   doesn't fit between the current position and the end of the ring the
+   sender stores SHMEM_WRAP marker and continues from the beginning.
+
+   Head and tail are monotonically increasing byte counters. Sleeping sides
+   announce themselves via 'sndwait'/'rcvwait' flags and are woken up via
+   eventfds. When neither side is sleeping no syscalls are made at all. */
+
+#define SHMEM_MAGIC 0x64736d31u
+#define SHMEM_WRAP UINT64_MAX
+#define SHMEM_MINSIZE 256
+
+struct shmem_ring {
+    /* Written by the producer. */
+    uint64_t head;
+    uint32_t sndwait;
+    uint32_t snddone;
+    uint8_t pad1[48];
+    /* Written by the consumer. */
+    uint64_t tail;
+    uint32_t rcvwait;
+    uint32_t rcvdone;
+    uint8_t pad2[48];
+};
+
+DSOCK_CT_ASSERT(sizeof(struct shmem_ring) == 128);
+
+/* Sent over the UNIX domain socket along with memfd and eventfds. */
+struct shmem_hello {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+static void *shmem_hquery(struct hvfs *hvfs, const void *type);
+static void shmem_hclose(struct hvfs *hvfs);
+static int shmem_msendl(struct msock_vfs *mvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+static ssize_t shmem_mrecvl(struct msock_vfs *mvfs,
+    struct iolist *first, struct iolist *last, int64_t deadline);
+
+struct shmem_sock {
+    struct hvfs hvfs;
+    struct msock_vfs mvfs;
+    uint8_t *mem;
+    size_t memlen;
+    /* Capacity of each ring. Always a power of two. */
+    size_t size;
+    struct shmem_ring *tx;
+    uint8_t *txdata;
+    struct shmem_ring *rx;
+    uint8_t *rxdata;
+    /* Peer waits here for data in tx ring. */
+    int txdata_efd;
+    /* We wait here for space in tx ring. */
+    int txspace_efd;
+    /* We wait here for data in rx ring. */
+    int rxdata_efd;
+    /* Peer waits here for space in rx ring. */
+    int rxspace_efd;
+    /* Size of the message lent to the user by shmem_borrow, -1 if none. */
+    ssize_t borrowed;
+};
+
+static void *shmem_hquery(struct hvfs *hvfs, const void *type) {
+    struct shmem_sock *obj = (struct shmem_sock*)hvfs;
+    if(type == msock_type) return &obj->mvfs;
+    if(type == shmem_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+#if defined __linux__
+
+static size_t shmem_memlen(size_t size) {
+    size_t len = 2 * (sizeof(struct shmem_ring) + size);
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    return (len + pgsz - 1) / pgsz * pgsz;
+}
+
+/* Create the socket object on top of an already mapped segment.
+   Ownership of the eventfds is transferred to the socket. */
+static int shmem_make(uint8_t *mem, size_t memlen, size_t size,
+      int client, int efds[4]) {
+    struct shmem_sock *obj = malloc(sizeof(struct shmem_sock));
+    if(dsock_slow(!obj)) {errno = ENOMEM; return -1;}
+    obj->hvfs.query = shmem_hquery;
+    obj->hvfs.close = shmem_hclose;
+    obj->hvfs.done = NULL;
+    obj->mvfs.msendl = shmem_msendl;
+    obj->mvfs.mrecvl = shmem_mrecvl;
+    obj->mem = mem;
+    obj->memlen = memlen;
+    obj->size = size;
+    /* Ring 0 is client-to-server, ring 1 is server-to-client. */
+    struct shmem_ring *r0 = (struct shmem_ring*)mem;
+    struct shmem_ring *r1 =
+        (struct shmem_ring*)(mem + sizeof(struct shmem_ring) + size);
+    obj->tx = client ? r0 : r1;
+    obj->rx = client ? r1 : r0;
+    obj->txdata = (uint8_t*)(obj->tx + 1);
+    obj->rxdata = (uint8_t*)(obj->rx + 1);
+    obj->txdata_efd = client ? efds[0] : efds[2];
+    obj->txspace_efd = client ? efds[1] : efds[3];
+    obj->rxdata_efd = client ? efds[2] : efds[0];
+    obj->rxspace_efd = client ? efds[3] : efds[1];
+    obj->borrowed = -1;
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {
+        int err = errno;
+        free(obj);
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+static int shmem_sendfds(int fd, struct shmem_hello *hello, int *fds,
+      int nfds, int64_t deadline) {
+    struct iovec iov = {hello, sizeof(struct shmem_hello)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 5)];
+    } ctl;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = ctl.buf;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    while(1) {
+        ssize_t sz = sendmsg(fd, &hdr, 0);
+        if(dsock_fast(sz == sizeof(struct shmem_hello))) return 0;
+        if(dsock_slow(sz >= 0)) {errno = EPROTO; return -1;}
+        if(dsock_slow(errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+        int rc = fdout(fd, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+}
+
+static int shmem_recvfds(int fd, struct shmem_hello *hello, int *fds,
+      int nfds, int64_t deadline) {
+    struct iovec iov = {hello, sizeof(struct shmem_hello)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 5)];
+    } ctl;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = ctl.buf;
+    hdr.msg_controllen = sizeof(ctl.buf);
+    ssize_t sz;
+    while(1) {
+        sz = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+        if(dsock_fast(sz >= 0)) break;
+        if(dsock_slow(errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+        int rc = fdin(fd, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(sz == 0)) {errno = EPIPE; return -1;}
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if(dsock_slow(!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+          cmsg->cmsg_type != SCM_RIGHTS)) {
+        errno = EPROTO; return -1;}
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if(dsock_slow(n != nfds || sz != sizeof(struct shmem_hello) ||
+          hello->magic != SHMEM_MAGIC)) {
+        int *rcvd = (int*)CMSG_DATA(cmsg);
+        int i;
+        for(i = 0; i != n; ++i) close(rcvd[i]);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    return 0;
+}
+
+int shmem_connect(int fd, size_t bufsz, int64_t deadline) {
+    int err, rc, i;
+    /* Round the ring size up to the power of two. */
+    if(dsock_slow(bufsz > SIZE_MAX / 4)) {err = EINVAL; goto error1;}
+    size_t size = SHMEM_MINSIZE;
+    while(size < bufsz) size *= 2;
+    size_t memlen = shmem_memlen(size);
+    /* Create the shared memory segment. */
+    int mfd = syscall(SYS_memfd_create, "dsock-shmem", 1 /* CLOEXEC */);
+    if(dsock_slow(mfd < 0)) {err = errno; goto error1;}
+    rc = ftruncate(mfd, memlen);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    uint8_t *mem = mmap(NULL, memlen, PROT_READ | PROT_WRITE, MAP_SHARED,
+        mfd, 0);
+    if(dsock_slow(mem == MAP_FAILED)) {err = errno; goto error2;}
+    /* Create the eventfds used for wakeups. */
+    int efds[4] = {-1, -1, -1, -1};
+    for(i = 0; i != 4; ++i) {
+        efds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(dsock_slow(efds[i] < 0)) {err = errno; goto error3;}
+    }
+    /* Pass everything to the peer. */
+    struct shmem_hello hello = {SHMEM_MAGIC, 0, size};
+    int fds[5] = {mfd, efds[0], efds[1], efds[2], efds[3]};
+    rc = shmem_sendfds(fd, &hello, fds, 5, deadline);
+    if(dsock_slow(rc < 0)) {err = errno; goto error3;}
+    rc = close(mfd);
+    dsock_assert(rc == 0);
+    int h = shmem_make(mem, memlen, size, 1, efds);
+    if(dsock_slow(h < 0)) {err = errno; mfd = -1; goto error3;}
+    return h;
+error3:
+    for(i = 0; i != 4; ++i) {
+        if(efds[i] >= 0) {
+            rc = close(efds[i]);
+            dsock_assert(rc == 0);
+        }
+    }
+    rc = munmap(mem, memlen);
+    dsock_assert(rc == 0);
+error2:
+    if(mfd >= 0) {
+        rc = close(mfd);
+        dsock_assert(rc == 0);
+    }
+error1:
+    errno = err;
+    return -1;
+}
+
+int shmem_accept(int fd, int64_t deadline) {
+    int err, rc, i;
+    struct shmem_hello hello;
+    int fds[5];
+    rc = shmem_recvfds(fd, &hello, fds, 5, deadline);
+    if(dsock_slow(rc < 0)) {err = errno; goto error1;}
+    size_t size = hello.size;
+    if(dsock_slow(size < SHMEM_MINSIZE || (size & (size - 1)) ||
+          size > SIZE_MAX / 4)) {
+        err = EPROTO; goto error2;}
+    /* Make sure that the peer doesn't trick us into accessing memory
+       beyond the end of the segment. */
+    size_t memlen = shmem_memlen(size);
+    struct stat st;
+    rc = fstat(fds[0], &st);
+    if(dsock_slow(rc < 0)) {err = errno; goto error2;}
+    if(dsock_slow(st.st_size < memlen)) {err = EPROTO; goto error2;}
+    uint8_t *mem = mmap(NULL, memlen, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fds[0], 0);
+    if(dsock_slow(mem == MAP_FAILED)) {err = errno; goto error2;}
+    int h = shmem_make(mem, memlen, size, 0, fds + 1);
+    if(dsock_slow(h < 0)) {err = errno; goto error3;}
+    rc = close(fds[0]);
+    dsock_assert(rc == 0);
+    return h;
+error3:
+    rc = munmap(mem, memlen);
+    dsock_assert(rc == 0);
+error2:
+    for(i = 0; i != 5; ++i) {
+        rc = close(fds[i]);
+        dsock_assert(rc == 0);
+    }
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Wake up the peer. Errors are ignored: the counter can't overflow in
+   practice and if it's already non-zero the peer will wake up anyway. */
+static void shmem_signal(int efd) {
+    uint64_t one = 1;
+    ssize_t sz = write(efd, &one, sizeof(one));
+    (void)sz;
+}
+
+/* Wait for the peer to wake us up. */
+static int shmem_wait(int efd, int64_t deadline) {
+    int rc = fdin(efd, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    uint64_t val;
+    ssize_t sz = read(efd, &val, sizeof(val));
+    dsock_assert(sz == sizeof(val) || errno == EAGAIN);
+    return 0;
+}
+
+static int shmem_msendl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct shmem_sock *obj = dsock_cont(mvfs, struct shmem_sock, mvfs);
+    struct shmem_ring *r = obj->tx;
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Make sure the message can always fit into the ring, even if
+       the wrap-around wastes part of it. */
+    size_t rec = 8 + ((len + 7) & ~(size_t)7);
+    if(dsock_slow(len > obj->size / 2 - 8)) {errno = EMSGSIZE; return -1;}
+    uint64_t head;
+    size_t pos, toend, need;
+    while(1) {
+        head = r->head;
+        pos = head & (obj->size - 1);
+        toend = obj->size - pos;
+        need = rec <= toend ? rec : toend + rec;
+        if(dsock_slow(__atomic_load_n(&r->rcvdone, __ATOMIC_ACQUIRE))) {
+            errno = EPIPE; return -1;}
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if(dsock_fast(obj->size - (head - tail) >= need)) break;
+        /* Not enough space. Announce that we are going to sleep, then check
+           once more to make sure the wakeup is not lost. */
+        __atomic_store_n(&r->sndwait, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        if(obj->size - (head - tail) >= need ||
+              __atomic_load_n(&r->rcvdone, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&r->sndwait, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        rc = shmem_wait(obj->txspace_efd, deadline);
+        __atomic_store_n(&r->sndwait, 0, __ATOMIC_RELAXED);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    /* Skip the tail end of the ring, if needed. */
+    if(rec > toend) {
+        *(uint64_t*)(obj->txdata + pos) = SHMEM_WRAP;
+        pos = 0;
+    }
+    /* Write the message. */
+    *(uint64_t*)(obj->txdata + pos) = len;
+    iol_copy(first, obj->txdata + pos + 8);
+    __atomic_store_n(&r->head, head + need, __ATOMIC_SEQ_CST);
+    /* If the receiver is asleep wake it up. */
+    if(__atomic_load_n(&r->rcvwait, __ATOMIC_SEQ_CST))
+        shmem_signal(obj->txdata_efd);
+    return 0;
+}
+
+/* Waits for the next message in the rx ring. Returns its size and stores
+   its position in the ring to *pos. */
+static ssize_t shmem_next(struct shmem_sock *obj, size_t *pos,
+      int64_t deadline) {
+    struct shmem_ring *r = obj->rx;
+    uint64_t tail = r->tail;
+    uint64_t sz;
+    while(1) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if(dsock_fast(head != tail)) {
+            *pos = tail & (obj->size - 1);
+            sz = *(uint64_t*)(obj->rxdata + *pos);
+            if(dsock_fast(sz != SHMEM_WRAP)) break;
+            /* Wrap-around marker. Go to the beginning of the ring. */
+            tail += obj->size - *pos;
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+        if(dsock_slow(__atomic_load_n(&r->snddone, __ATOMIC_ACQUIRE))) {
+            errno = EPIPE; return -1;}
+        /* No data. Announce that we are going to sleep, then check
+           once more to make sure the wakeup is not lost. */
+        __atomic_store_n(&r->rcvwait, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != tail ||
+              __atomic_load_n(&r->snddone, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&r->rcvwait, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        int rc = shmem_wait(obj->rxdata_efd, deadline);
+        __atomic_store_n(&r->rcvwait, 0, __ATOMIC_RELAXED);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(dsock_slow(sz > obj->size / 2 - 8 || *pos + 8 + sz > obj->size)) {
+        errno = EPROTO; return -1;}
+    return sz;
+}
+
+/* Releases space taken by the message at the tail of the rx ring. */
+static void shmem_consume(struct shmem_sock *obj, size_t sz) {
+    struct shmem_ring *r = obj->rx;
+    uint64_t tail = r->tail + 8 + ((sz + 7) & ~(uint64_t)7);
+    __atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+    /* If the sender is asleep wake it up. */
+    if(__atomic_load_n(&r->sndwait, __ATOMIC_SEQ_CST))
+        shmem_signal(obj->rxspace_efd);
+}
+
+static ssize_t shmem_mrecvl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct shmem_sock *obj = dsock_cont(mvfs, struct shmem_sock, mvfs);
+    /* Borrowed message has to be released first. */
+    if(dsock_slow(obj->borrowed >= 0)) {errno = EBUSY; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    size_t pos;
+    ssize_t sz = shmem_next(obj, &pos, deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    /* Copy the message straight from the ring into the user's buffer. */
+    if(dsock_fast(sz <= len)) {
+        uint8_t *src = obj->rxdata + pos + 8;
+        size_t rmn = sz;
+        struct iolist *it;
+        for(it = first; it && rmn; it = it->iol_next) {
+            size_t tocopy = rmn < it->iol_len ? rmn : it->iol_len;
+            if(it->iol_base) memcpy(it->iol_base, src, tocopy);
+            src += tocopy;
+            rmn -= tocopy;
+        }
+    }
+    /* Release the space. Message that doesn't fit is dropped. */
+    shmem_consume(obj, sz);
+    if(dsock_slow(sz > len)) {errno = EMSGSIZE; return -1;}
+    return sz;
+}
+
+ssize_t shmem_borrow(int s, const void **buf, int64_t deadline) {
+    struct shmem_sock *obj = hquery(s, shmem_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->borrowed >= 0)) {errno = EBUSY; return -1;}
+    size_t pos;
+    ssize_t sz = shmem_next(obj, &pos, deadline);
+    if(dsock_slow(sz < 0)) return -1;
+    /* The message stays in the ring until it's released. Sender can't
+       overwrite it in the meantime. */
+    *buf = obj->rxdata + pos + 8;
+    obj->borrowed = sz;
+    return sz;
+}
+
+int shmem_release(int s) {
+    struct shmem_sock *obj = hquery(s, shmem_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->borrowed < 0)) {errno = EINVAL; return -1;}
+    shmem_consume(obj, obj->borrowed);
+    obj->borrowed = -1;
+    return 0;
+}
+
+static void shmem_hclose(struct hvfs *hvfs) {
+    struct shmem_sock *obj = (struct shmem_sock*)hvfs;
+    /* Let the peer know that we are gone. */
+    __atomic_store_n(&obj->tx->snddone, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&obj->rx->rcvdone, 1, __ATOMIC_SEQ_CST);
+    shmem_signal(obj->txdata_efd);
+    shmem_signal(obj->rxspace_efd);
+    fdclean(obj->txspace_efd);
+    fdclean(obj->rxdata_efd);
+    int rc = close(obj->txdata_efd);
+    dsock_assert(rc == 0);
+    rc = close(obj->txspace_efd);
+    dsock_assert(rc == 0);
+    rc = close(obj->rxdata_efd);
+    dsock_assert(rc == 0);
+    rc = close(obj->rxspace_efd);
+    dsock_assert(rc == 0);
+    rc = munmap(obj->mem, obj->memlen);
+    dsock_assert(rc == 0);
+    free(obj);
+}
+
+#else
+
+int shmem_connect(int fd, size_t bufsz, int64_t deadline) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int shmem_accept(int fd, int64_t deadline) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t shmem_borrow(int s, const void **buf, int64_t deadline) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int shmem_release(int s) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
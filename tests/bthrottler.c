@@ -23,9 +23,25 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 
 #include "../dsock.h"
 
+coroutine void sender(int s, size_t len, int64_t *finished) {
+    char buf[500];
+    int rc = bsend(s, buf, len, -1);
+    assert(rc == 0);
+    *finished = now();
+}
+
+coroutine void drain(int s) {
+    char buf[1];
+    while(1) {
+        int rc = brecv(s, buf, 1, -1);
+        if(rc < 0) return;
+    }
+}
+
 int main() {
     int s[2];
 
@@ -95,6 +111,265 @@ int main() {
     hclose(thr);
     hclose(s[1]);
 
+    /* Token bucket: Sends are paced evenly. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 10000, 0, 0, 0);
+    assert(thr >= 0);
+    start = now();
+    int64_t prev = start;
+    for(i = 0; i != 20; ++i) {
+        rc = bsend(thr, buf, 50, -1);
+        assert(rc == 0);
+        int64_t gap = now() - prev;
+        assert(i == 0 || gap >= 3);
+        prev = now();
+    }
+    elapsed = now() - start;
+    assert(elapsed > 85 && elapsed < 300);
+    for(i = 0; i != 20; ++i) {
+        rc = brecv(s[1], buf, 50, -1);
+        assert(rc == 0);
+    }
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Token bucket: Burst is let through at once, the rest is paced. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 10000, 100, 0, 0);
+    assert(thr >= 0);
+    start = now();
+    rc = bsend(thr, buf, 100, -1);
+    assert(rc == 0);
+    elapsed = now() - start;
+    assert(elapsed < 50);
+    rc = bsend(thr, buf, 100, -1);
+    assert(rc == 0);
+    elapsed = now() - start;
+    assert(elapsed >= 9 && elapsed < 200);
+    rc = brecv(s[1], buf, 200, -1);
+    assert(rc == 0);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Token bucket: Achieved rate is accurate even though single sends
+       take less than a millisecond. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 100000, 0, 0, 0);
+    assert(thr >= 0);
+    start = now();
+    for(i = 0; i != 2000; ++i) {
+        rc = bsend(thr, buf, 10, -1);
+        assert(rc == 0);
+    }
+    elapsed = now() - start;
+    assert(elapsed > 190 && elapsed < 400);
+    for(i = 0; i != 100; ++i) {
+        rc = brecv(s[1], buf, 200, -1);
+        assert(rc == 0);
+    }
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Token bucket: recv-throttling. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 0, 0, 10000, 0);
+    assert(thr >= 0);
+    rc = bsend(s[1], buf, 200, -1);
+    assert(rc == 0);
+    start = now();
+    rc = brecv(thr, buf, 200, -1);
+    assert(rc == 0);
+    elapsed = now() - start;
+    assert(elapsed > 15 && elapsed < 200);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Token bucket: Deadline expires while waiting for the quota. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 1000, 0, 0, 0);
+    assert(thr >= 0);
+    rc = bsend(thr, buf, 10, -1);
+    assert(rc == 0);
+    rc = bsend(thr, buf, 10, now() + 5);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Group: Sockets share the capacity of the group fairly. */
+    int g = throttler_group(10000, 0, 0, 0);
+    assert(g >= 0);
+    int s2[2];
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    rc = ipc_pair(s2);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 0, 0, 0, 0);
+    assert(thr >= 0);
+    rc = bthrottler_join(thr, g);
+    assert(rc == 0);
+    int thr2 = bthrottler_attach_bucket(s2[0], 0, 0, 0, 0);
+    assert(thr2 >= 0);
+    rc = bthrottler_join(thr2, g);
+    assert(rc == 0);
+    int64_t finished[2];
+    start = now();
+    int cr1 = go(sender(thr, 500, &finished[0]));
+    assert(cr1 >= 0);
+    int cr2 = go(sender(thr2, 500, &finished[1]));
+    assert(cr2 >= 0);
+    rc = brecv(s[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = brecv(s[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = brecv(s[1], buf, 100, -1);
+    assert(rc == 0);
+    rc = brecv(s2[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = brecv(s2[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = brecv(s2[1], buf, 100, -1);
+    assert(rc == 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    assert(finished[0] - start > 85 && finished[0] - start < 300);
+    assert(finished[1] - start > 85 && finished[1] - start < 300);
+    struct throttler_group_stats stats;
+    rc = throttler_group_stats(g, &stats);
+    assert(rc == 0);
+    assert(stats.sockets == 2);
+    assert(stats.send_units == 1000 && stats.recv_units == 0);
+    rc = hclose(cr2);
+    assert(rc == 0);
+    rc = hclose(cr1);
+    assert(rc == 0);
+
+    /* Group: Socket's own limit applies within the group. */
+    rc = bthrottler_join(thr2, -1);
+    assert(rc == 0);
+    rc = throttler_group_stats(g, &stats);
+    assert(rc == 0);
+    assert(stats.sockets == 1);
+    hclose(thr2);
+    hclose(s2[1]);
+    hclose(thr);
+    hclose(s[1]);
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 2000, 0, 0, 0);
+    assert(thr >= 0);
+    rc = bthrottler_join(thr, g);
+    assert(rc == 0);
+    start = now();
+    rc = bsend(thr, buf, 200, -1);
+    assert(rc == 0);
+    elapsed = now() - start;
+    assert(elapsed > 85 && elapsed < 300);
+    rc = brecv(s[1], buf, 200, -1);
+    assert(rc == 0);
+
+    /* Group: Window-mode throttlers can't join groups. */
+    rc = ipc_pair(s2);
+    assert(rc == 0);
+    thr2 = bthrottler_attach(s2[0], 1000, 10, 0, 0);
+    assert(thr2 >= 0);
+    rc = bthrottler_join(thr2, g);
+    assert(rc == -1 && errno == EINVAL);
+    hclose(thr2);
+    hclose(s2[1]);
+
+    /* Group outlives its handle while there are sockets in it. */
+    rc = hclose(g);
+    assert(rc == 0);
+    rc = bsend(thr, buf, 20, -1);
+    assert(rc == 0);
+    rc = brecv(s[1], buf, 20, -1);
+    assert(rc == 0);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Group: Socket limited by its own rate doesn't slow down the others. */
+    g = throttler_group(100000, 0, 0, 0);
+    assert(g >= 0);
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    rc = ipc_pair(s2);
+    assert(rc == 0);
+    thr = bthrottler_attach_bucket(s[0], 200, 100, 0, 0);
+    assert(thr >= 0);
+    rc = bthrottler_join(thr, g);
+    assert(rc == 0);
+    thr2 = bthrottler_attach_bucket(s2[0], 0, 0, 0, 0);
+    assert(thr2 >= 0);
+    rc = bthrottler_join(thr2, g);
+    assert(rc == 0);
+    start = now();
+    /* The second 100 bytes have to wait 500ms for the socket's own bucket. */
+    cr1 = go(sender(thr, 200, &finished[0]));
+    assert(cr1 >= 0);
+    rc = bsend(thr2, buf, 200, -1);
+    assert(rc == 0);
+    elapsed = now() - start;
+    assert(elapsed < 250);
+    rc = brecv(s2[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = brecv(s[1], buf, 200, -1);
+    assert(rc == 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    assert(finished[0] - start > 450);
+    rc = hclose(cr1);
+    assert(rc == 0);
+    rc = hclose(g);
+    assert(rc == 0);
+    hclose(thr2);
+    hclose(s2[1]);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Adaptive: Rate is halved when the underlying socket is congested. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_adaptive(s[0], 1000, 100000000, 5);
+    assert(thr >= 0);
+    assert(bthrottler_rate(thr) == 100000000);
+    char chunk[10000] = {0};
+    for(i = 0; i != 10000; ++i) {
+        rc = bsend(thr, chunk, sizeof(chunk), now() + 50);
+        if(rc < 0) break;
+    }
+    assert(rc == -1 && errno == ETIMEDOUT);
+    int64_t rate = bthrottler_rate(thr);
+    assert(rate <= 50000000 && rate >= 1000);
+
+    /* Adaptive: Rate recovers once the congestion is gone. */
+    int cr = go(drain(s[1]));
+    assert(cr >= 0);
+    start = now();
+    while(now() - start < 300) {
+        rc = bsend(thr, buf, 100, -1);
+        assert(rc == 0);
+        rc = msleep(now() + 1);
+        assert(rc == 0);
+    }
+    assert(bthrottler_rate(thr) == 100000000);
+    rc = hclose(cr);
+    assert(rc == 0);
+    hclose(thr);
+    hclose(s[1]);
+
+    /* Adaptive: Invalid bounds. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    thr = bthrottler_attach_adaptive(s[0], 2000, 1000, 5);
+    assert(thr < 0 && errno == EINVAL);
+    hclose(s[0]);
+    hclose(s[1]);
+
     return 0;
 }
 
@@ -0,0 +1,170 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+int main() {
+    int h[2];
+    int rc = ipc_pair(h);
+    assert(rc == 0);
+
+    /* Small writes are coalesced into a single chunk. */
+    int s = chunked_attach(h[0], 16);
+    assert(s >= 0);
+    rc = bsend(s, "hello", 5, -1);
+    assert(rc == 0);
+    rc = bsend(s, ", world", 7, -1);
+    assert(rc == 0);
+    rc = bsend(s, "! It's chunked.", 15, -1);
+    assert(rc == 0);
+    rc = bsend(s, "bye", 3, -1);
+    assert(rc == 0);
+    rc = hdone(s, -1);
+    assert(rc == 0);
+    rc = bsend(s, "x", 1, -1);
+    assert(rc < 0 && errno == EPIPE);
+    h[0] = chunked_detach(s, -1);
+    assert(h[0] >= 0);
+    const char *expected = "1b\r\nhello, world! It's chunked.\r\n"
+        "3\r\nbye\r\n0\r\n\r\n";
+    char buf[64];
+    rc = brecv(h[1], buf, strlen(expected), -1);
+    assert(rc == 0 && memcmp(buf, expected, strlen(expected)) == 0);
+
+    /* Payload spanning several chunks, with extensions and trailer. */
+    const char *body = "5;name=value\r\nhello\r\nA\r\n, world!!!\r\n"
+        "0\r\nExpires: never\r\n\r\nNEXT";
+    rc = bsend(h[1], body, strlen(body), -1);
+    assert(rc == 0);
+    s = chunked_attach(h[0], 0);
+    assert(s >= 0);
+    char dst[15];
+    struct iolist iol[3] = {
+        {dst, 3, &iol[1], 0},
+        {NULL, 1, &iol[2], 0},
+        {dst + 4, 11, NULL, 0}};
+    rc = brecvl(s, &iol[0], &iol[2], -1);
+    assert(rc == 0);
+    assert(memcmp(dst, "hel", 3) == 0 &&
+        memcmp(dst + 4, "o, world!!!", 11) == 0);
+    rc = brecv(s, buf, 1, -1);
+    assert(rc < 0 && errno == EPIPE);
+    h[0] = chunked_detach(s, -1);
+    assert(h[0] >= 0);
+    /* Nothing beyond the body was read. */
+    rc = brecv(h[0], buf, 4, -1);
+    assert(rc == 0 && memcmp(buf, "NEXT", 4) == 0);
+
+    /* Body of unknown size is read chunk by chunk. */
+    body = "3\r\nabc\r\n1b\r\nand a chunk longer than buf\r\n"
+        "0\r\n\r\nNEXT";
+    rc = bsend(h[1], body, strlen(body), -1);
+    assert(rc == 0);
+    s = chunked_attach(h[0], 0);
+    assert(s >= 0);
+    char all[64];
+    size_t len = 0;
+    while(1) {
+        int64_t sz = chunked_chunklen(s, -1);
+        if(sz < 0 && errno == EPIPE) break;
+        assert(sz > 0);
+        size_t n = sz < sizeof(dst) ? sz : sizeof(dst);
+        rc = brecv(s, dst, n, -1);
+        assert(rc == 0);
+        memcpy(all + len, dst, n);
+        len += n;
+    }
+    assert(len == 30 && memcmp(all, "abcand a chunk longer than buf", 30) == 0);
+    h[0] = chunked_detach(s, -1);
+    assert(h[0] >= 0);
+    rc = brecv(h[0], buf, 4, -1);
+    assert(rc == 0 && memcmp(buf, "NEXT", 4) == 0);
+
+    /* Detaching skips the unread part of the body. */
+    rc = bsend(h[1], body, strlen(body), -1);
+    assert(rc == 0);
+    s = chunked_attach(h[0], 0);
+    assert(s >= 0);
+    rc = brecv(s, buf, 5, -1);
+    assert(rc == 0 && memcmp(buf, "abcan", 5) == 0);
+    h[0] = chunked_detach(s, -1);
+    assert(h[0] >= 0);
+    rc = brecv(h[0], buf, 4, -1);
+    assert(rc == 0 && memcmp(buf, "NEXT", 4) == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+
+    /* Chunked HTTP response followed by another response. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    int c = http_attach(h[0]);
+    assert(c >= 0);
+    int v = http_attach(h[1]);
+    assert(v >= 0);
+    rc = http_sendstatus(v, 200, "OK", -1);
+    assert(rc == 0);
+    rc = http_sendfield(v, "Transfer-Encoding", "chunked", -1);
+    assert(rc == 0);
+    rc = hdone(v, -1);
+    assert(rc == 0);
+    s = chunked_attach(v, 0);
+    assert(s >= 0);
+    rc = bsend(s, "abc", 3, -1);
+    assert(rc == 0);
+    v = chunked_detach(s, -1);
+    assert(v >= 0);
+    rc = http_sendstatus(v, 204, "No Content", -1);
+    assert(rc == 0);
+    rc = hdone(v, -1);
+    assert(rc == 0);
+    char reason[16];
+    rc = http_recvstatus(c, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    struct http_field *fields;
+    ssize_t nfields = http_recvheaders(c, &fields, -1);
+    assert(nfields == 1);
+    s = chunked_attach(c, 0);
+    assert(s >= 0);
+    rc = brecv(s, buf, 3, -1);
+    assert(rc == 0 && memcmp(buf, "abc", 3) == 0);
+    rc = brecv(s, buf, 1, -1);
+    assert(rc < 0 && errno == EPIPE);
+    c = chunked_detach(s, -1);
+    assert(c >= 0);
+    rc = http_recvstatus(c, reason, sizeof(reason), -1);
+    assert(rc == 204);
+    rc = hclose(c);
+    assert(rc == 0);
+    rc = hclose(v);
+    assert(rc == 0);
+
+    return 0;
+}
+
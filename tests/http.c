@@ -93,6 +93,18 @@ int main() {
     assert(strcmp(name, "valid-field-name") == 0);
     assert(strcmp(value, "both pad") == 0);
 
+    /* Long lines are scanned in blocks. */
+    struct http_view vname, vvalue;
+    rc = http_sendfield(s0, "X-Forwarded-For-Original-Client",
+        "203.0.113.195, 70.41.3.18, 150.172.238.178", -1);
+    assert(rc == 0);
+    rc = http_recvfieldv(s1, &vname, &vvalue, -1);
+    assert(rc == 0);
+    assert(vname.len == 31 &&
+        memcmp(vname.base, "X-Forwarded-For-Original-Client", 31) == 0);
+    assert(vvalue.len == 42 && memcmp(vvalue.base,
+        "203.0.113.195, 70.41.3.18, 150.172.238.178", 42) == 0);
+
     rc = hdone(s0, -1);
     assert(rc == 0);
     rc = http_recvfield(s1, name, sizeof(name), value, sizeof(value), -1);
@@ -125,6 +137,242 @@ int main() {
     assert(rc == 0);
     rc = hclose(h[0]);
     assert(rc == 0);
+
+    /* Receive the whole header in one go. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_sendrequest(s0, "GET", "/", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "Host", "www.example.org", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "Accept", "text/html", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "Connection", "close", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    struct http_field *fields;
+    ssize_t nfields = http_recvheaders(s1, &fields, -1);
+    assert(nfields == 3);
+    assert(fields[0].name.len == 4 &&
+        memcmp(fields[0].name.base, "Host", 4) == 0);
+    assert(fields[0].value.len == 15 &&
+        memcmp(fields[0].value.base, "www.example.org", 15) == 0);
+    assert(fields[1].name.len == 6 &&
+        memcmp(fields[1].name.base, "Accept", 6) == 0);
+    assert(fields[2].value.len == 5 &&
+        memcmp(fields[2].value.base, "close", 5) == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Header exceeding the limit. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_headerlimit(s1, 128);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/", -1);
+    assert(rc == 0);
+    int i;
+    for(i = 0; i != 8; ++i) {
+        rc = http_sendfield(s0, "X-Padding", "0123456789", -1);
+        assert(rc == 0);
+    }
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0);
+    nfields = http_recvheaders(s1, &fields, -1);
+    assert(nfields < 0 && errno == EMSGSIZE);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Pipelined requests with bodies on a single connection. */
+    char buf[16];
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    s1 = http_attach(h[1]);
+    assert(s1 >= 0);
+    rc = http_sendrequest(s0, "POST", "/a", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "Content-Length", "5", -1);
+    assert(rc == 0);
+    rc = bsend(s0, "hello", 5, -1);
+    assert(rc < 0 && errno == EPROTO);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = bsend(s0, "hello", 5, -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/b", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "PUT", "/c", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s0, "content-length", "3", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = bsend(s0, "xyz", 3, -1);
+    assert(rc == 0);
+    /* Read only part of the first body. The rest is skipped. */
+    rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+    assert(rc == 0 && strcmp(cmd, "POST") == 0 && strcmp(url, "/a") == 0);
+    nfields = http_recvheaders(s1, &fields, -1);
+    assert(nfields == 1);
+    assert(http_bodylen(s1) == 5);
+    rc = brecv(s1, buf, 2, -1);
+    assert(rc == 0 && memcmp(buf, "he", 2) == 0);
+    rc = brecv(s1, buf, 4, -1);
+    assert(rc < 0 && errno == EPIPE);
+    assert(http_bodylen(s1) == 3);
+    /* Respond while the following requests are still queued. */
+    for(i = 0; i != 3; ++i) {
+        if(i > 0) {
+            rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url),
+                -1);
+            assert(rc == 0);
+            rc = http_recvfield(s1, name, sizeof(name), value,
+                sizeof(value), -1);
+            if(i == 1) {
+                assert(strcmp(url, "/b") == 0);
+                assert(rc < 0 && errno == EPIPE);
+                assert(http_bodylen(s1) == 0);
+            }
+            else {
+                assert(strcmp(url, "/c") == 0);
+                assert(rc == 0);
+                rc = http_recvfield(s1, name, sizeof(name), value,
+                    sizeof(value), -1);
+                assert(rc < 0 && errno == EPIPE);
+                rc = brecv(s1, buf, 3, -1);
+                assert(rc == 0 && memcmp(buf, "xyz", 3) == 0);
+            }
+        }
+        rc = http_sendstatus(s1, 200, "OK", -1);
+        assert(rc == 0);
+        rc = http_sendfield(s1, "Content-Length", "2", -1);
+        assert(rc == 0);
+        rc = hdone(s1, -1);
+        assert(rc == 0);
+        rc = bsend(s1, "ok", 2, -1);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 3; ++i) {
+        rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+        assert(rc == 200);
+        nfields = http_recvheaders(s0, &fields, -1);
+        assert(nfields == 1);
+        rc = brecv(s0, buf, 2, -1);
+        assert(rc == 0 && memcmp(buf, "ok", 2) == 0);
+    }
+
+    /* Response to HEAD has no body despite its Content-Length. */
+    rc = http_sendrequest(s0, "HEAD", "/a", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    rc = http_sendrequest(s0, "GET", "/b", -1);
+    assert(rc == 0);
+    rc = hdone(s0, -1);
+    assert(rc == 0);
+    for(i = 0; i != 2; ++i) {
+        rc = http_recvrequest(s1, cmd, sizeof(cmd), url, sizeof(url), -1);
+        assert(rc == 0);
+        assert(strcmp(cmd, i ? "GET" : "HEAD") == 0);
+        nfields = http_recvheaders(s1, &fields, -1);
+        assert(nfields == 0);
+    }
+    rc = http_sendstatus(s1, 200, "OK", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s1, "Content-Length", "5", -1);
+    assert(rc == 0);
+    rc = hdone(s1, -1);
+    assert(rc == 0);
+    rc = http_sendstatus(s1, 200, "OK", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s1, "Content-Length", "2", -1);
+    assert(rc == 0);
+    rc = hdone(s1, -1);
+    assert(rc == 0);
+    rc = bsend(s1, "ok", 2, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    nfields = http_recvheaders(s0, &fields, -1);
+    assert(nfields == 1);
+    assert(http_bodylen(s0) == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    nfields = http_recvheaders(s0, &fields, -1);
+    assert(nfields == 1);
+    assert(http_bodylen(s0) == 2);
+    rc = brecv(s0, buf, 2, -1);
+    assert(rc == 0 && memcmp(buf, "ok", 2) == 0);
+
+    /* Body is skipped even if the fields weren't received. Body of unknown
+       length can't be skipped. */
+    rc = http_sendstatus(s1, 200, "OK", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s1, "Content-Length", "4", -1);
+    assert(rc == 0);
+    rc = hdone(s1, -1);
+    assert(rc == 0);
+    rc = bsend(s1, "body", 4, -1);
+    assert(rc == 0);
+    rc = http_sendstatus(s1, 200, "OK", -1);
+    assert(rc == 0);
+    rc = http_sendfield(s1, "Transfer-Encoding", "chunked", -1);
+    assert(rc == 0);
+    rc = hdone(s1, -1);
+    assert(rc == 0);
+    rc = bsend(s1, "4\r\nbody\r\n0\r\n\r\n", 14, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    nfields = http_recvheaders(s0, &fields, -1);
+    assert(nfields == 1);
+    assert(http_bodylen(s0) < 0 && errno == ENOTSUP);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc < 0 && errno == EPROTO);
+
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(s0);
+    assert(rc == 0);
+
+    /* Whitespace between the field name and the colon is not allowed. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = http_attach(h[0]);
+    assert(s0 >= 0);
+    rc = bsend(h[1], "HTTP/1.1 200 OK\r\nContent-Length : 5\r\n\r\n", 39, -1);
+    assert(rc == 0);
+    rc = http_recvstatus(s0, reason, sizeof(reason), -1);
+    assert(rc == 200);
+    rc = http_recvfield(s0, name, sizeof(name), value, sizeof(value), -1);
+    assert(rc < 0 && errno == EPROTO);
+    rc = hclose(s0);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
     return 0;
 }
 
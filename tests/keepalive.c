@@ -47,6 +47,23 @@ static void keepalive_pair(int h[2], int both) {
     }
 }
 
+coroutine void keepalive_reader(int s, int64_t deadline) {
+    /* Deliberately small buffer. Pings must get through anyway. */
+    char buf[1];
+    ssize_t sz = mrecv(s, buf, sizeof(buf), deadline);
+    assert(sz < 0 && (errno == ETIMEDOUT || errno == ECANCELED));
+}
+
+coroutine void keepalive_beat(int s, int n, int64_t interval) {
+    int i;
+    for(i = 0; i != n; ++i) {
+        int rc = msleep(now() + interval);
+        assert(rc == 0);
+        rc = msend(s, "K", 1, -1);
+        assert(rc == 0);
+    }
+}
+
 static void keepalive_pair_close(int h[2]) {
     int rc = hclose(h[1]);
     assert(rc == 0);
@@ -89,6 +106,91 @@ int main() {
     assert(elapsed > 130 && elapsed < 170);
     keepalive_pair_close(h);
 
+    /* Check that no keepalives are sent while there's traffic. */
+    keepalive_pair(h, 0);
+    int i;
+    for(i = 0; i != 10; ++i) {
+        rc = msend(h[0], "ABC", 3, -1);
+        assert(rc == 0);
+        sz = mrecv(h[1], buf, sizeof(buf), -1);
+        assert(sz == 4 && buf[0] == 'D');
+        rc = msleep(now() + 20);
+        assert(rc == 0);
+    }
+    start = now();
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz == 1 && buf[0] == 'K');
+    elapsed = now() - start;
+    assert(elapsed > 20 && elapsed < 40);
+    keepalive_pair_close(h);
+
+    /* Check that keepalives on multiple sockets are timed independently. */
+    int h2[2];
+    keepalive_pair(h, 0);
+    keepalive_pair(h2, 0);
+    rc = msend(h2[0], "ABC", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(h2[1], buf, sizeof(buf), -1);
+    assert(sz == 4 && buf[0] == 'D');
+    start = now();
+    rc = msleep(start + 30);
+    assert(rc == 0);
+    rc = msend(h[0], "ABC", 3, -1);
+    assert(rc == 0);
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz == 4 && buf[0] == 'D');
+    sz = mrecv(h2[1], buf, sizeof(buf), -1);
+    assert(sz == 1 && buf[0] == 'K');
+    elapsed = now() - start;
+    assert(elapsed > 40 && elapsed < 60);
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz == 1 && buf[0] == 'K');
+    elapsed = now() - start;
+    assert(elapsed > 70 && elapsed < 90);
+    keepalive_pair_close(h2);
+    keepalive_pair_close(h);
+
+    /* Check round-trip time measurement. */
+    struct keepalive_stats stats;
+    keepalive_pair(h, 1);
+    rc = keepalive_stats(h[0], &stats);
+    assert(rc == 0 && stats.samples == 0);
+    int cr = go(keepalive_reader(h[1], now() + 120));
+    assert(cr >= 0);
+    rc = keepalive_ping(h[0], 10);
+    assert(rc == 0);
+    sz = mrecv(h[0], buf, sizeof(buf), now() + 100);
+    assert(sz < 0 && errno == ETIMEDOUT);
+    rc = keepalive_stats(h[0], &stats);
+    assert(rc == 0);
+    assert(stats.samples >= 5 && stats.samples <= 11);
+    assert(stats.minrtt >= 0 && stats.minrtt <= stats.srtt);
+    assert(stats.srtt < 10000);
+    rc = keepalive_stats(h[1], &stats);
+    assert(rc == 0 && stats.samples == 0);
+    rc = keepalive_ping(h[0], -1);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    keepalive_pair_close(h);
+
+    /* Check that failure detector reacts faster than recv_interval. */
+    keepalive_pair(h, 0);
+    rc = keepalive_detector(h[0], 8.0);
+    assert(rc == 0);
+    assert(keepalive_suspicion(h[0]) == 0);
+    cr = go(keepalive_beat(h[1], 10, 20));
+    assert(cr >= 0);
+    start = now();
+    sz = mrecv(h[0], buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == ECONNRESET);
+    elapsed = now() - start;
+    assert(elapsed > 210 && elapsed < 280);
+    assert(keepalive_suspicion(h[0]) >= 8.0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    keepalive_pair_close(h);
+
     return 0;
 }
 
@@ -0,0 +1,124 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../dsock.h"
+
+int main() {
+    char buf[200];
+
+    int s[2];
+    int rc = ipc_pair(s);
+    assert(rc == 0);
+    int p0 = pfx_attach(s[0]);
+    assert(p0 >= 0);
+    int p1 = pfx_attach(s[1]);
+    assert(p1 >= 0);
+    int b0 = mbatch_attach(p0, 100, 50);
+    assert(b0 >= 0);
+
+    /* Small messages are packed into a single message which is sent
+       after the delay expires. */
+    int64_t start = now();
+    rc = msend(b0, "ABC", 3, -1);
+    assert(rc == 0);
+    rc = msend(b0, "DE", 2, -1);
+    assert(rc == 0);
+    ssize_t sz = mrecv(p1, buf, sizeof(buf), -1);
+    assert(sz == 7);
+    assert(memcmp(buf, "\x03" "ABC" "\x02" "DE", 7) == 0);
+    assert(now() - start >= 40);
+
+    /* Batches are unpacked on the receiving side. */
+    int b1 = mbatch_attach(p1, 100, 50);
+    assert(b1 >= 0);
+    rc = msend(b0, "123", 3, -1);
+    assert(rc == 0);
+    rc = msend(b0, "4567", 4, -1);
+    assert(rc == 0);
+    rc = msend(b0, "", 0, -1);
+    assert(rc == 0);
+    sz = mrecv(b1, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "123", 3) == 0);
+    sz = mrecv(b1, buf, sizeof(buf), -1);
+    assert(sz == 4 && memcmp(buf, "4567", 4) == 0);
+    sz = mrecv(b1, buf, sizeof(buf), -1);
+    assert(sz == 0);
+
+    /* Full batch is sent straight away. */
+    int i;
+    for(i = 0; i != 30; ++i) {
+        memset(buf, 'a' + i % 26, 9);
+        rc = msend(b0, buf, 9, -1);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 30; ++i) {
+        sz = mrecv(b1, buf, sizeof(buf), -1);
+        assert(sz == 9 && buf[0] == 'a' + i % 26 && buf[8] == 'a' + i % 26);
+    }
+
+    /* Message which doesn't fit into a batch. */
+    rc = msend(b0, buf, 100, -1);
+    assert(rc == -1 && errno == EMSGSIZE);
+
+    /* Message which doesn't fit into the receive buffer is dropped. */
+    rc = msend(b0, "123456", 6, -1);
+    assert(rc == 0);
+    rc = msend(b0, "12", 2, -1);
+    assert(rc == 0);
+    sz = mrecv(b1, buf, 3, -1);
+    assert(sz == -1 && errno == EMSGSIZE);
+    sz = mrecv(b1, buf, 3, -1);
+    assert(sz == 2 && memcmp(buf, "12", 2) == 0);
+
+    /* Detach flushes the pending messages. */
+    rc = msend(b0, "XY", 2, -1);
+    assert(rc == 0);
+    int u = mbatch_detach(b0, -1);
+    assert(u == p0);
+    sz = mrecv(b1, buf, sizeof(buf), -1);
+    assert(sz == 2 && memcmp(buf, "XY", 2) == 0);
+
+    rc = hclose(b1);
+    assert(rc == 0);
+    rc = hclose(u);
+    assert(rc == 0);
+
+    /* Invalid batch size. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    p0 = pfx_attach(s[0]);
+    assert(p0 >= 0);
+    b0 = mbatch_attach(p0, 1, 10);
+    assert(b0 < 0 && errno == EINVAL);
+    rc = hclose(p0);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    return 0;
+}
@@ -77,6 +77,122 @@ int main() {
     hclose(thr);
     hclose(crlf1);
 
+    /* Token bucket: Messages are paced evenly. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    thr = mthrottler_attach_bucket(pfx0, 200, 0, 0, 0);
+    assert(thr >= 0);
+    start = now();
+    int64_t prev = start;
+    for(i = 0; i != 20; ++i) {
+        rc = msend(thr, "ABC", 3, -1);
+        assert(rc == 0);
+        int64_t gap = now() - prev;
+        assert(i == 0 || gap >= 3);
+        prev = now();
+    }
+    elapsed = now() - start;
+    assert(elapsed > 85 && elapsed < 300);
+    for(i = 0; i != 20; ++i) {
+        ssize_t sz = mrecv(pfx1, buf, sizeof(buf), -1);
+        assert(sz == 3);
+    }
+    hclose(thr);
+    hclose(pfx1);
+
+    /* Token bucket: Burst of messages followed by pacing on receive. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    thr = mthrottler_attach_bucket(pfx0, 0, 0, 1000, 50);
+    assert(thr >= 0);
+    for(i = 0; i != 100; ++i) {
+        rc = msend(pfx1, "ABC", 3, -1);
+        assert(rc == 0);
+    }
+    start = now();
+    for(i = 0; i != 50; ++i) {
+        ssize_t sz = mrecv(thr, buf, sizeof(buf), -1);
+        assert(sz == 3);
+    }
+    elapsed = now() - start;
+    assert(elapsed < 50);
+    for(i = 0; i != 50; ++i) {
+        ssize_t sz = mrecv(thr, buf, sizeof(buf), -1);
+        assert(sz == 3);
+    }
+    elapsed = now() - start;
+    assert(elapsed > 40 && elapsed < 250);
+    hclose(thr);
+    hclose(pfx1);
+
+    /* Dual mode: Big messages are limited by the byte rate. */
+    char big[100] = {0};
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    thr = mthrottler_attach_dual(pfx0, 1000, 10000, 10, 0, 0, 0);
+    assert(thr >= 0);
+    start = now();
+    for(i = 0; i != 10; ++i) {
+        rc = msend(thr, big, sizeof(big), -1);
+        assert(rc == 0);
+    }
+    elapsed = now() - start;
+    assert(elapsed > 80 && elapsed < 300);
+    for(i = 0; i != 10; ++i) {
+        ssize_t sz = mrecv(pfx1, big, sizeof(big), -1);
+        assert(sz == sizeof(big));
+    }
+
+    /* Dual mode: Small messages are limited by the message rate. */
+    start = now();
+    for(i = 0; i != 100; ++i) {
+        rc = msend(thr, "A", 1, -1);
+        assert(rc == 0);
+    }
+    elapsed = now() - start;
+    assert(elapsed > 80 && elapsed < 300);
+    for(i = 0; i != 100; ++i) {
+        ssize_t sz = mrecv(pfx1, buf, sizeof(buf), -1);
+        assert(sz == 1);
+    }
+    hclose(thr);
+    hclose(pfx1);
+
+    /* Dual mode: recv-throttling charges the size of received messages. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    pfx0 = pfx_attach(s[0]);
+    assert(pfx0 >= 0);
+    pfx1 = pfx_attach(s[1]);
+    assert(pfx1 >= 0);
+    thr = mthrottler_attach_dual(pfx0, 0, 0, 0, 1000, 10000, 10);
+    assert(thr >= 0);
+    for(i = 0; i != 10; ++i) {
+        rc = msend(pfx1, big, sizeof(big), -1);
+        assert(rc == 0);
+    }
+    start = now();
+    for(i = 0; i != 10; ++i) {
+        ssize_t sz = mrecv(thr, big, sizeof(big), -1);
+        assert(sz == sizeof(big));
+    }
+    elapsed = now() - start;
+    assert(elapsed > 70 && elapsed < 300);
+    hclose(thr);
+    hclose(pfx1);
+
     return 0;
 }
 
@@ -88,6 +88,92 @@ int main() {
     rc = hclose(n);
     assert(rc == 0);
 
+    /* Adaptive mode: Single small chunk when idle gets through quickly. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    n = nagle_attach_adaptive(s[0], 5, 1000, 10, 500);
+    assert(n >= 0);
+    int64_t start = now();
+    rc = bsend(n, "12", 2, -1);
+    assert(rc == 0);
+    rc = brecv(s[1], buf, 2, -1);
+    assert(rc == 0);
+    assert(now() - start < 100);
+    struct nagle_stats stats;
+    rc = nagle_stats(n, &stats);
+    assert(rc == 0);
+    assert(stats.timeout_flushes == 1);
+    assert(stats.size_flushes == 0 && stats.bypasses == 0);
+
+    /* Adaptive mode: Batch and interval stay within the bounds under load. */
+    int i;
+    for(i = 0; i != 10000; ++i) {
+        rc = bsend(n, "123", 3, -1);
+        assert(rc == 0);
+        rc = nagle_stats(n, &stats);
+        assert(rc == 0);
+        assert(stats.batch >= 5 && stats.batch <= 1000);
+        assert(stats.interval >= 10 && stats.interval <= 500);
+    }
+    assert(stats.size_flushes > 0);
+    for(i = 0; i != 10000; ++i) {
+        rc = brecv(s[1], buf, 3, -1);
+        assert(rc == 0);
+    }
+    rc = hclose(s[1]);
+    assert(rc == 0);
+    rc = hclose(n);
+    assert(rc == 0);
+
+    /* Adaptive mode: Invalid bounds. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    n = nagle_attach_adaptive(s[0], 100, 10, 10, 500);
+    assert(n < 0 && errno == EINVAL);
+    n = nagle_attach_adaptive(s[0], 10, 100, 500, 10);
+    assert(n < 0 && errno == EINVAL);
+    rc = hclose(s[0]);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    /* Detach flushes the pending data. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    n = nagle_attach(s[0], 5, -1);
+    assert(n >= 0);
+    rc = bsend(n, "12", 2, -1);
+    assert(rc == 0);
+    int u = nagle_detach(n, -1);
+    assert(u == s[0]);
+    rc = brecv(s[1], buf, 2, -1);
+    assert(rc == 0 && buf[0] == '1' && buf[1] == '2');
+    rc = hclose(s[1]);
+    assert(rc == 0);
+    rc = hclose(u);
+    assert(rc == 0);
+
+    /* Writes interleaved with full-batch flushes arrive in order. */
+    rc = ipc_pair(s);
+    assert(rc == 0);
+    n = nagle_attach(s[0], 10, -1);
+    assert(n >= 0);
+    for(i = 0; i != 1000; ++i) {
+        char c = (char)i;
+        rc = bsend(n, &c, 1, -1);
+        assert(rc == 0);
+    }
+    rc = hdone(n, -1);
+    assert(rc == 0);
+    for(i = 0; i != 1000; ++i) {
+        rc = brecv(s[1], buf, 1, -1);
+        assert(rc == 0 && buf[0] == (char)i);
+    }
+    rc = hclose(s[1]);
+    assert(rc == 0);
+    rc = hclose(n);
+    assert(rc == 0);
+
     return 0;
 }
 
@@ -0,0 +1,174 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../dsock.h"
+
+static int shmem_pair(int h[2], size_t bufsz) {
+    int fds[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    h[0] = shmem_connect(fds[0], bufsz, -1);
+    if(h[0] < 0 && errno == ENOTSUP) return -1;
+    assert(h[0] >= 0);
+    h[1] = shmem_accept(fds[1], -1);
+    assert(h[1] >= 0);
+    rc = close(fds[0]);
+    assert(rc == 0);
+    rc = close(fds[1]);
+    assert(rc == 0);
+    return 0;
+}
+
+coroutine void sender(int s, int count) {
+    char buf[100];
+    int i;
+    for(i = 0; i != count; ++i) {
+        size_t len = i % sizeof(buf) + 1;
+        memset(buf, (char)i, len);
+        int rc = msend(s, buf, len, -1);
+        assert(rc == 0);
+    }
+}
+
+int main() {
+    int h[2];
+    char buf[256];
+
+    /* Simple ping-pong. Skip the test if shared memory isn't supported. */
+    if(shmem_pair(h, 1000) < 0) return 77;
+    int rc = msend(h[0], "ABC", 3, -1);
+    assert(rc == 0);
+    ssize_t sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    rc = msend(h[1], "DEFG", 4, -1);
+    assert(rc == 0);
+    sz = mrecv(h[0], buf, sizeof(buf), -1);
+    assert(sz == 4 && memcmp(buf, "DEFG", 4) == 0);
+    sz = mrecv(h[0], buf, sizeof(buf), now() + 50);
+    assert(sz < 0 && errno == ETIMEDOUT);
+
+    /* Message that can never fit into the ring. */
+    char big[1024];
+    rc = msend(h[0], big, sizeof(big), -1);
+    assert(rc < 0 && errno == EMSGSIZE);
+
+    /* Message that doesn't fit into the receive buffer is dropped. */
+    rc = msend(h[0], "HIJKLM", 6, -1);
+    assert(rc == 0);
+    rc = msend(h[0], "NO", 2, -1);
+    assert(rc == 0);
+    sz = mrecv(h[1], buf, 3, -1);
+    assert(sz < 0 && errno == EMSGSIZE);
+    sz = mrecv(h[1], buf, 3, -1);
+    assert(sz == 2 && memcmp(buf, "NO", 2) == 0);
+
+    /* In-place receive. */
+    rc = msend(h[0], "PQRST", 5, -1);
+    assert(rc == 0);
+    rc = msend(h[0], "UV", 2, -1);
+    assert(rc == 0);
+    const void *view;
+    sz = shmem_borrow(h[1], &view, -1);
+    assert(sz == 5 && memcmp(view, "PQRST", 5) == 0);
+    sz = shmem_borrow(h[1], &view, -1);
+    assert(sz < 0 && errno == EBUSY);
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EBUSY);
+    rc = shmem_release(h[1]);
+    assert(rc == 0);
+    rc = shmem_release(h[1]);
+    assert(rc < 0 && errno == EINVAL);
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz == 2 && memcmp(buf, "UV", 2) == 0);
+
+    /* Closing one side is reported to the other one. */
+    rc = hclose(h[0]);
+    assert(rc == 0);
+    sz = mrecv(h[1], buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPIPE);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+
+    /* Sender blocks when the ring is full and gets woken up. */
+    shmem_pair(h, 256);
+    int cr = go(sender(h[0], 10000));
+    assert(cr >= 0);
+    int i;
+    for(i = 0; i != 10000; ++i) {
+        sz = mrecv(h[1], buf, sizeof(buf), -1);
+        assert(sz == i % 100 + 1);
+        assert(buf[0] == (char)i && buf[sz - 1] == (char)i);
+    }
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+    rc = msend(h[0], "ABC", 3, -1);
+    assert(rc < 0 && errno == EPIPE);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Two different processes. */
+    int fds[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(pid == 0) {
+        int s = shmem_accept(fds[1], -1);
+        assert(s >= 0);
+        while(1) {
+            sz = mrecv(s, buf, sizeof(buf), -1);
+            if(sz < 0 && errno == EPIPE) break;
+            assert(sz >= 0);
+            rc = msend(s, buf, sz, -1);
+            assert(rc == 0);
+        }
+        rc = hclose(s);
+        assert(rc == 0);
+        _exit(0);
+    }
+    int s = shmem_connect(fds[0], 4096, -1);
+    assert(s >= 0);
+    for(i = 0; i != 1000; ++i) {
+        rc = msend(s, "ABC", 3, -1);
+        assert(rc == 0);
+        sz = mrecv(s, buf, sizeof(buf), -1);
+        assert(sz == 3 && memcmp(buf, "ABC", 3) == 0);
+    }
+    rc = hclose(s);
+    assert(rc == 0);
+    int status;
+    rc = waitpid(pid, &status, 0);
+    assert(rc == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    return 0;
+}
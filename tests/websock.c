@@ -23,10 +23,53 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 
 #include "../dsock.h"
 
+static void websock_pair(int s[2]) {
+    int h[2];
+    int rc = ipc_pair(h);
+    assert(rc == 0);
+    s[0] = websock_attach(h[0], 1);
+    assert(s[0] >= 0);
+    s[1] = websock_attach(h[1], 0);
+    assert(s[1] >= 0);
+}
+
+coroutine void websock_closed(int s) {
+    char buf[16];
+    ssize_t sz = mrecv(s, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPIPE);
+}
+
+coroutine void websock_sendbig(int s, const void *buf, size_t len) {
+    int rc = msend(s, buf, len, -1);
+    assert(rc == 0 || errno == ECANCELED);
+}
+
+coroutine void websock_recvat(int s, int64_t *when) {
+    char buf[16];
+    ssize_t sz = mrecv(s, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "GHI", 3) == 0);
+    *when = now();
+}
+
+/* Sends a client frame with all-zero masking key, i.e. with the payload
+   as is. */
+static void websock_sendraw(int s, uint8_t head, const void *buf,
+      size_t len) {
+    assert(len < 126);
+    uint8_t hdr[6] = {head, 0x80 | (uint8_t)len, 0, 0, 0, 0};
+    int rc = bsend(s, hdr, sizeof(hdr), -1);
+    assert(rc == 0);
+    rc = bsend(s, buf, len, -1);
+    assert(rc == 0);
+}
+
+static uint8_t big[1 << 20];
+
 int main() {
     int h[2];
     int rc = ipc_pair(h);
@@ -45,10 +88,371 @@ int main() {
     sz = mrecv(s0, buf, sizeof(buf), -1);
     assert(sz == 3 && memcmp(buf, "DEF", 3) == 0);
 
+    /* Check masking of a message split into odd-sized buffers. */
+    static uint8_t src[10000];
+    static uint8_t dst[10000];
+    size_t i;
+    for(i = 0; i != sizeof(src); ++i)
+        src[i] = (uint8_t)(i * 7);
+    struct iolist siol[4] = {
+        {src, 1, &siol[1], 0},
+        {src + 1, 3, &siol[2], 0},
+        {src + 4, 37, &siol[3], 0},
+        {src + 41, sizeof(src) - 41, NULL, 0}};
+    struct iolist diol[3] = {
+        {dst, 5, &diol[1], 0},
+        {dst + 5, 2999, &diol[2], 0},
+        {dst + 3004, sizeof(dst) - 3004, NULL, 0}};
+    rc = msendl(s0, &siol[0], &siol[3], -1);
+    assert(rc == 0);
+    sz = mrecvl(s1, &diol[0], &diol[2], -1);
+    assert(sz == sizeof(src) && memcmp(src, dst, sizeof(src)) == 0);
+    rc = msend(s0, "", 0, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 0);
+
+    /* Check a message bigger than the staging buffer. */
+    static uint8_t big[70000];
+    static uint8_t bigdst[70000];
+    for(i = 0; i != sizeof(big); ++i)
+        big[i] = (uint8_t)(i * 13);
+    rc = msend(s0, big, sizeof(big), -1);
+    assert(rc == 0);
+    sz = mrecv(s1, bigdst, sizeof(bigdst), -1);
+    assert(sz == sizeof(big) && memcmp(big, bigdst, sizeof(big)) == 0);
+
+    /* Check in-place masking. */
+    rc = websock_inplace(s0, 1);
+    assert(rc == 0);
+    memcpy(dst, src, sizeof(src));
+    rc = msend(s0, dst, sizeof(dst), -1);
+    assert(rc == 0);
+    assert(memcmp(src, dst, sizeof(src)) != 0);
+    sz = mrecv(s1, dst, sizeof(dst), -1);
+    assert(sz == sizeof(src) && memcmp(src, dst, sizeof(src)) == 0);
+
+    /* Check streaming of a fragmented message. */
+    rc = websock_inplace(s0, 0);
+    assert(rc == 0);
+    rc = websock_sendfrag(s0, big, 30000, 0, -1);
+    assert(rc == 0);
+    rc = msend(s0, "ABC", 3, -1);
+    assert(rc < 0 && errno == EBUSY);
+    rc = websock_sendfrag(s0, big + 30000, 0, 0, -1);
+    assert(rc == 0);
+    rc = websock_sendfrag(s0, big + 30000, sizeof(big) - 30000, 1, -1);
+    assert(rc == 0);
+    size_t pos = 0;
+    int fin = 0;
+    while(!fin) {
+        sz = websock_recvfrag(s1, bigdst + pos, 999, &fin, -1);
+        assert(sz >= 0 && sz <= 999);
+        pos += sz;
+        if(!fin) {
+            sz = mrecv(s1, buf, sizeof(buf), -1);
+            assert(sz < 0 && errno == EBUSY);
+        }
+    }
+    assert(pos == sizeof(big) && memcmp(big, bigdst, sizeof(big)) == 0);
+    /* Fragmented message can be received in one go. */
+    rc = websock_sendfrag(s0, "AB", 2, 0, -1);
+    assert(rc == 0);
+    rc = websock_sendfrag(s0, "C", 1, 1, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "ABC", 3) == 0);
+
+    /* Check broadcasting of a pre-encoded frame. */
+    int srv[3];
+    int cli[3];
+    for(i = 0; i != 3; ++i) {
+        int p[2];
+        rc = ipc_pair(p);
+        assert(rc == 0);
+        cli[i] = websock_attach(p[0], 1);
+        assert(cli[i] >= 0);
+        srv[i] = websock_attach(p[1], 0);
+        assert(srv[i] >= 0);
+    }
+    int f = websock_frame("GHI", 3);
+    assert(f >= 0);
+    rc = websock_broadcast(f, srv, 3, -1);
+    assert(rc == 0);
+    rc = websock_broadcast(f, cli, 3, -1);
+    assert(rc < 0 && errno == EINVAL);
+    rc = hclose(f);
+    assert(rc == 0);
+    for(i = 0; i != 3; ++i) {
+        sz = mrecv(cli[i], buf, sizeof(buf), -1);
+        assert(sz == 3 && memcmp(buf, "GHI", 3) == 0);
+        rc = hclose(cli[i]);
+        assert(rc == 0);
+        rc = hclose(srv[i]);
+        assert(rc == 0);
+    }
+
     rc = hclose(s0);
     assert(rc == 0);
     rc = hclose(s1);
     assert(rc == 0);
+
+    /* Check that pings are answered while receiving. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    rc = bsend(h[0], "\x89\x83\0\0\0\0abc\x82\x83\0\0\0\0XYZ", 18, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "XYZ", 3) == 0);
+    rc = brecv(h[0], buf, 5, -1);
+    assert(rc == 0 && memcmp(buf, "\x8a\x03" "abc", 5) == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Check that receiving doesn't wait for a large message to be sent
+       before answering a ping. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    int cr = go(websock_sendbig(s1, big, sizeof(big)));
+    assert(cr >= 0);
+    rc = bsend(h[0], "\x89\x83\0\0\0\0abc\x82\x83\0\0\0\0XYZ", 18, -1);
+    assert(rc == 0);
+    int64_t start = now();
+    sz = mrecv(s1, buf, sizeof(buf), now() + 1000);
+    assert(sz == 3 && memcmp(buf, "XYZ", 3) == 0);
+    assert(now() - start < 500);
+    rc = brecv(h[0], buf, 10, -1);
+    assert(rc == 0 && memcmp(buf, "\x82\x7f", 2) == 0);
+    rc = brecv(h[0], NULL, sizeof(big), -1);
+    assert(rc == 0);
+    rc = brecv(h[0], buf, 5, -1);
+    assert(rc == 0 && memcmp(buf, "\x8a\x03" "abc", 5) == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Check that a stuck socket doesn't hold up the broadcast. */
+    for(i = 0; i != 3; ++i) {
+        int p[2];
+        rc = ipc_pair(p);
+        assert(rc == 0);
+        cli[i] = websock_attach(p[0], 1);
+        assert(cli[i] >= 0);
+        srv[i] = websock_attach(p[1], 0);
+        assert(srv[i] >= 0);
+    }
+    cr = go(websock_sendbig(srv[0], big, sizeof(big)));
+    assert(cr >= 0);
+    int64_t when[2] = {-1, -1};
+    int rcv[2];
+    for(i = 0; i != 2; ++i) {
+        rcv[i] = go(websock_recvat(cli[i + 1], &when[i]));
+        assert(rcv[i] >= 0);
+    }
+    f = websock_frame("GHI", 3);
+    assert(f >= 0);
+    start = now();
+    rc = websock_broadcast(f, srv, 3, now() + 200);
+    assert(rc < 0 && errno == ETIMEDOUT);
+    for(i = 0; i != 2; ++i) {
+        assert(when[i] >= 0 && when[i] - start < 200);
+        rc = hclose(rcv[i]);
+        assert(rc == 0);
+    }
+    rc = hclose(f);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    for(i = 0; i != 3; ++i) {
+        rc = hclose(cli[i]);
+        assert(rc == 0);
+        rc = hclose(srv[i]);
+        assert(rc == 0);
+    }
+
+    /* Check UTF-8 validation of text split between frames. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s1 = websock_attach(h[1], 0);
+    assert(s1 >= 0);
+    rc = websock_utf8(s1, 1);
+    assert(rc == 0);
+    rc = bsend(h[0], "\x01\x82\0\0\0\0a\xc3\x80\x81\0\0\0\0\xa9", 15, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz == 3 && memcmp(buf, "a\xc3\xa9", 3) == 0);
+    rc = bsend(h[0], "\x81\x81\0\0\0\0\xff", 7, -1);
+    assert(rc == 0);
+    sz = mrecv(s1, buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == EPROTO);
+    rc = brecv(h[0], buf, 4, -1);
+    assert(rc == 0 && memcmp(buf, "\x88\x02\x03\xef", 4) == 0);
+    rc = hclose(s1);
+    assert(rc == 0);
+    rc = hclose(h[0]);
+    assert(rc == 0);
+
+    /* Check UTF-8 validation of texts long enough to be validated in
+       blocks, both in a single frame and split between frames. */
+    uint8_t text[104];
+    memset(text, 'a', sizeof(text));
+    memcpy(text + 30, "\xe2\x82\xac", 3);
+    memcpy(text + 62, "\xf0\x9f\x98\x80", 4);
+    for(i = 0; i != 2; ++i) {
+        rc = ipc_pair(h);
+        assert(rc == 0);
+        s1 = websock_attach(h[1], 0);
+        assert(s1 >= 0);
+        rc = websock_utf8(s1, 1);
+        assert(rc == 0);
+        if(i == 0)
+            websock_sendraw(h[0], 0x81, text, 80);
+        else {
+            websock_sendraw(h[0], 0x01, text, 31);
+            websock_sendraw(h[0], 0x80, text + 31, 49);
+        }
+        sz = mrecv(s1, dst, sizeof(dst), -1);
+        assert(sz == 80 && memcmp(dst, text, 80) == 0);
+        rc = hclose(s1);
+        assert(rc == 0);
+        rc = hclose(h[0]);
+        assert(rc == 0);
+    }
+    /* Overlong sequence, surrogate and code point above U+10FFFF. */
+    const char *invalid[] = {"\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80"};
+    for(i = 0; i != 6; ++i) {
+        memset(text, 'a', sizeof(text));
+        memcpy(text + 80, invalid[i / 2], strlen(invalid[i / 2]));
+        rc = ipc_pair(h);
+        assert(rc == 0);
+        s1 = websock_attach(h[1], 0);
+        assert(s1 >= 0);
+        rc = websock_utf8(s1, 1);
+        assert(rc == 0);
+        if(i % 2 == 0)
+            websock_sendraw(h[0], 0x81, text + 40, 64);
+        else {
+            websock_sendraw(h[0], 0x01, text, 40);
+            websock_sendraw(h[0], 0x80, text + 40, 64);
+        }
+        sz = mrecv(s1, dst, sizeof(dst), -1);
+        assert(sz < 0 && errno == EPROTO);
+        rc = brecv(h[0], buf, 4, -1);
+        assert(rc == 0 && memcmp(buf, "\x88\x02\x03\xef", 4) == 0);
+        rc = hclose(s1);
+        assert(rc == 0);
+        rc = hclose(h[0]);
+        assert(rc == 0);
+    }
+
+    /* Check that compression is used only once both peers offered it. */
+    rc = ipc_pair(h);
+    assert(rc == 0);
+    s0 = websock_attach(h[0], 1);
+    assert(s0 >= 0);
+    rc = bsend(h[1], "\x89\x09" "dsock-lz4" "\x82\x01x", 14, -1);
+    assert(rc == 0);
+    rc = websock_compress(s0, 64, -1);
+    assert(rc == 0);
+    sz = mrecv(s0, buf, sizeof(buf), -1);
+    assert(sz == 1 && buf[0] == 'x');
+    memset(src, 'a', 1000);
+    rc = msend(s0, src, 1000, -1);
+    assert(rc == 0);
+    /* The offer, the pong and the compressed message. */
+    uint8_t raw[64];
+    rc = brecv(h[1], raw, 36, -1);
+    assert(rc == 0);
+    assert(raw[0] == 0x89 && raw[15] == 0x8a && raw[30] == 0xc2);
+    assert((raw[31] & 0x7f) < 100);
+    rc = hclose(s0);
+    assert(rc == 0);
+    rc = hclose(h[1]);
+    assert(rc == 0);
+
+    /* Check compressed messages in both directions. */
+    int s[2];
+    websock_pair(s);
+    rc = websock_compress(s[0], 64, -1);
+    assert(rc == 0);
+    rc = websock_compress(s[1], 64, -1);
+    assert(rc == 0);
+    rc = msend(s[1], "hi", 2, -1);
+    assert(rc == 0);
+    sz = mrecv(s[0], buf, sizeof(buf), -1);
+    assert(sz == 2 && memcmp(buf, "hi", 2) == 0);
+    for(i = 0; i != sizeof(src); ++i)
+        src[i] = "abcdefgh"[i % 97 % 8];
+    rc = msendl(s[0], &siol[0], &siol[3], -1);
+    assert(rc == 0);
+    memset(dst, 0, sizeof(dst));
+    sz = mrecvl(s[1], &diol[0], &diol[2], -1);
+    assert(sz == sizeof(src) && memcmp(src, dst, sizeof(src)) == 0);
+    rc = msend(s[1], src, sizeof(src), -1);
+    assert(rc == 0);
+    memset(dst, 0, sizeof(dst));
+    sz = mrecv(s[0], dst, sizeof(dst), -1);
+    assert(sz == sizeof(src) && memcmp(src, dst, sizeof(src)) == 0);
+    rc = msend(s[1], src, sizeof(src), -1);
+    assert(rc == 0);
+    sz = mrecv(s[0], dst, 100, -1);
+    assert(sz < 0 && errno == EMSGSIZE);
+    rc = hclose(s[0]);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    /* Check the closing handshake. */
+    websock_pair(s);
+    cr = go(websock_closed(s[1]));
+    assert(cr >= 0);
+    int u = websock_detach(s[0], now() + 1000);
+    assert(u >= 0);
+    rc = msend(s[1], "ABC", 3, -1);
+    assert(rc < 0 && errno == EPIPE);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = hclose(u);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    /* Check that silent peer is detected. */
+    websock_pair(s);
+    rc = websock_heartbeat(s[1], -1, 100);
+    assert(rc == 0);
+    start = now();
+    sz = mrecv(s[1], buf, sizeof(buf), -1);
+    assert(sz < 0 && errno == ECONNRESET);
+    int64_t elapsed = now() - start;
+    assert(elapsed > 80 && elapsed < 300);
+    rc = hclose(s[0]);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
+    /* Check that heartbeats keep idle connection alive. */
+    websock_pair(s);
+    rc = websock_heartbeat(s[0], 20, -1);
+    assert(rc == 0);
+    rc = websock_heartbeat(s[1], -1, 100);
+    assert(rc == 0);
+    sz = mrecv(s[1], buf, sizeof(buf), now() + 250);
+    assert(sz < 0 && errno == ETIMEDOUT);
+    rc = hclose(s[0]);
+    assert(rc == 0);
+    rc = hclose(s[1]);
+    assert(rc == 0);
+
     return 0;
 }
 
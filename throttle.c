@@ -0,0 +1,189 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdillimpl.h>
+#include <stdlib.h>
+
+#include "dsock.h"
+#include "throttle.h"
+#include "utils.h"
+
+dsock_unique_id(throttle_group_type);
+
+#define THROTTLE_NS 1000000000
+
+/* Time needed to send the units, in nanoseconds. */
+static int64_t throttle_cost(uint64_t rate, uint64_t units) {
+    return (units / rate) * THROTTLE_NS + (units % rate) * THROTTLE_NS / rate;
+}
+
+void throttle_init(struct throttle *self, uint64_t rate, uint64_t burst) {
+    dsock_assert(rate > 0);
+    self->rate = rate;
+    self->burst = burst;
+    /* Bucket is full. */
+    self->tat = 0;
+}
+
+int throttle_acquire(struct throttle **buckets, const uint64_t *units,
+      size_t nbuckets, int64_t deadline) {
+    int64_t nw = now();
+    /* Find out the time when all the buckets allow the operation. */
+    int64_t t = nw * 1000000;
+    size_t i;
+    for(i = 0; i != nbuckets; ++i) {
+        struct throttle *b = buckets[i];
+        if(!b) continue;
+        int64_t cost = throttle_cost(b->rate, units[i]);
+        int64_t tau = throttle_cost(b->rate, b->burst);
+        t = MAX(t, b->tat + MIN(cost, tau) - tau);
+    }
+    /* Clock has millisecond resolution. Anything within the current
+       millisecond is allowed straight away. Otherwise every sub-millisecond
+       operation would have to wait for the next tick. The error doesn't
+       accumulate because the time is reserved with full precision. */
+    int64_t ms = t / 1000000;
+    if(dsock_slow(deadline >= 0 && ms > nw && ms > deadline)) {
+        int rc = msleep(deadline);
+        if(dsock_slow(rc < 0)) return -1;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    /* Reserve the time slot. Each bucket is charged as if the operation
+       was done as soon as that bucket allows. Otherwise a socket limited
+       by its own bucket would push its group's capacity into the future
+       and stall the other sockets in the group. */
+    for(i = 0; i != nbuckets; ++i) {
+        struct throttle *b = buckets[i];
+        if(!b) continue;
+        b->tat = MAX(b->tat, nw * 1000000) + throttle_cost(b->rate, units[i]);
+    }
+    if(ms > nw) {
+        int rc = msleep(ms);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    return 0;
+}
+
+void throttle_charge(struct throttle *self, uint64_t units) {
+    self->tat = MAX(self->tat, now() * 1000000) +
+        throttle_cost(self->rate, units);
+}
+
+void throttle_aimd_init(struct throttle_aimd *self, struct throttle *bucket,
+      uint64_t minrate, uint64_t maxrate, int64_t latency) {
+    throttle_init(bucket, maxrate, 0);
+    self->minrate = minrate;
+    self->maxrate = maxrate;
+    self->step = MAX((maxrate - minrate) / 32, 1);
+    self->latency = latency;
+    self->last = now();
+}
+
+void throttle_aimd_adjust(struct throttle_aimd *self, struct throttle *bucket,
+      int64_t duration) {
+    /* Adjust the rate at most once per latency period. Otherwise a single
+       congestion episode would halve the rate many times over. */
+    int64_t nw = now();
+    if(nw - self->last < self->latency) return;
+    if(duration > self->latency)
+        bucket->rate = MAX(bucket->rate / 2, self->minrate);
+    else
+        bucket->rate = MIN(bucket->rate + self->step, self->maxrate);
+    self->last = nw;
+}
+
+static void *throttle_group_hquery(struct hvfs *hvfs, const void *type) {
+    struct throttle_group *obj = (struct throttle_group*)hvfs;
+    if(type == throttle_group_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+static void throttle_group_hclose(struct hvfs *hvfs) {
+    struct throttle_group *obj = (struct throttle_group*)hvfs;
+    /* The group lives on till the last member socket leaves it. */
+    if(!--obj->refs) free(obj);
+}
+
+int throttler_group(uint64_t send_rate, uint64_t send_burst,
+      uint64_t recv_rate, uint64_t recv_burst) {
+    int err;
+    if(dsock_slow(send_rate > THROTTLE_MAXRATE ||
+          recv_rate > THROTTLE_MAXRATE)) {
+        err = EINVAL; goto error1;}
+    struct throttle_group *obj = malloc(sizeof(struct throttle_group));
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = throttle_group_hquery;
+    obj->hvfs.close = throttle_group_hclose;
+    obj->hvfs.done = NULL;
+    obj->send.rate = 0;
+    if(send_rate > 0) throttle_init(&obj->send, send_rate, send_burst);
+    obj->recv.rate = 0;
+    if(recv_rate > 0) throttle_init(&obj->recv, recv_rate, recv_burst);
+    obj->refs = 1;
+    obj->sockets = 0;
+    obj->send_units = 0;
+    obj->recv_units = 0;
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* How far ahead the capacity of the bucket is already reserved. */
+static int64_t throttle_backlog(struct throttle *self) {
+    if(!self->rate) return 0;
+    return MAX(self->tat / 1000000 - now(), 0);
+}
+
+int throttler_group_stats(int g, struct throttler_group_stats *stats) {
+    struct throttle_group *obj = hquery(g, throttle_group_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(!stats)) {errno = EINVAL; return -1;}
+    stats->sockets = obj->sockets;
+    stats->send_units = obj->send_units;
+    stats->recv_units = obj->recv_units;
+    stats->send_backlog = throttle_backlog(&obj->send);
+    stats->recv_backlog = throttle_backlog(&obj->recv);
+    return 0;
+}
+
+struct throttle_group *throttle_group_join(int g) {
+    struct throttle_group *obj = hquery(g, throttle_group_type);
+    if(dsock_slow(!obj)) return NULL;
+    obj->refs++;
+    obj->sockets++;
+    return obj;
+}
+
+void throttle_group_leave(struct throttle_group *self) {
+    self->sockets--;
+    if(!--self->refs) free(self);
+}
@@ -0,0 +1,123 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_THROTTLE_H_INCLUDED
+#define DSOCK_THROTTLE_H_INCLUDED
+
+#include <libdillimpl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Token bucket implemented as generic cell rate algorithm. Instead of the
+   number of tokens the bucket keeps the theoretical time when it would be
+   full again. That way there's no need to refill it periodically and time
+   is accounted for with nanosecond precision even though libdill clock has
+   millisecond resolution. Rate is in units per second, where unit is
+   a byte or a message, depending on the user. Burst is the number of units
+   that can be sent at once when the bucket is full. Zero burst means that
+   the operations are paced evenly. */
+
+/* Higher rates would overflow the nanosecond arithmetic. */
+#define THROTTLE_MAXRATE (UINT64_MAX / 1000000000)
+
+struct throttle {
+    uint64_t rate;
+    uint64_t burst;
+    /* Theoretical arrival time, in nanoseconds. */
+    int64_t tat;
+};
+
+void throttle_init(
+    struct throttle *self,
+    uint64_t rate,
+    uint64_t burst);
+
+/* Waits till all the buckets allow for the specified amount of units
+   to pass and takes the units out of them. NULL buckets are ignored.
+   The time is reserved before waiting so the concurrent callers are
+   served in FIFO order. Operations bigger than the burst are let through
+   once the bucket is full, leaving it in debt. */
+int throttle_acquire(
+    struct throttle **buckets,
+    const uint64_t *units,
+    size_t nbuckets,
+    int64_t deadline);
+
+/* Takes the units out of the bucket without waiting. Used when the amount
+   is known only after the operation was done. */
+void throttle_charge(
+    struct throttle *self,
+    uint64_t units);
+
+/* Adjusts the rate of the bucket using additive increase/multiplicative
+   decrease. Duration of the underlying operation is used as a measure of
+   congestion downstream. If it exceeds 'latency' the rate is halved,
+   otherwise it is increased by 1/32 of the range once per 'latency'
+   milliseconds. Rate starts at maximum. */
+
+struct throttle_aimd {
+    uint64_t minrate;
+    uint64_t maxrate;
+    uint64_t step;
+    int64_t latency;
+    /* Last time the rate was adjusted. */
+    int64_t last;
+};
+
+void throttle_aimd_init(
+    struct throttle_aimd *self,
+    struct throttle *bucket,
+    uint64_t minrate,
+    uint64_t maxrate,
+    int64_t latency);
+void throttle_aimd_adjust(
+    struct throttle_aimd *self,
+    struct throttle *bucket,
+    int64_t duration);
+
+/* Throttle group is shared by multiple throttled sockets. Each socket takes
+   the units out of both its own bucket and the group's bucket. Given that
+   the time is reserved in FIFO order and that the sockets pass the data in
+   small chunks, the group's capacity is shared fairly among the sockets. */
+
+struct throttle_group {
+    struct hvfs hvfs;
+    /* Zero rate means that the direction is not limited. */
+    struct throttle send;
+    struct throttle recv;
+    /* The handle and each member socket hold a reference. */
+    size_t refs;
+    size_t sockets;
+    uint64_t send_units;
+    uint64_t recv_units;
+};
+
+/* Adds a socket to the group referred to by handle 'g'. */
+struct throttle_group *throttle_group_join(
+    int g);
+void throttle_group_leave(
+    struct throttle_group *self);
+
+#endif
+
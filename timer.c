@@ -0,0 +1,227 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <libdill.h>
+#include <stddef.h>
+
+#include "timer.h"
+#include "utils.h"
+
+/* Each level has 64 slots. Slot at level 0 covers one millisecond, slot at
+   level 1 covers 64 milliseconds and so on. Timers at higher levels are
+   moved to lower levels as the time goes on. Four levels cover deadlines
+   up to 4.6 hours. Timers further in the future are parked in the last
+   level and re-inserted once they get there. */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+struct timer_wheel {
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    size_t counts[TIMER_LEVELS];
+    size_t count;
+    /* Time up to which the timers were processed. */
+    int64_t cur;
+    /* Background coroutine and the channel to wake it up. */
+    int service;
+    int wakech;
+    /* Time when the coroutine is going to wake up. -1 if it is not running
+       or sleeping without a deadline. */
+    int64_t wakeup;
+    int running;
+};
+
+/* libdill handles can't be shared among threads. Therefore, there's one
+   wheel per thread. */
+static __thread struct timer_wheel timer_wheel = {.service = -1,
+    .wakech = -1};
+
+static void timer_insert(struct timer_wheel *w, struct timer *self) {
+    int64_t delta = self->expiry - w->cur;
+    int64_t expiry = self->expiry;
+    int level;
+    if(delta <= 0) {
+        /* Already expired. Fire at the next tick. */
+        level = 0;
+        expiry = w->cur + 1;
+    }
+    else {
+        for(level = 0; level != TIMER_LEVELS - 1; ++level)
+            if(delta < (int64_t)1 << (TIMER_BITS * (level + 1))) break;
+        /* Too far in the future. Park the timer at the last level. */
+        int64_t max = ((int64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+        if(delta > max) expiry = w->cur + max;
+    }
+    struct timer **slot = &w->slots[level]
+        [(expiry >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    self->level = level;
+    self->next = *slot;
+    if(self->next) self->next->pprev = &self->next;
+    self->pprev = slot;
+    *slot = self;
+    w->counts[level]++;
+    w->count++;
+}
+
+static void timer_unlink(struct timer_wheel *w, struct timer *self) {
+    *self->pprev = self->next;
+    if(self->next) self->next->pprev = self->pprev;
+    self->next = NULL;
+    self->pprev = NULL;
+    w->counts[self->level]--;
+    w->count--;
+}
+
+/* Process all the timers that expired up to 'target'. */
+static void timer_advance(struct timer_wheel *w, int64_t target) {
+    while(w->cur < target) {
+        if(!w->count) {w->cur = target; break;}
+        /* If the lower levels are empty there's nothing to do till
+           the next slot boundary on the first non-empty level. */
+        int level = 0;
+        while(level != TIMER_LEVELS - 1 && !w->counts[level]) ++level;
+        int64_t next = w->cur + 1;
+        if(level > 0) {
+            int64_t gran = (int64_t)1 << (TIMER_BITS * level);
+            next = (w->cur | (gran - 1)) + 1;
+        }
+        w->cur = MIN(next, target);
+        /* Move timers from the higher levels to the lower ones. Higher
+           levels first so that timers can cascade all the way down. */
+        for(level = TIMER_LEVELS - 1; level > 0; --level) {
+            int64_t gran = (int64_t)1 << (TIMER_BITS * level);
+            if(w->cur & (gran - 1)) continue;
+            struct timer **slot = &w->slots[level]
+                [(w->cur >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+            struct timer *it = *slot;
+            *slot = NULL;
+            while(it) {
+                struct timer *nx = it->next;
+                w->counts[level]--;
+                w->count--;
+                timer_insert(w, it);
+                it = nx;
+            }
+        }
+        /* Fire the expired timers. The callback may add or remove timers,
+           so always take the first one from the slot. */
+        struct timer **slot = &w->slots[0][w->cur & (TIMER_SLOTS - 1)];
+        while(*slot) {
+            struct timer *it = *slot;
+            timer_unlink(w, it);
+            if(dsock_slow(it->expiry > w->cur)) {
+                timer_insert(w, it);
+                continue;
+            }
+            it->callback(it);
+        }
+    }
+}
+
+/* Returns the time when the next timer may need attention. */
+static int64_t timer_next(struct timer_wheel *w) {
+    if(!w->count) return -1;
+    int64_t next = -1;
+    int level;
+    for(level = 0; level != TIMER_LEVELS; ++level) {
+        if(!w->counts[level]) continue;
+        int shift = TIMER_BITS * level;
+        int64_t base = w->cur >> shift;
+        int i;
+        for(i = 1; i <= TIMER_SLOTS; ++i) {
+            if(w->slots[level][(base + i) & (TIMER_SLOTS - 1)]) {
+                int64_t t = (base + i) << shift;
+                if(next < 0 || t < next) next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static coroutine void timer_service(struct timer_wheel *w) {
+    while(w->count) {
+        w->wakeup = timer_next(w);
+        int dummy;
+        int rc = chrecv(w->wakech, &dummy, sizeof(dummy), w->wakeup);
+        if(dsock_slow(rc < 0 && errno == ECANCELED)) break;
+        timer_advance(w, now());
+    }
+    w->running = 0;
+    w->wakeup = -1;
+}
+
+void timer_init(struct timer *self, void (*callback)(struct timer *self)) {
+    self->next = NULL;
+    self->pprev = NULL;
+    self->expiry = 0;
+    self->level = 0;
+    self->callback = callback;
+}
+
+int timer_add(struct timer *self, int64_t deadline) {
+    struct timer_wheel *w = &timer_wheel;
+    if(dsock_slow(w->wakech < 0)) {
+        w->wakech = chmake(sizeof(int));
+        if(dsock_slow(w->wakech < 0)) return -1;
+    }
+    if(!w->running) {
+        /* The coroutine exits when there are no timers. Clean it up. */
+        if(w->service >= 0) {
+            int rc = hclose(w->service);
+            dsock_assert(rc == 0);
+            w->service = -1;
+        }
+        /* Wheel was idle. Catch up with the current time. */
+        w->cur = MAX(w->cur, now());
+    }
+    if(self->pprev) timer_unlink(w, self);
+    self->expiry = deadline;
+    timer_insert(w, self);
+    if(!w->running) {
+        w->running = 1;
+        w->service = go(timer_service(w));
+        if(dsock_slow(w->service < 0)) {
+            int err = errno;
+            w->running = 0;
+            timer_unlink(w, self);
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+    /* Wake the coroutine up if the timer expires before it would. */
+    if(w->wakeup < 0 || deadline < w->wakeup) {
+        int dummy = 0;
+        chsend(w->wakech, &dummy, sizeof(dummy), 0);
+    }
+    return 0;
+}
+
+void timer_rm(struct timer *self) {
+    if(!self->pprev) return;
+    timer_unlink(&timer_wheel, self);
+}
+
@@ -0,0 +1,59 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef DSOCK_TIMER_H_INCLUDED
+#define DSOCK_TIMER_H_INCLUDED
+
+#include <stdint.h>
+
+/* Hierarchical timer wheel shared by all the sockets in the thread. It is
+   meant for sockets that need to do something rarely, e.g. send a keepalive
+   once in a while, and would otherwise have to keep a coroutine around just
+   to wait for the deadline. A single coroutine is sleeping on behalf of all
+   the timers instead. The callback is invoked from that coroutine and thus
+   must not block. If it needs to do a blocking operation it should launch
+   a new coroutine to do it. */
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    int64_t expiry;
+    int level;
+    void (*callback)(struct timer *self);
+};
+
+void timer_init(
+    struct timer *self,
+    void (*callback)(struct timer *self));
+/* Callback is invoked once the deadline expires. If the timer is already
+   running it is rescheduled. */
+int timer_add(
+    struct timer *self,
+    int64_t deadline);
+/* It's OK to remove a timer that is not running. */
+void timer_rm(
+    struct timer *self);
+
+#endif
+
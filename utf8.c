@@ -0,0 +1,289 @@
+/*
+
+  Copyright (c) 2017 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define DSOCK_UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+#include "utf8.h"
+#include "utils.h"
+
+void utf8_init(struct utf8_state *self) {
+    self->need = 0;
+    self->lo = 0x80;
+    self->hi = 0xbf;
+}
+
+int utf8_complete(const struct utf8_state *self) {
+    return self->need == 0;
+}
+
+/* Byte-by-byte validation as per the table in RFC 3629, section 4. */
+static int utf8_scalar(struct utf8_state *self, const uint8_t *buf,
+      size_t len) {
+    size_t i = 0;
+    while(i != len) {
+        if(self->need == 0) {
+            /* Skip ASCII 8 bytes at a time. */
+            while(len - i >= 8) {
+                uint64_t w;
+                memcpy(&w, buf + i, 8);
+                if(w & 0x8080808080808080ull) break;
+                i += 8;
+            }
+            if(i == len) break;
+            uint8_t c = buf[i++];
+            if(c < 0x80) continue;
+            self->lo = 0x80;
+            self->hi = 0xbf;
+            if(c >= 0xc2 && c <= 0xdf) self->need = 1;
+            else if(c >= 0xe0 && c <= 0xef) {
+                self->need = 2;
+                if(c == 0xe0) self->lo = 0xa0;
+                if(c == 0xed) self->hi = 0x9f;
+            }
+            else if(c >= 0xf0 && c <= 0xf4) {
+                self->need = 3;
+                if(c == 0xf0) self->lo = 0x90;
+                if(c == 0xf4) self->hi = 0x8f;
+            }
+            else return -1;
+            continue;
+        }
+        uint8_t c = buf[i++];
+        if(dsock_slow(c < self->lo || c > self->hi)) return -1;
+        self->need--;
+        self->lo = 0x80;
+        self->hi = 0xbf;
+    }
+    return 0;
+}
+
+typedef size_t (*utf8_fn)(const uint8_t *buf, size_t len, int *err);
+
+/* Returns the number of bytes at the beginning of the last 32 that can't
+   be validated by a kernel because the character is not complete. */
+static size_t utf8_incomplete(const uint8_t *buf, size_t len) {
+    size_t i;
+    for(i = 1; i <= 3 && i <= len; ++i) {
+        uint8_t c = buf[len - i];
+        if(c < 0x80) return 0;
+        if(c < 0xc0) continue;
+        size_t sz = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+        return sz > i ? i : 0;
+    }
+    return 0;
+}
+
+#if defined DSOCK_UTF8_X86
+
+/* Skips ASCII text 16 bytes at a time. Returns the number of bytes
+   validated. */
+__attribute__((target("sse2")))
+static size_t utf8_sse2(const uint8_t *buf, size_t len, int *err) {
+    size_t i = 0;
+    while(len - i >= 16) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(buf + i));
+        if(_mm_movemask_epi8(w)) break;
+        i += 16;
+    }
+    *err = 0;
+    return i;
+}
+
+/* Validates whole 32-byte blocks using the lookup algorithm by Keiser and
+   Lemire ("Validating UTF-8 in less than one instruction per byte").
+   Each byte is classified by its high nibble together with the high and
+   low nibble of the preceding byte; the three lookups are ANDed and any
+   remaining bit denotes an error. Returns the number of bytes validated.
+   Character split at the end of the last block is left for the caller. */
+
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+__attribute__((target("avx2")))
+static __m256i utf8_table(const int8_t *t) {
+    __m128i half = _mm_loadu_si128((const __m128i*)t);
+    return _mm256_broadcastsi128_si256(half);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_avx2(const uint8_t *buf, size_t len, int *err) {
+    static const int8_t byte1high[16] = {
+        /* 0xxx: ASCII in byte 1. */
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        /* 10xx: continuation in byte 1. */
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        /* 1100: two byte lead, may be overlong. */
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        /* 1101: two byte lead. */
+        UTF8_TOO_SHORT,
+        /* 1110: three byte lead. */
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        /* 1111: four byte lead. */
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+            UTF8_OVERLONG_4};
+    static const int8_t byte1low[16] = {
+        /* xxxx0000 */
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        /* xxxx0001 */
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        /* xxxx001x */
+        UTF8_CARRY,
+        UTF8_CARRY,
+        /* xxxx0100 */
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        /* xxxx0101 to xxxx1100 */
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        /* xxxx1101 */
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        /* xxxx111x */
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000};
+    static const int8_t byte2high[16] = {
+        /* 0xxx: ASCII in byte 2. */
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        /* 1000 */
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        /* 1001 */
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+            UTF8_TOO_LARGE,
+        /* 101x */
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+            UTF8_TOO_LARGE,
+        /* 11xx: lead byte in byte 2. */
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT};
+    const __m256i t1h = utf8_table(byte1high);
+    const __m256i t1l = utf8_table(byte1low);
+    const __m256i t2h = utf8_table(byte2high);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    /* Bytes which, if they are among the last three, start a character
+       that doesn't fit into the block. */
+    const __m256i maxval = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    __m256i prev = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+    while(len - i >= 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(buf + i));
+        if(!_mm256_movemask_epi8(in)) {
+            /* ASCII block can't complete the previous block's character. */
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+        }
+        else {
+            __m256i shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(in, shifted, 15);
+            __m256i prev2 = _mm256_alignr_epi8(in, shifted, 14);
+            __m256i prev3 = _mm256_alignr_epi8(in, shifted, 13);
+            __m256i b1h = _mm256_shuffle_epi8(t1h,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            __m256i b1l = _mm256_shuffle_epi8(t1l,
+                _mm256_and_si256(prev1, nibble));
+            __m256i b2h = _mm256_shuffle_epi8(t2h,
+                _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+            __m256i sc = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+            /* Third and fourth bytes of a character must be
+               continuations. */
+            __m256i third = _mm256_subs_epu8(prev2,
+                _mm256_set1_epi8((char)(0xe0 - 0x80)));
+            __m256i fourth = _mm256_subs_epu8(prev3,
+                _mm256_set1_epi8((char)(0xf0 - 0x80)));
+            __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                _mm256_set1_epi8((char)0x80));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+            incomplete = _mm256_subs_epu8(in, maxval);
+        }
+        prev = in;
+        i += 32;
+    }
+    *err = !_mm256_testz_si256(error, error);
+    return i;
+}
+
+#endif
+
+static utf8_fn utf8_kernel(void) {
+    static utf8_fn kernel = NULL;
+    static int resolved = 0;
+    /* Racing threads would store the same value so there's no need
+       for synchronisation. */
+    if(dsock_fast(resolved)) return kernel;
+#if defined DSOCK_UTF8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) kernel = utf8_avx2;
+    else if(__builtin_cpu_supports("sse2")) kernel = utf8_sse2;
+#endif
+    resolved = 1;
+    return kernel;
+}
+
+int utf8_validate(struct utf8_state *self, const uint8_t *buf, size_t len) {
+    /* Finish the character split between the pieces first, so that
+       the kernel always starts at a character boundary. */
+    while(self->need && len) {
+        if(dsock_slow(utf8_scalar(self, buf, 1) < 0)) return -1;
+        buf++;
+        len--;
+    }
+    utf8_fn kernel = utf8_kernel();
+    if(kernel && len >= 32) {
+        int err;
+        size_t sz = kernel(buf, len, &err);
+        if(dsock_slow(err)) return -1;
+        /* Character split at the end of the validated part is validated
+           once again, this time together with its continuation bytes. */
+        sz -= utf8_incomplete(buf, sz);
+        buf += sz;
+        len -= sz;
+    }
+    return utf8_scalar(self, buf, len);
+}
+
@@ -30,9 +30,14 @@
 
 #include "dsock.h"
 #include "iol.h"
+#include "lz4/lz4.h"
+#include "mask.h"
+#include "timer.h"
+#include "utf8.h"
 #include "utils.h"
 
 dsock_unique_id(websock_type);
+dsock_unique_id(websock_frame_type);
 
 static void *websock_hquery(struct hvfs *hvfs, const void *type);
 static void websock_hclose(struct hvfs *hvfs);
@@ -41,6 +46,36 @@ static int websock_msendl(struct msock_vfs *mvfs,
 static ssize_t websock_mrecvl(struct msock_vfs *mvfs,
     struct iolist *first, struct iolist *last, int64_t deadline);
 
+/* Client messages are masked into txbuf, header first, so that small and
+   medium-sized messages are sent in a single underlying call. txbuf grows
+   with the size of the messages up to WEBSOCK_MAXTXBUF. Bigger messages
+   are sent in WEBSOCK_MAXTXBUF-sized chunks. */
+#define WEBSOCK_MINTXBUF 2048
+#define WEBSOCK_MAXTXBUF 65536
+
+/* Control frames are handled inline in the receive path. Pings are answered
+   by a pong, close frame is answered and the socket is shut down. The reply
+   is sent straight away if nothing else is being sent. Otherwise it's queued
+   and a short-lived coroutine sends it so that receiving doesn't wait for
+   a large message to be sent. Given that control frames are sent from other
+   coroutines than user's messages, frames being sent are serialised by
+   txbusy flag. Those who want to send while a frame is being sent wait
+   on txch.
+
+   Heartbeat is driven by a timer from the shared timer wheel. If nothing
+   was sent for hbinterval the same short-lived coroutine is launched to send
+   a ping. If nothing was received for hbtimeout receive fails.
+
+   Per-message compression is negotiated by a ping carrying WEBSOCK_LZ4OFFER
+   as its payload. Other peers simply answer it by a pong. Once a peer has
+   sent the offer it accepts compressed messages. Once it has received
+   the offer from the other side it may send them. Compressed message has
+   RSV1 bit set and its payload consists of 4-byte uncompressed size
+   followed by LZ4 block. Message is sent compressed only if it shrinks
+   by at least 1/WEBSOCK_LZ4RATIO. */
+#define WEBSOCK_LZ4OFFER "dsock-lz4"
+#define WEBSOCK_LZ4RATIO 8
+
 struct websock_sock {
     struct hvfs hvfs;
     struct msock_vfs mvfs;
@@ -48,9 +83,68 @@ struct websock_sock {
     int txerr;
     int rxerr;
     int client;
-    uint8_t txbuf[2048];
+    /* User allows outgoing messages to be masked in place. */
+    int inplace;
+    uint8_t *txbuf;
+    size_t txcap;
+    /* Fragmented message is being sent. */
+    int txcont;
+    /* Fragmented message is being received. */
+    int rxcont;
+    /* State of the frame being received. */
+    int rxinframe;
+    int rxfin;
+    uint64_t rxrmn;
+    uint8_t rxmask[4];
+    size_t rxmpos;
+    /* A frame is being sent. */
+    int txbusy;
+    /* Number of coroutines waiting to send a frame. */
+    int txwaiting;
+    int txch;
+    /* Close frame was already sent. */
+    int closesent;
+    /* Heartbeat. Negative values mean it's off. */
+    int64_t hbinterval;
+    int64_t hbtimeout;
+    int64_t last_send;
+    int64_t last_recv;
+    struct timer hbtimer;
+    /* Control frames to be sent by the background coroutine. */
+    int ping_due;
+    int pong_due;
+    uint8_t pong[125];
+    size_t pongsz;
+    int close_due;
+    uint8_t closecode[2];
+    size_t closesz;
+    /* Background coroutine is sending control frames. */
+    int sending;
+    /* Coroutine sending the last control frames. It may have already
+       finished. */
+    int sender;
+    /* Text messages are checked to be valid UTF-8. */
+    int utf8;
+    /* Text message is being received and it should be checked. */
+    int rxtext;
+    struct utf8_state rxutf8;
+    /* Compression was offered to the peer. */
+    int lz4;
+    /* Peer has offered compression. */
+    int peerlz4;
+    /* Shorter messages are never compressed. */
+    size_t lz4min;
+    uint8_t *txzbuf;
+    size_t txzcap;
+    uint8_t *rxzbuf;
+    size_t rxzcap;
+    /* Compressed message is being received. */
+    int rxlz4;
 };
 
+static coroutine void websock_sender(struct websock_sock *obj);
+static void websock_hbexpired(struct timer *timer);
+
 static void *websock_hquery(struct hvfs *hvfs, const void *type) {
     struct websock_sock *obj = (struct websock_sock*)hvfs;
     if(type == msock_type) return &obj->mvfs;
@@ -60,11 +154,12 @@ static void *websock_hquery(struct hvfs *hvfs, const void *type) {
 }
 
 int websock_attach(int s, int client) {
+    int err;
     /* Check whether underlying socket is a bytestream. */
-    if(dsock_slow(!hquery(s, bsock_type))) return -1;
+    if(dsock_slow(!hquery(s, bsock_type))) {err = errno; goto error1;}
     /* Create the object. */
     struct websock_sock *obj = malloc(sizeof(struct websock_sock));
-    if(dsock_slow(!obj)) {errno = ENOMEM; return -1;}
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
     obj->hvfs.query = websock_hquery;
     obj->hvfs.close = websock_hclose;
     obj->mvfs.msendl = websock_msendl;
@@ -73,49 +168,208 @@ int websock_attach(int s, int client) {
     obj->txerr = 0;
     obj->rxerr = 0;
     obj->client = client;
+    obj->inplace = 0;
+    obj->txbuf = NULL;
+    obj->txcap = 0;
+    obj->txcont = 0;
+    obj->rxcont = 0;
+    obj->rxinframe = 0;
+    obj->rxfin = 0;
+    obj->rxrmn = 0;
+    obj->rxmpos = 0;
+    obj->txbusy = 0;
+    obj->txwaiting = 0;
+    obj->closesent = 0;
+    obj->hbinterval = -1;
+    obj->hbtimeout = -1;
+    obj->last_send = 0;
+    obj->last_recv = 0;
+    timer_init(&obj->hbtimer, websock_hbexpired);
+    obj->ping_due = 0;
+    obj->pong_due = 0;
+    obj->pongsz = 0;
+    obj->close_due = 0;
+    obj->closesz = 0;
+    obj->sending = 0;
+    obj->sender = -1;
+    obj->utf8 = 0;
+    obj->rxtext = 0;
+    utf8_init(&obj->rxutf8);
+    obj->lz4 = 0;
+    obj->peerlz4 = 0;
+    obj->lz4min = 0;
+    obj->txzbuf = NULL;
+    obj->txzcap = 0;
+    obj->rxzbuf = NULL;
+    obj->rxzcap = 0;
+    obj->rxlz4 = 0;
+    obj->txch = chmake(sizeof(int));
+    if(dsock_slow(obj->txch < 0)) {err = errno; goto error2;}
     /* Create the handle. */
     int h = hmake(&obj->hvfs);
-    if(dsock_slow(h < 0)) {
-        int err = errno;
-        free(obj);
-        errno = err;
-        return -1;
-    }
+    if(dsock_slow(h < 0)) {err = errno; goto error3;}
     return h;
+error3:;
+    int rc = hclose(obj->txch);
+    dsock_assert(rc == 0);
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
 }
 
-int websock_detach(int s, int64_t deadline) {
-    int err;
+static int websock_free(struct websock_sock *obj) {
+    timer_rm(&obj->hbtimer);
+    if(obj->sender >= 0) {
+        int rc = hclose(obj->sender);
+        dsock_assert(rc == 0);
+    }
+    int rc = hclose(obj->txch);
+    dsock_assert(rc == 0);
+    int u = obj->s;
+    free(obj->txbuf);
+    free(obj->txzbuf);
+    free(obj->rxzbuf);
+    free(obj);
+    return u;
+}
+
+int websock_utf8(int s, int utf8) {
     struct websock_sock *obj = hquery(s, websock_type);
     if(dsock_slow(!obj)) return -1;
-    dsock_assert(0);
+    obj->utf8 = utf8;
+    return 0;
 }
 
-static int websock_msendl(struct msock_vfs *mvfs,
-      struct iolist *first, struct iolist *last, int64_t deadline) {
-    struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
-    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
-    size_t len;
-    int rc = iol_check(first, last, NULL, &len);
-    if(dsock_slow(rc < 0)) return -1;
-    /* Construct message header. */
-    uint8_t buf[12];
-    size_t sz;
-    buf[0] = 0x82;
+int websock_inplace(int s, int inplace) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->inplace = inplace;
+    return 0;
+}
+
+/* Makes sure that txbuf can hold sz bytes. If it can't be grown, whatever
+   is already allocated is used. */
+static int websock_txbuf(struct websock_sock *obj, size_t sz) {
+    sz = MAX(sz, WEBSOCK_MINTXBUF);
+    sz = MIN(sz, WEBSOCK_MAXTXBUF);
+    if(dsock_fast(obj->txcap >= sz)) return 0;
+    /* Grow exponentially so that slowly growing messages don't cause
+       a reallocation each time. */
+    size_t cap = MAX(obj->txcap * 2, WEBSOCK_MINTXBUF);
+    while(cap < sz) cap *= 2;
+    cap = MIN(cap, WEBSOCK_MAXTXBUF);
+    uint8_t *txbuf = realloc(obj->txbuf, cap);
+    if(dsock_slow(!txbuf)) {
+        if(obj->txcap) return 0;
+        errno = ENOMEM;
+        return -1;
+    }
+    obj->txbuf = txbuf;
+    obj->txcap = cap;
+    return 0;
+}
+
+/* Constructs unmasked frame header. op is the first byte of the header,
+   i.e. FIN bit and the opcode. Returns size of the header. */
+static size_t websock_hdr(uint8_t *buf, uint8_t op, size_t len) {
+    buf[0] = op;
     if(len > 0xffff) {
         buf[1] = 127;
         dsock_putll(buf + 2, len);
-        sz = 10;
+        return 10;
     }
-    else if(len > 125) {
+    if(len > 125) {
         buf[1] = 126;
         dsock_puts(buf + 2, len);
-        sz = 4;
+        return 4;
     }
-    else {
-        buf[1] = (uint8_t)len;
-        sz = 2;
+    buf[1] = (uint8_t)len;
+    return 2;
+}
+
+/* Gets exclusive access to the underlying socket for sending a frame. */
+static int websock_txlock(struct websock_sock *obj, int64_t deadline) {
+    while(dsock_slow(obj->txbusy)) {
+        obj->txwaiting++;
+        int dummy;
+        int rc = chrecv(obj->txch, &dummy, sizeof(dummy), deadline);
+        obj->txwaiting--;
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    obj->txbusy = 1;
+    return 0;
+}
+
+static void websock_txunlock(struct websock_sock *obj) {
+    obj->txbusy = 0;
+    /* Wake up one of the waiters, if any. */
+    int dummy = 0;
+    if(dsock_slow(obj->txwaiting))
+        chsend(obj->txch, &dummy, sizeof(dummy), 0);
+}
+
+/* Makes sure that the buffer can hold sz bytes. */
+static int websock_zbuf(uint8_t **buf, size_t *cap, size_t sz) {
+    if(dsock_fast(*cap >= sz)) return 0;
+    uint8_t *newbuf = realloc(*buf, sz);
+    if(dsock_slow(!newbuf)) {errno = ENOMEM; return -1;}
+    *buf = newbuf;
+    *cap = sz;
+    return 0;
+}
+
+/* Compresses the message into txzbuf. Returns 0 and leaves the message
+   alone if compressing it isn't worth it. */
+static int websock_pack(struct websock_sock *obj, struct iolist *first,
+      size_t len, struct iolist *iol) {
+    if(len == 0 || len < obj->lz4min || len > LZ4_MAX_INPUT_SIZE) return 0;
+    size_t bound = LZ4_compressBound(len);
+    /* Message scattered over several buffers has to be gathered first. */
+    size_t sz = 4 + bound + (first->iol_next ? len : 0);
+    int rc = websock_zbuf(&obj->txzbuf, &obj->txzcap, sz);
+    if(dsock_slow(rc < 0)) return 0;
+    const char *src = first->iol_base;
+    if(first->iol_next) {
+        uint8_t *pos = obj->txzbuf + 4 + bound;
+        struct iolist *it;
+        for(it = first; it; it = it->iol_next) {
+            memcpy(pos, it->iol_base, it->iol_len);
+            pos += it->iol_len;
+        }
+        src = (const char*)obj->txzbuf + 4 + bound;
     }
+    int csz = LZ4_compress_default(src, (char*)obj->txzbuf + 4, len, bound);
+    if(csz <= 0 || 4 + csz > len - len / WEBSOCK_LZ4RATIO) return 0;
+    dsock_putl(obj->txzbuf, len);
+    iol->iol_base = obj->txzbuf;
+    iol->iol_len = 4 + csz;
+    iol->iol_next = NULL;
+    iol->iol_rsvd = 0;
+    return 1;
+}
+
+/* Writes a single frame to the underlying socket. If RSV1 bit is set
+   in op the message is compressed, unless it doesn't pay off. */
+static int websock_writeframe(struct websock_sock *obj, uint8_t op,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    struct iolist ziol;
+    if(op & 0x40) {
+        if(websock_pack(obj, first, len, &ziol)) {
+            first = last = &ziol;
+            len = ziol.iol_len;
+        }
+        else {
+            op &= ~0x40;
+        }
+    }
+    /* Construct message header. There's space for the mask at the end. */
+    uint8_t buf[14];
+    size_t sz = websock_hdr(buf, op, len);
     /* Server sends unmasked message. */
     if(!obj->client) {
         struct iolist hdr = {buf, sz, first};
@@ -130,33 +384,43 @@ static int websock_msendl(struct msock_vfs *mvfs,
     buf[1] |= 0x80;
     memcpy(buf + sz, mask, 4);
     sz += 4;
-    /* TODO: It should be worth sending the header together with the first
-       batch of data. */
-    rc = bsend(obj->s, buf, sz, deadline);
-    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    /* User doesn't care about the content of the buffers after the call.
+       Mask them in place and send everything in one go. */
+    if(obj->inplace) {
+        mask_iol(first, mask, 0);
+        struct iolist hdr = {buf, sz, first};
+        rc = bsendl(obj->s, &hdr, last, deadline);
+        if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+        return 0;
+    }
+    rc = websock_txbuf(obj, sz + len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* The header goes out together with the first chunk of data. */
+    memcpy(obj->txbuf, buf, sz);
     struct iolist *it = first;
     size_t srcoff = 0;
-    size_t dstoff = 0;
-    int pos = 0;
+    size_t dstoff = sz;
+    size_t pos = 0;
     while(it) {
         size_t srcrmn = it->iol_len - srcoff;
-        size_t dstrmn = sizeof(obj->txbuf) - dstoff;
+        size_t dstrmn = obj->txcap - dstoff;
         if(srcrmn < dstrmn) {
-            memcpy(obj->txbuf + dstoff, it->iol_base + srcoff, srcrmn);
+            mask_apply(obj->txbuf + dstoff, it->iol_base + srcoff, srcrmn,
+                mask, pos);
             dstoff += srcrmn;
+            pos += srcrmn;
             it = it->iol_next;
             srcoff = 0;
             if(it) continue;
         }
         else {
-            memcpy(obj->txbuf + dstoff, it->iol_base + srcoff, dstrmn);
+            mask_apply(obj->txbuf + dstoff, it->iol_base + srcoff, dstrmn,
+                mask, pos);
             srcoff += dstrmn;
             dstoff += dstrmn;
+            pos += dstrmn;
         }
         /* Either txbuf is full or there's no more data to send. */
-        int i;
-        for(i = 0; i != dstoff; ++i, ++pos)
-            obj->txbuf[i] ^= mask[pos % 4];
         rc = bsend(obj->s, obj->txbuf, dstoff, deadline);
         if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
         dstoff = 0; 
@@ -164,85 +428,701 @@ static int websock_msendl(struct msock_vfs *mvfs,
     return 0;
 }
 
-static ssize_t websock_mrecvl(struct msock_vfs *mvfs,
+/* Sends a single frame. */
+static int websock_sendframe(struct websock_sock *obj, uint8_t op,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = websock_txlock(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    /* The error may have occurred while we were waiting. */
+    if(dsock_slow(obj->txerr)) {
+        websock_txunlock(obj); errno = obj->txerr; return -1;}
+    rc = websock_writeframe(obj, op, first, last, deadline);
+    websock_txunlock(obj);
+    if(dsock_slow(rc < 0)) return -1;
+    if(obj->hbinterval >= 0) obj->last_send = now();
+    return 0;
+}
+
+/* Sends a control frame. Payload of control frames is at most 125 bytes
+   long so the whole frame is assembled on the stack. */
+static int websock_sendctrl(struct websock_sock *obj, uint8_t op,
+      const uint8_t *payload, size_t len, int64_t deadline) {
+    dsock_assert(len <= 125);
+    if(dsock_slow(obj->txerr)) {errno = obj->txerr; return -1;}
+    int rc = websock_txlock(obj, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    if(dsock_slow(obj->txerr)) {
+        websock_txunlock(obj); errno = obj->txerr; return -1;}
+    uint8_t buf[6 + 125];
+    size_t sz = websock_hdr(buf, op, len);
+    if(obj->client) {
+        rc = dsock_random(buf + sz, 4, deadline);
+        if(dsock_slow(rc < 0)) {websock_txunlock(obj); return -1;}
+        buf[1] |= 0x80;
+        mask_apply(buf + sz + 4, payload, len, buf + sz, 0);
+        sz += 4;
+    }
+    else {
+        if(len) memcpy(buf + sz, payload, len);
+    }
+    rc = bsend(obj->s, buf, sz + len, deadline);
+    websock_txunlock(obj);
+    if(dsock_slow(rc < 0)) {obj->txerr = errno; return -1;}
+    if(obj->hbinterval >= 0) obj->last_send = now();
+    /* No data frames can be sent after the close frame. */
+    if((op & 0x0f) == 8) {
+        obj->closesent = 1;
+        obj->txerr = EPIPE;
+    }
+    return 0;
+}
+
+int websock_compress(int s, size_t threshold, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    obj->lz4min = threshold;
+    if(obj->lz4) return 0;
+    /* Compressed messages may arrive as soon as the offer is sent. */
+    obj->lz4 = 1;
+    return websock_sendctrl(obj, 0x89, (const uint8_t*)WEBSOCK_LZ4OFFER,
+        sizeof(WEBSOCK_LZ4OFFER) - 1, deadline);
+}
+
+/* Launches the coroutine to send pending control frames. */
+static int websock_kick(struct websock_sock *obj) {
+    if(obj->sending) return 0;
+    /* The previous sender has already finished given that it cleared
+       the sending flag as the last thing it did. */
+    if(obj->sender >= 0) {
+        int rc = hclose(obj->sender);
+        dsock_assert(rc == 0);
+    }
+    obj->sending = 1;
+    obj->sender = go(websock_sender(obj));
+    if(dsock_slow(obj->sender < 0)) {obj->sending = 0; return -1;}
+    return 0;
+}
+
+/* Answers a ping or a close frame. If a frame is being sent at the moment
+   the reply is handed over to the background coroutine. Only the latest
+   pong is kept. Failure to send shows up on the next send. */
+static void websock_reply(struct websock_sock *obj, uint8_t op,
+      const uint8_t *payload, size_t len, int64_t deadline) {
+    if(!obj->txbusy && !obj->sending) {
+        websock_sendctrl(obj, op, payload, len, deadline);
+        return;
+    }
+    if((op & 0x0f) == 8) {
+        memcpy(obj->closecode, payload, len);
+        obj->closesz = len;
+        obj->close_due = 1;
+    }
+    else {
+        memcpy(obj->pong, payload, len);
+        obj->pongsz = len;
+        obj->pong_due = 1;
+    }
+    websock_kick(obj);
+}
+
+static int websock_msendl(struct msock_vfs *mvfs,
       struct iolist *first, struct iolist *last, int64_t deadline) {
     struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
-    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
-    size_t len;
-    int rc = iol_check(first, last, NULL, &len);
+    /* Fragmented message is being sent at the moment. */
+    if(dsock_slow(obj->txcont)) {errno = EBUSY; return -1;}
+    uint8_t op = obj->lz4 && obj->peerlz4 ? 0xc2 : 0x82;
+    return websock_sendframe(obj, op, first, last, deadline);
+}
+
+int websock_sendfragl(int s, struct iolist *first, struct iolist *last,
+      int fin, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    /* First frame carries the opcode, subsequent ones are continuations. */
+    uint8_t op = obj->txcont ? 0x00 : 0x02;
+    if(fin) op |= 0x80;
+    int rc = websock_sendframe(obj, op, first, last, deadline);
     if(dsock_slow(rc < 0)) return -1;
-    size_t pos = 0;
-    while(1) {
-        uint8_t hdr1[2];
-        int rc = brecv(obj->s, hdr1, 2, deadline);
+    obj->txcont = !fin;
+    return 0;
+}
+
+int websock_sendfrag(int s, const void *buf, size_t len, int fin,
+      int64_t deadline) {
+    struct iolist iol = {(void*)buf, len, NULL, 0};
+    return websock_sendfragl(s, &iol, &iol, fin, deadline);
+}
+
+/* Reports invalid text. Peer is told so by close frame with status 1007. */
+static int websock_badutf8(struct websock_sock *obj, int64_t deadline) {
+    if(!obj->closesent && !obj->close_due) {
+        uint8_t status[2];
+        dsock_puts(status, 1007);
+        websock_reply(obj, 0x88, status, sizeof(status), deadline);
+    }
+    errno = obj->rxerr = EPROTO;
+    return -1;
+}
+
+/* Checks the received piece of text message. Validation continues where
+   the previous piece ended, even if it was a different frame. */
+static int websock_checkutf8(struct websock_sock *obj, struct iolist *first,
+      int64_t deadline) {
+    struct iolist *it;
+    for(it = first; it; it = it->iol_next) {
+        /* Data dropped by the user can't be checked. */
+        if(dsock_slow(!it->iol_base)) {obj->rxtext = 0; return 0;}
+        int rc = utf8_validate(&obj->rxutf8, it->iol_base, it->iol_len);
+        if(dsock_slow(rc < 0)) return websock_badutf8(obj, deadline);
+    }
+    return 0;
+}
+
+/* Handles a control frame. hdr is the first two bytes of the frame.
+   Returns -1 and EPIPE once the close frame is received. */
+static int websock_recvctrl(struct websock_sock *obj, const uint8_t *hdr,
+      int64_t deadline) {
+    /* Control frames are never fragmented and their payload is short. */
+    if(dsock_slow(!(hdr[0] & 0x80) || (hdr[1] & 0x7f) > 125)) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    if(!!(obj->client) ^ !(hdr[1] & 0x80)) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    size_t masksz = obj->client ? 0 : 4;
+    size_t sz = hdr[1] & 0x7f;
+    uint8_t buf[4 + 125];
+    if(masksz + sz > 0) {
+        int rc = brecv(obj->s, buf, masksz + sz, deadline);
         if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
-        if(hdr1[0] & 0x70) {errno = obj->rxerr = EPROTO; return -1;}
-        int opcode = hdr1[0] & 0x0f;
-        switch(opcode) {
-        case 0:
-        case 1:
-        case 2:
-            goto dataframe;
-        case 8:
-            /* TODO: close frame */
-            dsock_assert(0);
-        case 9:
-            /* TODO: ping frame */
-            dsock_assert(0);
-        case 10:
-            /* TODO: pong frame */
-            dsock_assert(0);
-        default:
-            errno = obj->rxerr = EPROTO;
+    }
+    uint8_t *payload = buf + masksz;
+    if(masksz) mask_apply(payload, payload, sz, buf, 0);
+    switch(hdr[0] & 0x0f) {
+    case 8:
+        /* Echo the status code back unless we've initiated the close
+           handshake ourselves. Error on sending is not interesting,
+           the connection is going down anyway. */
+        if(!obj->closesent && !obj->close_due)
+            websock_reply(obj, 0x88, payload, MIN(sz, 2), deadline);
+        errno = obj->rxerr = EPIPE;
+        return -1;
+    case 9:
+        if(sz == sizeof(WEBSOCK_LZ4OFFER) - 1 &&
+              memcmp(payload, WEBSOCK_LZ4OFFER, sz) == 0)
+            obj->peerlz4 = 1;
+        websock_reply(obj, 0x8a, payload, sz, deadline);
+        return 0;
+    case 10:
+        /* Pong is only interesting as a sign of life. */
+        return 0;
+    default:
+        errno = obj->rxerr = EPROTO;
+        return -1;
+    }
+}
+
+/* Receives header of the next data frame. Fills in the size of the frame,
+   its FIN bit and the mask. cont says whether continuation frame is
+   expected.
+
+   The underlying socket can't be asked for whatever data is available,
+   so reading ahead means reading everything that's known to follow
+   at the moment. Extended length and mask are read in a single call.
+   If the length of the frame is already known from the first two bytes
+   and the frame fits into len bytes available at offset pos of the iolist,
+   the mask and the payload are read in a single call as well. Returns
+   the number of payload bytes received that way. No byte beyond the end
+   of the frame is ever read, so the socket can be detached at any time. */
+static ssize_t websock_recvhdr(struct websock_sock *obj, int cont,
+      struct iolist *first, struct iolist *last, size_t pos, size_t len,
+      int64_t deadline) {
+    uint8_t hdr1[2];
+    int rc;
+    /* Control frames may be interspersed with the data frames. */
+    while(1) {
+        /* If heartbeat is on, peer is considered dead if nothing arrives
+           within the timeout. */
+        int64_t dd = deadline;
+        int hb = 0;
+        if(obj->hbtimeout >= 0) {
+            int64_t hbdd = obj->last_recv + obj->hbtimeout;
+            if(deadline < 0 || hbdd < deadline) {dd = hbdd; hb = 1;}
+        }
+        rc = brecv(obj->s, hdr1, 2, dd);
+        if(dsock_slow(rc < 0)) {
+            if(hb && errno == ETIMEDOUT) errno = ECONNRESET;
+            obj->rxerr = errno;
             return -1;
         }
-dataframe:
-        if(!!(obj->client) ^ !(hdr1[1] & 0x80)) {
+        if(obj->hbtimeout >= 0) obj->last_recv = now();
+        /* RSV1 is allowed only if compression was offered. */
+        uint8_t rsv = obj->lz4 ? 0x30 : 0x70;
+        if(hdr1[0] & rsv) {errno = obj->rxerr = EPROTO; return -1;}
+        int opcode = hdr1[0] & 0x0f;
+        if(!(opcode & 0x08)) {
+            if(dsock_slow(opcode == 0 && !cont)) {
+                errno = obj->rxerr = EPROTO; return -1;}
+            if(dsock_slow((opcode == 1 || opcode == 2) && cont)) {
+                errno = obj->rxerr = EPROTO; return -1;}
+            if(dsock_slow(opcode > 2)) {
+                errno = obj->rxerr = EPROTO; return -1;}
+            /* First frame of a message decides whether it's text and
+               whether it's compressed. */
+            if(opcode != 0) {
+                obj->rxtext = obj->utf8 && opcode == 1;
+                utf8_init(&obj->rxutf8);
+                obj->rxlz4 = !!(hdr1[0] & 0x40);
+            }
+            else if(dsock_slow(hdr1[0] & 0x40)) {
+                errno = obj->rxerr = EPROTO; return -1;}
+            break;
+        }
+        if(dsock_slow(hdr1[0] & 0x40)) {
             errno = obj->rxerr = EPROTO; return -1;}
-        size_t sz = hdr1[1] & 0x7f;
-        if(sz == 126) {
-            uint8_t hdr2[2];
-            int rc = brecv(obj->s, hdr2, 2, deadline);
-            if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
-            sz = dsock_gets(hdr2);
+        rc = websock_recvctrl(obj, hdr1, deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    if(!!(obj->client) ^ !(hdr1[1] & 0x80)) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    obj->rxfin = !!(hdr1[0] & 0x80);
+    obj->rxmpos = 0;
+    size_t masksz = obj->client ? 0 : 4;
+    uint64_t sz = hdr1[1] & 0x7f;
+    /* Compressed payload never goes directly to the user's buffers. */
+    if(sz < 126 && sz <= len && !obj->rxlz4) {
+        if(sz == 0 && masksz == 0) {obj->rxrmn = 0; return 0;}
+        struct iolist miol = {obj->rxmask, masksz, NULL, 0};
+        struct iol_slice slc;
+        struct iolist *ifirst = &miol;
+        struct iolist *ilast = &miol;
+        if(sz > 0) {
+            iol_slice_init(&slc, first, last, pos, sz);
+            miol.iol_next = &slc.first;
+            ilast = slc.last;
         }
-        else if(sz == 127) {
-            uint8_t hdr2[8];
-            int rc = brecv(obj->s, hdr2, 8, deadline);
-            if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
-            sz = dsock_getll(hdr2);
+        if(masksz == 0) ifirst = miol.iol_next;
+        rc = brecvl(obj->s, ifirst, ilast, deadline);
+        if(dsock_slow(rc < 0)) {
+            if(sz > 0) iol_slice_term(&slc);
+            obj->rxerr = errno;
+            return -1;
         }
-        uint8_t mask[4];
-        if(!obj->client) {
-            int rc = brecv(obj->s, mask, 4, deadline);
+        if(sz > 0 && masksz)
+            obj->rxmpos = mask_iol(&slc.first, obj->rxmask, 0);
+        if(sz > 0 && obj->rxtext)
+            rc = websock_checkutf8(obj, &slc.first, deadline);
+        if(sz > 0) iol_slice_term(&slc);
+        if(dsock_slow(rc < 0)) return -1;
+        obj->rxrmn = 0;
+        return sz;
+    }
+    uint8_t hdr2[12];
+    size_t extsz = sz == 126 ? 2 : sz == 127 ? 8 : 0;
+    if(extsz + masksz > 0) {
+        rc = brecv(obj->s, hdr2, extsz + masksz, deadline);
+        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+    }
+    if(extsz == 2) sz = dsock_gets(hdr2);
+    else if(extsz == 8) sz = dsock_getll(hdr2);
+    memcpy(obj->rxmask, hdr2 + extsz, masksz);
+    obj->rxrmn = sz;
+    return 0;
+}
+
+/* Receives sz bytes of the current frame into the iolist at offset pos.
+   Unmasking continues where the previous chunk of the frame ended. */
+static int websock_recvdata(struct websock_sock *obj, struct iolist *first,
+      struct iolist *last, size_t pos, size_t sz, int64_t deadline) {
+    if(sz == 0) return 0;
+    struct iol_slice slc;
+    iol_slice_init(&slc, first, last, pos, sz);
+    int rc = brecvl(obj->s, &slc.first, slc.last, deadline);
+    if(dsock_slow(rc < 0)) {
+        iol_slice_term(&slc);
+        obj->rxerr = errno;
+        return -1;
+    }
+    if(!obj->client)
+        obj->rxmpos = mask_iol(&slc.first, obj->rxmask, obj->rxmpos);
+    if(obj->rxtext) rc = websock_checkutf8(obj, &slc.first, deadline);
+    iol_slice_term(&slc);
+    if(dsock_slow(rc < 0)) return -1;
+    obj->rxrmn -= sz;
+    return 0;
+}
+
+/* Receives the rest of a compressed message, the header of its first frame
+   having been already read, and decompresses it into the iolist of len
+   bytes. */
+static ssize_t websock_recvlz4(struct websock_sock *obj, struct iolist *first,
+      struct iolist *last, size_t len, int64_t deadline) {
+    size_t maxsz = 4 + LZ4_compressBound(MIN(len, LZ4_MAX_INPUT_SIZE));
+    size_t csz = 0;
+    int rc;
+    while(1) {
+        if(dsock_slow(obj->rxrmn > maxsz - csz)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        size_t sz = obj->rxrmn;
+        rc = websock_zbuf(&obj->rxzbuf, &obj->rxzcap, csz + sz);
+        if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+        if(sz > 0) {
+            rc = brecv(obj->s, obj->rxzbuf + csz, sz, deadline);
             if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
+            if(!obj->client)
+                mask_apply(obj->rxzbuf + csz, obj->rxzbuf + csz, sz,
+                    obj->rxmask, 0);
         }
-        if(dsock_slow(sz > len)) {errno = obj->rxerr = EMSGSIZE; return -1;}
-        struct iol_slice slc;
-        iol_slice_init(&slc, first, last, pos, sz);
-        rc = brecvl(obj->s, &slc.first, slc.last, deadline);
-        iol_slice_term(&slc);
+        csz += sz;
+        obj->rxrmn = 0;
+        if(obj->rxfin) break;
+        ssize_t n = websock_recvhdr(obj, 1, first, last, 0, 0, deadline);
+        if(dsock_slow(n < 0)) return -1;
+    }
+    if(dsock_slow(csz < 4)) {errno = obj->rxerr = EPROTO; return -1;}
+    size_t sz = dsock_getl(obj->rxzbuf);
+    if(dsock_slow(sz > len)) {errno = obj->rxerr = EMSGSIZE; return -1;}
+    /* Decompress directly into user's buffer, if possible. */
+    uint8_t *dst = first->iol_base;
+    if(first->iol_next || !dst) {
+        rc = websock_zbuf(&obj->rxzbuf, &obj->rxzcap, csz + sz);
         if(dsock_slow(rc < 0)) {obj->rxerr = errno; return -1;}
-        if(!obj->client) {
-            /* Unmask the frame data. */
-            size_t i, mpos = 0;
-            struct iolist *it;
-            for(it = first; it; it = it->iol_next)
-                for(i = 0; i != it->iol_len; ++i)
-                    ((uint8_t*)it->iol_base)[i] ^= mask[mpos++ % 4];
+        dst = obj->rxzbuf + csz;
+    }
+    int dsz = LZ4_decompress_safe((char*)obj->rxzbuf + 4, (char*)dst,
+        csz - 4, sz);
+    if(dsock_slow(dsz < 0 || (size_t)dsz != sz)) {
+        errno = obj->rxerr = EPROTO; return -1;}
+    if(dst != first->iol_base) {
+        uint8_t *pos = dst;
+        size_t rmn = sz;
+        struct iolist *it;
+        for(it = first; it && rmn; it = it->iol_next) {
+            size_t n = MIN(it->iol_len, rmn);
+            if(it->iol_base) memcpy(it->iol_base, pos, n);
+            pos += n;
+            rmn -= n;
+        }
+    }
+    if(obj->rxtext) {
+        rc = utf8_validate(&obj->rxutf8, dst, sz);
+        if(dsock_slow(rc < 0)) return websock_badutf8(obj, deadline);
+    }
+    return sz;
+}
+
+static ssize_t websock_mrecvl(struct msock_vfs *mvfs,
+      struct iolist *first, struct iolist *last, int64_t deadline) {
+    struct websock_sock *obj = dsock_cont(mvfs, struct websock_sock, mvfs);
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    /* Fragmented message is being received at the moment. */
+    if(dsock_slow(obj->rxcont)) {errno = EBUSY; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    size_t pos = 0;
+    int cont = 0;
+    while(1) {
+        ssize_t n = websock_recvhdr(obj, cont, first, last, pos, len,
+            deadline);
+        if(dsock_slow(n < 0)) return -1;
+        if(obj->rxlz4) {
+            n = websock_recvlz4(obj, first, last, len, deadline);
+            if(dsock_slow(n < 0)) return -1;
+            pos = n;
+            break;
         }
+        pos += n;
+        len -= n;
+        if(dsock_slow(obj->rxrmn > len)) {
+            errno = obj->rxerr = EMSGSIZE; return -1;}
+        size_t sz = obj->rxrmn;
+        rc = websock_recvdata(obj, first, last, pos, sz, deadline);
+        if(dsock_slow(rc < 0)) return -1;
         pos += sz;
         len -= sz;
-        if(hdr1[0] & 0x80)
+        if(obj->rxfin)
             break;
+        cont = 1;
     }
+    /* Text must not end in the middle of a character. */
+    if(dsock_slow(obj->rxtext && !utf8_complete(&obj->rxutf8)))
+        return websock_badutf8(obj, deadline);
     return pos;
 }
 
+ssize_t websock_recvfragl(int s, struct iolist *first, struct iolist *last,
+      int *fin, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(obj->rxerr)) {errno = obj->rxerr; return -1;}
+    size_t len;
+    int rc = iol_check(first, last, NULL, &len);
+    if(dsock_slow(rc < 0)) return -1;
+    /* Start a new frame if the previous one was fully read. */
+    ssize_t n = 0;
+    if(!obj->rxinframe) {
+        n = websock_recvhdr(obj, obj->rxcont, first, last, 0, len, deadline);
+        if(dsock_slow(n < 0)) return -1;
+        /* Compressed messages can be received only as a whole. */
+        if(dsock_slow(obj->rxlz4)) {errno = obj->rxerr = ENOTSUP; return -1;}
+        obj->rxinframe = 1;
+        obj->rxcont = 1;
+    }
+    size_t sz = MIN(len - n, obj->rxrmn);
+    rc = websock_recvdata(obj, first, last, n, sz, deadline);
+    if(dsock_slow(rc < 0)) return -1;
+    sz += n;
+    int done = 0;
+    if(obj->rxrmn == 0) {
+        obj->rxinframe = 0;
+        if(obj->rxfin) {
+            obj->rxcont = 0;
+            done = 1;
+            if(dsock_slow(obj->rxtext && !utf8_complete(&obj->rxutf8)))
+                return websock_badutf8(obj, deadline);
+        }
+    }
+    if(fin) *fin = done;
+    return sz;
+}
+
+ssize_t websock_recvfrag(int s, void *buf, size_t len, int *fin,
+      int64_t deadline) {
+    struct iolist iol = {buf, len, NULL, 0};
+    return websock_recvfragl(s, &iol, &iol, fin, deadline);
+}
+
+/* Frame encoded once to be sent to many server sockets. The frame is
+   referenced by its handle and by broadcasts in progress so that closing
+   the handle in the middle of a broadcast is safe. */
+struct websock_frame {
+    struct hvfs hvfs;
+    int refs;
+    size_t len;
+    uint8_t data[];
+};
+
+static void *websock_frame_hquery(struct hvfs *hvfs, const void *type) {
+    struct websock_frame *obj = (struct websock_frame*)hvfs;
+    if(type == websock_frame_type) return obj;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+static void websock_frame_hclose(struct hvfs *hvfs) {
+    struct websock_frame *obj = (struct websock_frame*)hvfs;
+    if(!--obj->refs) free(obj);
+}
+
+int websock_frame(const void *buf, size_t len) {
+    int err;
+    if(dsock_slow(!buf && len)) {err = EINVAL; goto error1;}
+    uint8_t hdr[10];
+    size_t sz = websock_hdr(hdr, 0x82, len);
+    struct websock_frame *obj = malloc(sizeof(struct websock_frame) +
+        sz + len);
+    if(dsock_slow(!obj)) {err = ENOMEM; goto error1;}
+    obj->hvfs.query = websock_frame_hquery;
+    obj->hvfs.close = websock_frame_hclose;
+    obj->hvfs.done = NULL;
+    obj->refs = 1;
+    obj->len = sz + len;
+    memcpy(obj->data, hdr, sz);
+    if(len) memcpy(obj->data + sz, buf, len);
+    int h = hmake(&obj->hvfs);
+    if(dsock_slow(h < 0)) {err = errno; goto error2;}
+    return h;
+error2:
+    free(obj);
+error1:
+    errno = err;
+    return -1;
+}
+
+/* Sends the frame to a single socket. Returns the error, if any. */
+static int websock_bcastone(struct websock_frame *frame, int s,
+      int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    /* The socket may have been closed while we were sending. */
+    if(dsock_slow(!obj)) return errno;
+    if(dsock_slow(obj->txerr)) return obj->txerr;
+    if(dsock_slow(obj->txcont)) return EBUSY;
+    int rc = websock_txlock(obj, deadline);
+    if(dsock_slow(rc < 0)) return errno;
+    rc = bsend(obj->s, frame->data, frame->len, deadline);
+    websock_txunlock(obj);
+    if(dsock_slow(rc < 0)) return obj->txerr = errno;
+    if(obj->hbinterval >= 0) obj->last_send = now();
+    return 0;
+}
+
+static coroutine void websock_bcaster(struct websock_frame *frame, int s,
+      int ch, int64_t deadline) {
+    int err = websock_bcastone(frame, s, deadline);
+    chsend(ch, &err, sizeof(err), -1);
+}
+
+/* Each socket is sent to by a coroutine of its own so that a slow peer
+   doesn't hold up the others. A coroutine runs straight away until it
+   blocks, so sockets with space in their send buffers get the frame
+   before the next coroutine is launched. */
+int websock_broadcast(int f, const int *socks, size_t nsocks,
+      int64_t deadline) {
+    int err;
+    struct websock_frame *frame = hquery(f, websock_frame_type);
+    if(dsock_slow(!frame)) {err = errno; goto error1;}
+    if(dsock_slow(!socks && nsocks)) {err = EINVAL; goto error1;}
+    /* Check the sockets before anything is sent. Clients have to mask
+       each message with a different key so there's nothing to share. */
+    size_t i;
+    for(i = 0; i != nsocks; ++i) {
+        struct websock_sock *obj = hquery(socks[i], websock_type);
+        if(dsock_slow(!obj)) {err = errno; goto error1;}
+        if(dsock_slow(obj->client)) {err = EINVAL; goto error1;}
+    }
+    if(!nsocks) return 0;
+    int *crs = malloc(nsocks * sizeof(int));
+    if(dsock_slow(!crs)) {err = ENOMEM; goto error1;}
+    int ch = chmake(sizeof(int));
+    if(dsock_slow(ch < 0)) {err = errno; goto error2;}
+    frame->refs++;
+    err = 0;
+    size_t n;
+    for(n = 0; n != nsocks; ++n) {
+        crs[n] = go(websock_bcaster(frame, socks[n], ch, deadline));
+        if(dsock_slow(crs[n] < 0)) {err = errno; break;}
+    }
+    /* Collect the results. Each coroutine honours the deadline. */
+    for(i = 0; i != n; ++i) {
+        int e;
+        int rc = chrecv(ch, &e, sizeof(e), -1);
+        if(dsock_slow(rc < 0)) {err = errno; break;}
+        if(dsock_slow(e && !err)) err = e;
+    }
+    for(i = 0; i != n; ++i) {
+        int rc = hclose(crs[i]);
+        dsock_assert(rc == 0);
+    }
+    if(!--frame->refs) free(frame);
+    int rc = hclose(ch);
+    dsock_assert(rc == 0);
+    free(crs);
+    if(dsock_slow(err)) {errno = err; return -1;}
+    return 0;
+error2:
+    free(crs);
+error1:
+    errno = err;
+    return -1;
+}
+
+int websock_detach(int s, int64_t deadline) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    /* Perform the closing handshake. Send close frame with status 1000
+       (normal closure) and wait for peer's close frame, dropping any data
+       that arrive in the meantime. */
+    if(!obj->closesent) {
+        /* Close reply may still be waiting for the background coroutine. */
+        uint8_t status[2];
+        dsock_puts(status, 1000);
+        int rc = obj->close_due ?
+            websock_sendctrl(obj, 0x88, obj->closecode, obj->closesz,
+                deadline) :
+            websock_sendctrl(obj, 0x88, status, sizeof(status), deadline);
+        if(dsock_slow(rc < 0)) return -1;
+    }
+    while(!obj->rxerr) {
+        if(obj->rxrmn) {
+            struct iolist iol = {NULL, obj->rxrmn, NULL, 0};
+            int rc = brecvl(obj->s, &iol, &iol, deadline);
+            if(dsock_slow(rc < 0)) {obj->rxerr = errno; break;}
+            obj->rxrmn = 0;
+        }
+        struct iolist iol = {NULL, 0, NULL, 0};
+        websock_recvhdr(obj, obj->rxcont, &iol, &iol, 0, 0, deadline);
+        obj->rxcont = !obj->rxfin;
+    }
+    if(dsock_slow(obj->rxerr != EPIPE)) {errno = obj->rxerr; return -1;}
+    /* Nothing is ever read beyond the end of the close frame, so there
+       are no buffered data to lose. */
+    return websock_free(obj);
+}
+
+int websock_heartbeat(int s, int64_t interval, int64_t timeout) {
+    struct websock_sock *obj = hquery(s, websock_type);
+    if(dsock_slow(!obj)) return -1;
+    if(dsock_slow(interval == 0)) {errno = EINVAL; return -1;}
+    int64_t nw = now();
+    obj->hbinterval = interval;
+    obj->hbtimeout = timeout;
+    obj->last_send = nw;
+    obj->last_recv = nw;
+    if(interval < 0) {
+        timer_rm(&obj->hbtimer);
+        return 0;
+    }
+    return timer_add(&obj->hbtimer, nw + interval);
+}
+
+static coroutine void websock_sender(struct websock_sock *obj) {
+    uint8_t buf[125];
+    /* More control frames may become due while we are sending. */
+    while(1) {
+        int rc;
+        if(obj->close_due) {
+            obj->close_due = 0;
+            rc = websock_sendctrl(obj, 0x88, obj->closecode, obj->closesz,
+                -1);
+        }
+        else if(obj->pong_due) {
+            /* A newer ping may overwrite the payload while we are waiting
+               for the socket. */
+            obj->pong_due = 0;
+            size_t sz = obj->pongsz;
+            memcpy(buf, obj->pong, sz);
+            rc = websock_sendctrl(obj, 0x8a, buf, sz, -1);
+        }
+        else if(obj->ping_due) {
+            obj->ping_due = 0;
+            rc = websock_sendctrl(obj, 0x89, NULL, 0, -1);
+        }
+        else break;
+        if(dsock_slow(rc < 0 && errno == ECANCELED)) return;
+        /* Other errors are reported to the user on the next send. */
+    }
+    obj->sending = 0;
+    /* No more heartbeats are needed after an error. */
+    if(!obj->txerr && obj->hbinterval >= 0)
+        timer_add(&obj->hbtimer, obj->last_send + obj->hbinterval);
+}
+
+static void websock_hbexpired(struct timer *timer) {
+    struct websock_sock *obj = dsock_cont(timer, struct websock_sock,
+        hbtimer);
+    int64_t nw = now();
+    /* Something was sent in the meantime. */
+    if(nw < obj->last_send + obj->hbinterval) {
+        timer_add(&obj->hbtimer, obj->last_send + obj->hbinterval);
+        return;
+    }
+    /* User is sending a message at the moment. Check again later. */
+    if(obj->txbusy) {
+        timer_add(&obj->hbtimer, nw + obj->hbinterval);
+        return;
+    }
+    /* If the sender is running it picks the ping up and reschedules
+       the timer once it's done. */
+    obj->ping_due = 1;
+    int rc = websock_kick(obj);
+    /* Try again later. */
+    if(dsock_slow(rc < 0)) timer_add(&obj->hbtimer, nw + obj->hbinterval);
+}
+
 static void websock_hclose(struct hvfs *hvfs) {
     struct websock_sock *obj = (struct websock_sock*)hvfs;
-    int rc = hclose(obj->s);
+    int u = websock_free(obj);
+    int rc = hclose(u);
     dsock_assert(rc == 0);
-    free(obj);
 }
 